@@ -0,0 +1,101 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "batch.h"
+#include "compiler.h"
+#include "vm.h"
+
+// One script over many short inputs: compiled again for each input, as a
+// process per input does, against compiled once and run as a batch on 1 to
+// 8 worker threads.
+
+#define FUNCTIONS 300
+#define JOBS 2000
+#define MAX_WORKERS 8
+
+static char* generateSource(void) {
+    SourceText source = {0};
+    for (int i = 0; i < FUNCTIONS; i++) {
+        appendSource(&source,
+            "fwunction rule_%d(word) {\n"
+            "    if (len(word) %% %d == 0) return \"rule %d\";\n"
+            "    return none;\n"
+            "}\n",
+            i, i % 7 + 2, i);
+    }
+    appendSource(&source,
+        "var total = 0;\n"
+        "for (var i = 0; i < len(input); i = i + 1) {\n"
+        "    if (slice(input, i, i + 1) == \" \") total = total + 1;\n"
+        "}\n"
+        "var matched = rule_%d(input);\n"
+        "for i in range(2000) total = total + i %% 7;\n",
+        FUNCTIONS / 2);
+    return source.chars;
+}
+
+static char inputs[JOBS][32];
+static BatchJob jobs[JOBS];
+
+static void makeJobs(void) {
+    for (int i = 0; i < JOBS; i++) {
+        jobs[i].length = sprintf(inputs[i], "input %d of the batch", i);
+        jobs[i].input = inputs[i];
+    }
+}
+
+// What a process per input does, less starting the process.
+static bool compileEach(const char* source, double* seconds) {
+    char prefix[64];
+    double start = now();
+    for (int i = 0; i < JOBS; i++) {
+        VM* instance = newVM();
+        snprintf(prefix, sizeof(prefix), "var input = \"%.31s\";", inputs[i]);
+        InterpretResult result = interpretIn(instance, prefix);
+        if (result == INTERPRET_OK) result = interpretIn(instance, source);
+        destroyVM(instance);
+        if (result != INTERPRET_OK) return false;
+    }
+    *seconds = elapsed(start);
+    return true;
+}
+
+static bool runAsBatch(ObjFunction* function, int workers, double* seconds) {
+    double start = now();
+    int failed = runBatch(function, jobs, JOBS, workers, NULL);
+    *seconds = elapsed(start);
+    return failed == 0;
+}
+
+int main(void) {
+    char* source = generateSource();
+    makeJobs();
+
+    double each;
+    if (!compileEach(source, &each)) return 1;
+
+    initVM();
+    ObjFunction* function = compile(source);
+    if (function == NULL) return 1;
+
+    printf("%d jobs, %ld cores\n", JOBS, sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-16s %10s %10s %9s\n", "run", "wall s", "jobs/s", "speedup");
+    printf("%-16s %10.3f %10.0f %8.2fx\n", "compile each", each, JOBS / each, 1.0);
+    for (int workers = 1; workers <= MAX_WORKERS; workers *= 2) {
+        double seconds;
+        if (!runAsBatch(function, workers, &seconds)) {
+            fprintf(stderr, "a batch on %d threads failed\n", workers);
+            return 1;
+        }
+        printf("batch, %d thread%s %10.3f %10.0f %8.2fx\n", workers, workers == 1 ? " " : "s",
+               seconds, JOBS / seconds, each / seconds);
+    }
+
+    freeVM();
+    free(source);
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef pythowon_bench_h
+#define pythowon_bench_h
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// What the programs in bench/ share. Each includes this once, after
+// defining _DEFAULT_SOURCE for clock_gettime().
+
+// Wall time on a monotonic clock, in seconds. Threads and worker
+// processes count for what they take of it, not for their CPU time.
+static inline double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static inline double elapsed(double start) {
+    return now() - start;
+}
+
+// A generated script, grown as it is appended to. chars is always
+// terminated and is the caller's to free().
+typedef struct {
+    char* chars;
+    size_t length;
+    size_t capacity;
+} SourceText;
+
+static inline void appendSource(SourceText* source, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+
+    size_t needed = source->length + (size_t)length + 1;
+    if (needed > source->capacity) {
+        size_t capacity = source->capacity < 4096 ? 4096 : source->capacity;
+        while (capacity < needed) capacity *= 2;
+        source->chars = realloc(source->chars, capacity);
+        source->capacity = capacity;
+    }
+
+    va_start(args, format);
+    vsnprintf(source->chars + source->length, (size_t)length + 1, format, args);
+    va_end(args);
+    source->length += (size_t)length;
+}
+
+#endif
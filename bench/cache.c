@@ -0,0 +1,75 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "cache.h"
+#include "compiler.h"
+#include "vm.h"
+
+// Getting a large generated script ready to run: compiling it from
+// source, against loading what an earlier run stored in the cache. Both
+// include hashing the source, which a cache hit can't skip.
+
+#define FUNCTIONS 20000
+#define ROUNDS 5
+
+static char* generateSource(void) {
+    SourceText source = {0};
+    for (int i = 0; i < FUNCTIONS; i++) {
+        appendSource(&source,
+            "fwunction step_%d(x, scale = 2) {\n"
+            "    var total = 0;\n"
+            "    for i in range(x) total = total + i * scale;\n"
+            "    switch (x) {\n"
+            "        case 1: return \"one\";\n"
+            "        case 2: return \"two %d\";\n"
+            "    }\n"
+            "    if (total > 100) total = total - 100;\n"
+            "    return total + %d;\n"
+            "}\n",
+            i, i, i);
+    }
+    return source.chars;
+}
+
+int main(void) {
+    char* source = generateSource();
+    size_t length = strlen(source);
+    char directory[] = "/tmp/pythowon-bench-XXXXXX";
+    if (mkdtemp(directory) == NULL) return 1;
+
+    double compileTotal = 0, loadTotal = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        CacheEntry entry;
+        initVM();
+        double start = now();
+        if (!findCacheEntry(directory, source, length, &entry)) return 1;
+        ObjFunction* compiled = compile(source);
+        compileTotal += elapsed(start);
+        if (compiled == NULL || !storeCache(&entry, compiled)) return 1;
+        freeVM();
+
+        initVM();
+        start = now();
+        if (!findCacheEntry(directory, source, length, &entry)) return 1;
+        ObjFunction* loaded = loadCache(&entry);
+        loadTotal += elapsed(start);
+        freeVM();
+        if (loaded == NULL) return 1;
+
+        if (round == ROUNDS - 1) remove(entry.path);
+    }
+    rmdir(directory);
+
+    printf("%d functions, %.1f MB of source\n", FUNCTIONS, (double)length / (1024.0 * 1024.0));
+    printf("%-8s %10.3f s\n", "compile", compileTotal / ROUNDS);
+    printf("%-8s %10.3f s\n", "cached", loadTotal / ROUNDS);
+    printf("speedup  %9.2fx\n", compileTotal / loadTotal);
+
+    free(source);
+    return 0;
+}
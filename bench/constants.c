@@ -0,0 +1,96 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "compiler.h"
+#include "object.h"
+#include "vm.h"
+
+// Memory held by the compiled chunks of a large generated script, with
+// and without shared constants and trimmed arrays. Each side compiles in
+// a child process of its own, so the resident size it reports isn't
+// muddied by whatever the other side left in the allocator.
+
+#define FUNCTIONS 20000
+
+typedef struct {
+    long constants;
+    long bytes;         // allocated for code, lines and constants
+} ChunkSize;
+
+static char* generateSource(void) {
+    SourceText source = {0};
+    for (int i = 0; i < FUNCTIONS; i++) {
+        appendSource(&source,
+            "fwunction step_%d(x) {\n"
+            "    var scaled = x * 1.5 + 1.5;\n"
+            "    if (scaled > 100) scaled = scaled - 100;\n"
+            "    if (scaled < 0) scaled = 0;\n"
+            "    var label = \"step\";\n"
+            "    if (x == 1) label = \"one\";\n"
+            "    if (x == 2) label = \"two\";\n"
+            "    return scaled * 1.5 + x * 100 + %d;\n"
+            "}\n",
+            i, i);
+    }
+    return source.chars;
+}
+
+static void measure(const ObjFunction* function, ChunkSize* size) {
+    const Chunk* chunk = &function->chunk;
+    size->constants += chunk->constants.count;
+    size->bytes += (long)chunk->capacity * (long)sizeof(uint8_t) +
+                   (long)chunk->lineCapacity * (long)sizeof(LineRun) +
+                   (long)chunk->constants.capacity * (long)sizeof(Value);
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_FUNCTION(constant)) measure(AS_FUNCTION(constant), size);
+    }
+}
+
+static long residentKilobytes(void) {
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (statm == NULL) return 0;
+    long pages = 0, resident = 0;
+    if (fscanf(statm, "%ld %ld", &pages, &resident) != 2) resident = 0;
+    fclose(statm);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void run(const char* name, const char* source, bool compact) {
+    fflush(stdout);
+    pid_t child = fork();
+    if (child != 0) {
+        waitpid(child, NULL, 0);
+        return;
+    }
+
+    compilerOptions.compactChunks = compact;
+    initVM();
+    long before = residentKilobytes();
+    ObjFunction* function = compile(source);
+    long after = residentKilobytes();
+    if (function == NULL) exit(1);
+
+    ChunkSize size = {0, 0};
+    measure(function, &size);
+    printf("%-8s %10ld %10.1f MB %10.1f MB\n", name, size.constants,
+           (double)size.bytes / (1024.0 * 1024.0), (double)(after - before) / 1024.0);
+    exit(0);
+}
+
+int main(void) {
+    char* source = generateSource();
+
+    printf("%-8s %10s %13s %13s\n", "chunks", "constants", "chunk memory", "compile RSS");
+    run("plain", source, false);
+    run("compact", source, true);
+
+    free(source);
+    return 0;
+}
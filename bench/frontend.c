@@ -0,0 +1,76 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "compiler.h"
+#include "scanner.h"
+#include "vm.h"
+
+// Front-end throughput: scanning alone and scanning plus compiling a
+// generated multi-megabyte script, reported in MB/s of source.
+
+#define FUNCTIONS 20000
+
+static char* generateSource(size_t* length) {
+    SourceText source = {0};
+
+    appendSource(&source,
+        "#| Generated front-end benchmark input.\n"
+        "   Block comments, line comments, long runs of\n"
+        "   indentation and long identifiers all show up. |#\n\n");
+    for (int i = 0; i < FUNCTIONS; i++) {
+        appendSource(&source,
+            "# helper number %d\n"
+            "fwunction generated_helper_%d(first_argument, second_argument) {\n"
+            "        var accumulated_total = first_argument * %d + second_argument;\n"
+            "        var scaled_fraction = accumulated_total / 1024.0625;\n"
+            "        if (scaled_fraction > 12345.678) {\n"
+            "                accumulated_total = accumulated_total - %d;  # clamp\n"
+            "        }\n"
+            "        #| nothing interesting\n"
+            "           happens down here |#\n"
+            "        var label = \"helper %d produced a value\";\n"
+            "        return accumulated_total + 987654321;\n"
+            "}\n\n",
+            i, i, i % 97, i * 3, i);
+    }
+
+    *length = source.length;
+    return source.chars;
+}
+
+int main(void) {
+    size_t length;
+    char* source = generateSource(&length);
+    double megabytes = (double)length / (1024.0 * 1024.0);
+
+    int rounds = 5;
+    long tokens = 0;
+    double start = now();
+    for (int round = 0; round < rounds; round++) {
+        initScanner(source);
+        for (;;) {
+            Token token = scanToken();
+            if (token.decoded) free((char*)token.start);
+            tokens++;
+            if (token.type == TOKEN_EOF || token.type == TOKEN_ERROR) break;
+        }
+    }
+    double seconds = elapsed(start);
+    printf("scan     %6.1f MB x %d  %8.3f s  %8.1f MB/s  (%ld tokens)\n",
+           megabytes, rounds, seconds, megabytes * rounds / seconds, tokens / rounds);
+
+    initVM();
+    start = now();
+    ObjFunction* function = compile(source);
+    seconds = elapsed(start);
+    printf("compile  %6.1f MB      %8.3f s  %8.1f MB/s\n",
+           megabytes, seconds, megabytes / seconds);
+    freeVM();
+
+    free(source);
+    return function != NULL ? 0 : 1;
+}
@@ -0,0 +1,71 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "compiler.h"
+#include "vm.h"
+
+// A large generated script of which a run only calls a few functions:
+// the time until its first instruction runs, and for the whole run, with
+// every body compiled up front and with each compiled on its first call.
+
+#define FUNCTIONS 20000
+#define CALLED 20
+
+static char* generateSource(void) {
+    SourceText source = {0};
+    for (int i = 0; i < FUNCTIONS; i++) {
+        appendSource(&source,
+            "fwunction util_%d(x, scale = 2) {\n"
+            "    var total = 0;\n"
+            "    for (var i = 0; i < x; i = i + 1) {\n"
+            "        if (i %% 3 == 0) total = total + i * scale; else total = total - 1;\n"
+            "    }\n"
+            "    var label = \"util %d\";\n"
+            "    return total + %d;\n"
+            "}\n",
+            i, i, i);
+    }
+    appendSource(&source, "var sum = 0;\n");
+    for (int i = 0; i < CALLED; i++) {
+        appendSource(&source, "sum = sum + util_%d(1000);\n", i * (FUNCTIONS / CALLED));
+    }
+    return source.chars;
+}
+
+static bool run(const char* source, bool lazy, double* compileSeconds, double* totalSeconds) {
+    compilerOptions.lazy = lazy;
+    initVM();
+    double start = now();
+    ObjFunction* function = compile(source);
+    *compileSeconds = elapsed(start);
+    freeVM();
+    if (function == NULL) return false;
+
+    initVM();
+    start = now();
+    InterpretResult result = interpret(source);
+    *totalSeconds = elapsed(start);
+    freeVM();
+    return result == INTERPRET_OK;
+}
+
+int main(void) {
+    char* source = generateSource();
+    double eagerCompile, eagerTotal, lazyCompile, lazyTotal;
+    if (!run(source, false, &eagerCompile, &eagerTotal) ||
+        !run(source, true, &lazyCompile, &lazyTotal)) {
+        return 1;
+    }
+
+    printf("%d functions, %d called\n", FUNCTIONS, CALLED);
+    printf("%-8s %12s %10s\n", "bodies", "to first s", "total s");
+    printf("%-8s %12.3f %10.3f\n", "eager", eagerCompile, eagerTotal);
+    printf("%-8s %12.3f %10.3f\n", "lazy", lazyCompile, lazyTotal);
+    printf("speedup  %11.2fx %9.2fx\n", eagerCompile / lazyCompile, eagerTotal / lazyTotal);
+
+    free(source);
+    return 0;
+}
@@ -0,0 +1,79 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+
+#include "bench.h"
+#include "compiler.h"
+#include "passes.h"
+#include "vm.h"
+
+// Hot loops over configuration globals, run through the -O pipeline with
+// and without loop-invariant code motion.
+
+typedef struct {
+    const char* name;
+    const char* source;
+} Script;
+
+static const Script CORPUS[] = {
+    {"scale",
+     "var WIDTH = 640;\n"
+     "var SCALE = 3;\n"
+     "var OFFSET = 7;\n"
+     "var sum = 0;\n"
+     "for (var i = 0; i < WIDTH * 1000; i = i + 1) {\n"
+     "    sum = sum + i * SCALE + OFFSET;\n"
+     "}\n"},
+    {"nested",
+     "var ROWS = 400;\n"
+     "var COLS = 400;\n"
+     "var BIAS = 2;\n"
+     "var cells = 0;\n"
+     "for (var r = 0; r < ROWS; r = r + 1) {\n"
+     "    for (var c = 0; c < COLS; c = c + 1) cells = cells + BIAS * 2 + r;\n"
+     "}\n"},
+    {"function",
+     "var LIMIT = 300000;\n"
+     "var STEP = 1;\n"
+     "var THRESHOLD = 1000;\n"
+     "fwunction count() {\n"
+     "    var n = 0;\n"
+     "    var hits = 0;\n"
+     "    while (n < LIMIT) {\n"
+     "        if (n % THRESHOLD == 0) hits = hits + 1;\n"
+     "        n = n + STEP;\n"
+     "    }\n"
+     "    return hits;\n"
+     "}\n"
+     "var result = count();\n"},
+};
+
+#define CORPUS_SIZE (int)(sizeof(CORPUS) / sizeof(CORPUS[0]))
+
+static double run(const Script* script, const char* passes) {
+    selectPasses(passes);
+
+    initVM();
+    double start = now();
+    interpret(script->source);
+    double seconds = elapsed(start);
+    freeVM();
+    return seconds;
+}
+
+int main(void) {
+    compilerOptions.pipeline = true;
+    double totalOff = 0, totalOn = 0;
+
+    printf("%-10s %10s %10s %8s\n", "script", "off s", "on s", "speedup");
+    for (int i = 0; i < CORPUS_SIZE; i++) {
+        double off = run(&CORPUS[i], "fold,inline,dead");
+        double on = run(&CORPUS[i], "fold,inline,dead,licm");
+        printf("%-10s %10.3f %10.3f %7.2fx\n", CORPUS[i].name, off, on, off / on);
+        totalOff += off;
+        totalOn += on;
+    }
+
+    printf("total      %10.3f %10.3f %7.2fx\n", totalOff, totalOn, totalOff / totalOn);
+    return 0;
+}
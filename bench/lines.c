@@ -0,0 +1,71 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "compiler.h"
+#include "object.h"
+#include "vm.h"
+
+// Room taken by line numbers across a large generated script: what one
+// int per byte of code would need against the run-length table, next to
+// the code itself. Chunks are trimmed first so capacities are exact.
+
+#define FUNCTIONS 20000
+
+typedef struct {
+    long code;
+    long runs;
+    long runBytes;
+} LineSize;
+
+static char* generateSource(void) {
+    SourceText source = {0};
+    for (int i = 0; i < FUNCTIONS; i++) {
+        appendSource(&source,
+            "fwunction step_%d(x) {\n"
+            "    var scaled = x * 1.5 + %d;\n"
+            "    if (scaled > 100) scaled = scaled - 100;\n"
+            "    var total = 0;\n"
+            "    for (var i = 0; i < x; i = i + 1) total = total + i * scaled;\n"
+            "    if (total < 0) { print \"negative\"; total = 0; }\n"
+            "    return total + scaled;\n"
+            "}\n",
+            i, i);
+    }
+    return source.chars;
+}
+
+static void measure(const ObjFunction* function, LineSize* size) {
+    const Chunk* chunk = &function->chunk;
+    size->code += chunk->count;
+    size->runs += chunk->lineCount;
+    size->runBytes += (long)chunk->lineCapacity * (long)sizeof(LineRun);
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_FUNCTION(constant)) measure(AS_FUNCTION(constant), size);
+    }
+}
+
+int main(void) {
+    char* source = generateSource();
+
+    compilerOptions.compactChunks = true;
+    initVM();
+    ObjFunction* function = compile(source);
+    if (function == NULL) return 1;
+
+    LineSize size = {0, 0, 0};
+    measure(function, &size);
+    double perByte = (double)size.code * sizeof(int);
+    printf("%-12s %12ld bytes\n", "code", size.code);
+    printf("%-12s %12.0f bytes\n", "int per byte", perByte);
+    printf("%-12s %12ld bytes (%ld runs)\n", "line runs", size.runBytes, size.runs);
+    printf("%-12s %11.1f%%\n", "saved", 100.0 * (1.0 - (double)size.runBytes / perByte));
+
+    freeVM();
+    free(source);
+    return 0;
+}
@@ -0,0 +1,85 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "format.h"
+
+// Number to string throughput: the snprintf() path asString() used to take
+// against formatInteger()/formatDouble().
+
+#define COUNT 2000000
+
+static void report(const char* name, double seconds, size_t bytes) {
+    printf("%-28s %8.3f s %10.1f M/s  (checksum %zu)\n",
+           name, seconds, COUNT / seconds / 1e6, bytes);
+}
+
+int main(void) {
+    double* doubles = malloc(sizeof(double) * COUNT);
+    long* integers = malloc(sizeof(long) * COUNT);
+    srand(42);
+    for (int i = 0; i < COUNT; i++) {
+        doubles[i] = (double)rand() / RAND_MAX * (i % 7 == 0 ? 1e12 : 1000.0);
+        integers[i] = (long)rand() % (i % 3 == 0 ? 100 : 1000000000);
+    }
+
+    size_t bytes = 0;
+    double start = now();
+    for (int i = 0; i < COUNT; i++) {
+        char* chars = malloc(32);
+        bytes += snprintf(chars, 32, "%ld", integers[i]);
+        free(chars);
+    }
+    report("integer  malloc+snprintf", elapsed(start), bytes);
+
+    bytes = 0;
+    start = now();
+    for (int i = 0; i < COUNT; i++) {
+        char chars[FORMAT_INTEGER_MAX];
+        bytes += formatInteger(integers[i], chars);
+    }
+    report("integer  formatInteger", elapsed(start), bytes);
+
+    bytes = 0;
+    start = now();
+    for (int i = 0; i < COUNT; i++) {
+        char* chars = malloc(32);
+        bytes += snprintf(chars, 32, "%g", doubles[i]);
+        free(chars);
+    }
+    report("double   malloc+snprintf %g", elapsed(start), bytes);
+
+    bytes = 0;
+    start = now();
+    for (int i = 0; i < COUNT; i++) {
+        char chars[32];
+        bytes += snprintf(chars, 32, "%.17g", doubles[i]);
+    }
+    report("double   snprintf %.17g", elapsed(start), bytes);
+
+    bytes = 0;
+    start = now();
+    for (int i = 0; i < COUNT; i++) {
+        char chars[FORMAT_DOUBLE_MAX];
+        bytes += formatDouble(doubles[i], chars);
+    }
+    report("double   formatDouble", elapsed(start), bytes);
+
+    int lossy = 0;
+    int wrong = 0;
+    for (int i = 0; i < COUNT; i++) {
+        char chars[32];
+        snprintf(chars, 32, "%g", doubles[i]);
+        if (strtod(chars, NULL) != doubles[i]) lossy++;
+        formatDouble(doubles[i], chars);
+        if (strtod(chars, NULL) != doubles[i]) wrong++;
+    }
+    printf("values that do not round-trip: %%g %d, formatDouble %d\n", lossy, wrong);
+
+    free(doubles);
+    free(integers);
+    return wrong == 0 ? 0 : 1;
+}
@@ -0,0 +1,116 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+
+#include "bench.h"
+#include "compiler.h"
+#include "object.h"
+#include "peephole.h"
+#include "vm.h"
+
+// Instruction counts and run time for a small corpus of scripts, compiled
+// with and without the peephole pass. Counts are static (every function's
+// chunk, once) and include the script's own chunk.
+
+typedef struct {
+    const char* name;
+    const char* source;
+} Script;
+
+static const Script CORPUS[] = {
+    {"loops",
+     "var total = 0;\n"
+     "for (var i = 0; i < 300000; i = i + 1) {\n"
+     "    if (i % 3 == 0) continue;\n"
+     "    total = total + i;\n"
+     "}\n"
+     "var j = 0;\n"
+     "while (j < 300000) { j = j + 1; }\n"},
+    {"branches",
+     "var hits = 0;\n"
+     "var k = 0;\n"
+     "while (k < 200000) {\n"
+     "    if (k % 2 == 0 and k % 5 == 0) hits = hits + 1;\n"
+     "    else if (k % 7 == 0 or k % 11 == 0) hits = hits + 2;\n"
+     "    else hits = hits + 0;\n"
+     "    k = k + 1;\n"
+     "}\n"},
+    {"switch",
+     "var n = 0;\n"
+     "var s = 0;\n"
+     "while (n < 200000) {\n"
+     "    switch (n % 4) {\n"
+     "        case 0: s = s + 1;\n"
+     "        case 1: s = s + 2;\n"
+     "        case 2: s = s + 3;\n"
+     "        default: s = s + 4;\n"
+     "    }\n"
+     "    n = n + 1;\n"
+     "}\n"},
+    {"calls",
+     "fwunction fib(n) {\n"
+     "    if (n < 2) return n;\n"
+     "    return fib(n - 1) + fib(n - 2);\n"
+     "}\n"
+     "fwunction count(limit, step = 1) {\n"
+     "    var c = 0;\n"
+     "    var x = 0;\n"
+     "    while (x < limit) { x = x + step; c = c + 1; }\n"
+     "    return c;\n"
+     "}\n"
+     "var r = fib(22) + count(100000);\n"},
+};
+
+#define CORPUS_SIZE (int)(sizeof(CORPUS) / sizeof(CORPUS[0]))
+
+static void countCode(const ObjFunction* function, long* instructions, long* bytes) {
+    const Chunk* chunk = &function->chunk;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset])) {
+        (*instructions)++;
+    }
+    *bytes += chunk->count;
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        if (IS_OBJ(constant) && OBJ_TYPE(constant) == OBJ_FUNCTION) {
+            countCode(AS_FUNCTION(constant), instructions, bytes);
+        }
+    }
+}
+
+static void measure(const Script* script, bool peephole, long* instructions, long* bytes, double* seconds) {
+    compilerOptions.peephole = peephole;
+
+    initVM();
+    *instructions = 0;
+    *bytes = 0;
+    countCode(compile(script->source), instructions, bytes);
+    freeVM();
+
+    initVM();
+    double start = now();
+    interpret(script->source);
+    *seconds = elapsed(start);
+    freeVM();
+}
+
+int main(void) {
+    long totalBefore = 0, totalAfter = 0;
+
+    printf("%-10s %14s %14s %10s %10s\n", "script", "instructions", "bytes", "off s", "on s");
+    for (int i = 0; i < CORPUS_SIZE; i++) {
+        long instructionsOff, bytesOff, instructionsOn, bytesOn;
+        double off, on;
+        measure(&CORPUS[i], false, &instructionsOff, &bytesOff, &off);
+        measure(&CORPUS[i], true, &instructionsOn, &bytesOn, &on);
+
+        printf("%-10s %6ld -> %-5ld %6ld -> %-5ld %10.3f %10.3f\n",
+               CORPUS[i].name, instructionsOff, instructionsOn, bytesOff, bytesOn, off, on);
+        totalBefore += instructionsOff;
+        totalAfter += instructionsOn;
+    }
+
+    printf("total      %6ld -> %-5ld (%.1f%% fewer instructions)\n",
+           totalBefore, totalAfter, 100.0 * (double)(totalBefore - totalAfter) / (double)totalBefore);
+    return totalAfter <= totalBefore ? 0 : 1;
+}
@@ -0,0 +1,81 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+
+#include "bench.h"
+#include "vm.h"
+
+// Counted loops written C-style and as `for x in range(...)`, at the top
+// level and inside a function, where the counter is a local either way.
+
+typedef struct {
+    const char* name;
+    const char* cStyle;
+    const char* range;
+} Script;
+
+static const Script CORPUS[] = {
+    {"flat",
+     "var sum = 0;\n"
+     "for (var i = 0; i < 3000000; i = i + 1) sum = sum + i;\n",
+     "var sum = 0;\n"
+     "for i in range(3000000) sum = sum + i;\n"},
+    {"nested",
+     "fwunction cells() {\n"
+     "    var n = 0;\n"
+     "    for (var r = 0; r < 1500; r = r + 1) {\n"
+     "        for (var c = 0; c < 1500; c = c + 1) n = n + 1;\n"
+     "    }\n"
+     "    return n;\n"
+     "}\n"
+     "var result = cells();\n",
+     "fwunction cells() {\n"
+     "    var n = 0;\n"
+     "    for r in range(1500) {\n"
+     "        for c in range(1500) n = n + 1;\n"
+     "    }\n"
+     "    return n;\n"
+     "}\n"
+     "var result = cells();\n"},
+    {"stepped",
+     "fwunction evens() {\n"
+     "    var n = 0;\n"
+     "    for (var i = 10; i < 6000000; i = i + 2) n = n + i;\n"
+     "    return n;\n"
+     "}\n"
+     "var result = evens();\n",
+     "fwunction evens() {\n"
+     "    var n = 0;\n"
+     "    for i in range(10, 6000000, 2) n = n + i;\n"
+     "    return n;\n"
+     "}\n"
+     "var result = evens();\n"},
+};
+
+#define CORPUS_SIZE (int)(sizeof(CORPUS) / sizeof(CORPUS[0]))
+
+static double run(const char* source) {
+    initVM();
+    double start = now();
+    InterpretResult result = interpret(source);
+    double seconds = elapsed(start);
+    freeVM();
+    return result == INTERPRET_OK ? seconds : -1;
+}
+
+int main(void) {
+    double totalC = 0, totalRange = 0;
+
+    printf("%-10s %10s %10s %8s\n", "script", "for s", "range s", "speedup");
+    for (int i = 0; i < CORPUS_SIZE; i++) {
+        double cStyle = run(CORPUS[i].cStyle);
+        double range = run(CORPUS[i].range);
+        if (cStyle < 0 || range < 0) return 1;
+        printf("%-10s %10.3f %10.3f %7.2fx\n", CORPUS[i].name, cStyle, range, cStyle / range);
+        totalC += cStyle;
+        totalRange += range;
+    }
+
+    printf("total      %10.3f %10.3f %7.2fx\n", totalC, totalRange, totalC / totalRange);
+    return 0;
+}
@@ -0,0 +1,219 @@
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "compiler.h"
+#include "server.h"
+#include "vm.h"
+
+// A load generator for the server: request latency for a short script
+// with a lot of code, against starting a process to compile and run it
+// each time, and how much of the workers' memory is shared between them.
+
+#define FUNCTIONS 3000
+#define WORKERS 4
+#define CLIENTS 4
+#define REQUESTS 500
+#define PROCESS_RUNS 40
+
+static char* generateSource(const char* prelude) {
+    SourceText source = {0};
+    appendSource(&source, "%s", prelude);
+    for (int i = 0; i < FUNCTIONS; i++) {
+        appendSource(&source,
+            "fwunction rule_%d(word, weight = %d) {\n"
+            "    var total = 0;\n"
+            "    for (var i = 0; i < len(word); i = i + 1) {\n"
+            "        if (slice(word, i, i + 1) == \"%c\") total = total + weight;\n"
+            "    }\n"
+            "    return total;\n"
+            "}\n",
+            i, i % 5 + 1, 'a' + i % 26);
+    }
+    appendSource(&source,
+        "var score = 0;\n"
+        "for i in range(10) score = score + rule_%d(input);\n"
+        "print input + \": \" + score;\n",
+        FUNCTIONS / 2);
+    return source.chars;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void printLatencies(const char* label, double* latencies, int count) {
+    qsort(latencies, (size_t)count, sizeof(double), compareDoubles);
+    printf("%-18s %10.3f %10.3f %10d\n", label, latencies[count / 2] * 1000,
+           latencies[count * 99 / 100] * 1000, count);
+}
+
+static char socketPath[64];
+static double latencies[CLIENTS * REQUESTS];
+
+typedef struct {
+    double* times;
+    int failures;
+} Client;
+
+static void* runClient(void* argument) {
+    Client* client = argument;
+    OutputBuffer output;
+    OutputBuffer errors;
+    initOutput(&output, OUTPUT_MEMORY, 0);
+    initOutput(&errors, OUTPUT_MEMORY, 0);
+    for (int i = 0; i < REQUESTS; i++) {
+        double start = now();
+        int status = sendRequest(socketPath, "script", "abracadabra", 11, &output, &errors);
+        client->times[i] = elapsed(start);
+        if (status != 0) client->failures++;
+        output.count = 0;
+        errors.count = 0;
+    }
+    freeOutput(&output);
+    freeOutput(&errors);
+    return NULL;
+}
+
+static pid_t startServer(const char* source) {
+    fflush(stdout);
+    pid_t server = fork();
+    if (server != 0) return server;
+
+    initVM();
+    ServedScript script = {"script", compile(source)};
+    ServerOptions options = {socketPath, WORKERS};
+    _exit(script.function != NULL && runServer(&script, 1, &options) ? 0 : 1);
+}
+
+static bool waitForServer(void) {
+    OutputBuffer output;
+    initOutput(&output, OUTPUT_MEMORY, 0);
+    for (int i = 0; i < 500; i++) {
+        if (sendRequest(socketPath, "script", "", 0, &output, &output) >= 0) {
+            freeOutput(&output);
+            return true;
+        }
+        usleep(10000);
+    }
+    freeOutput(&output);
+    return false;
+}
+
+// Memory of the workers in kB, summed over them, from smaps_rollup.
+static void measureWorkers(pid_t server, long* shared, long* private) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/task/%d/children", (int)server, (int)server);
+    FILE* children = fopen(path, "r");
+    *shared = 0;
+    *private = 0;
+    if (children == NULL) return;
+
+    int worker;
+    while (fscanf(children, "%d", &worker) == 1) {
+        snprintf(path, sizeof(path), "/proc/%d/smaps_rollup", worker);
+        FILE* smaps = fopen(path, "r");
+        if (smaps == NULL) continue;
+        char line[128];
+        long kilobytes;
+        while (fgets(line, sizeof(line), smaps) != NULL) {
+            if (sscanf(line, "Shared_Clean: %ld", &kilobytes) == 1 ||
+                sscanf(line, "Shared_Dirty: %ld", &kilobytes) == 1) {
+                *shared += kilobytes;
+            } else if (sscanf(line, "Private_Dirty: %ld", &kilobytes) == 1) {
+                *private += kilobytes;
+            }
+        }
+        fclose(smaps);
+    }
+    fclose(children);
+}
+
+static bool runLoad(const char* source, long* shared, long* private) {
+    pid_t server = startServer(source);
+    if (server < 0 || !waitForServer()) return false;
+
+    pthread_t threads[CLIENTS];
+    Client clients[CLIENTS];
+    for (int i = 0; i < CLIENTS; i++) {
+        clients[i].times = &latencies[i * REQUESTS];
+        clients[i].failures = 0;
+        pthread_create(&threads[i], NULL, runClient, &clients[i]);
+    }
+    int failures = 0;
+    for (int i = 0; i < CLIENTS; i++) {
+        pthread_join(threads[i], NULL);
+        failures += clients[i].failures;
+    }
+    measureWorkers(server, shared, private);
+
+    kill(server, SIGTERM);
+    int status;
+    waitpid(server, &status, 0);
+    if (failures > 0) return false;
+    printLatencies("server", latencies, CLIENTS * REQUESTS);
+    return true;
+}
+
+// Each run starts the interpreter on the script, as a request would
+// without a server.
+static bool runProcesses(const char* source) {
+    if (access("PythOwOn", X_OK) != 0) return true;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/pythowon-bench-%d.owo", (int)getpid());
+    FILE* file = fopen(path, "w");
+    if (file == NULL) return false;
+    fputs(source, file);
+    fclose(file);
+
+    double times[PROCESS_RUNS];
+    bool ok = true;
+    for (int i = 0; i < PROCESS_RUNS && ok; i++) {
+        fflush(stdout);
+        double start = now();
+        pid_t child = fork();
+        if (child == 0) {
+            freopen("/dev/null", "w", stdout);
+            execl("./PythOwOn", "PythOwOn", "--no-cache", path, (char*)NULL);
+            _exit(127);
+        }
+        int status;
+        ok = child > 0 && waitpid(child, &status, 0) == child && WIFEXITED(status) &&
+             WEXITSTATUS(status) == 0;
+        times[i] = elapsed(start);
+    }
+    remove(path);
+    if (ok) printLatencies("process each", times, PROCESS_RUNS);
+    return ok;
+}
+
+int main(void) {
+    snprintf(socketPath, sizeof(socketPath), "/tmp/pythowon-bench-%d.sock", (int)getpid());
+    signal(SIGPIPE, SIG_IGN);
+    char* source = generateSource("");
+    char* standalone = generateSource("var input = \"abracadabra\";\n");
+
+    printf("%d functions, %d workers, %d clients\n", FUNCTIONS, WORKERS, CLIENTS);
+    printf("%-18s %10s %10s %10s\n", "requests", "p50 ms", "p99 ms", "count");
+    long shared, private;
+    if (!runProcesses(standalone) || !runLoad(source, &shared, &private)) {
+        fprintf(stderr, "the load failed\n");
+        return 1;
+    }
+
+    printf("workers' memory: %ld kB shared, %ld kB private\n", shared, private);
+
+    free(source);
+    free(standalone);
+    return 0;
+}
@@ -0,0 +1,84 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "compiler.h"
+#include "snapshot.h"
+#include "vm.h"
+
+// A script whose setup defines many functions and globals and builds its
+// lookup strings before main() does a little work: the time to get to the
+// end of main() by running the whole script, against loading a snapshot
+// taken after the setup and calling main() straight away.
+
+#define FUNCTIONS 5000
+#define ROUNDS 5
+
+static char* generateSource(void) {
+    SourceText source = {0};
+    for (int i = 0; i < FUNCTIONS; i++) {
+        appendSource(&source,
+            "fwunction handler_%d(x) {\n"
+            "    if (x > %d) return x - %d;\n"
+            "    return x + %d;\n"
+            "}\n"
+            "var key_%d = \"key\";\n"
+            "for i in range(%d) key_%d = key_%d + \"-\" + i;\n",
+            i, i, i, i, i, 4 + i % 8, i, i);
+    }
+    appendSource(&source,
+        "var weights = 0;\n"
+        "for i in range(2000000) weights = weights + i %% 7;\n"
+        "fwunction main() {\n"
+        "    var total = weights;\n"
+        "    for i in range(%d) total = total + handler_0(i);\n"
+        "    return total;\n"
+        "}\n",
+        FUNCTIONS);
+    return source.chars;
+}
+
+static bool callMain(void) {
+    Value main;
+    if (!tableGet(&vm->globals, OBJ_VAL(copyString("main", 4)), &main) || !IS_FUNCTION(main)) {
+        return false;
+    }
+    return interpretFunction(AS_FUNCTION(main)) == INTERPRET_OK;
+}
+
+int main(void) {
+    char* source = generateSource();
+    char path[] = "/tmp/pythowon-snapshot-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0) return 1;
+    close(fd);
+
+    double scriptTotal = 0, snapshotTotal = 0;
+    for (int round = 0; round < ROUNDS; round++) {
+        initVM();
+        double start = now();
+        bool ran = interpret(source) == INTERPRET_OK && callMain();
+        scriptTotal += elapsed(start);
+        if (!ran || !saveSnapshot(path)) return 1;
+        freeVM();
+
+        initVM();
+        start = now();
+        ran = loadSnapshot(path) && callMain();
+        snapshotTotal += elapsed(start);
+        freeVM();
+        if (!ran) return 1;
+    }
+    remove(path);
+
+    printf("%-10s %10s\n", "start", "s to main");
+    printf("%-10s %10.3f\n", "script", scriptTotal / ROUNDS);
+    printf("%-10s %10.3f\n", "snapshot", snapshotTotal / ROUNDS);
+    printf("speedup    %9.2fx\n", scriptTotal / snapshotTotal);
+
+    free(source);
+    return 0;
+}
@@ -0,0 +1,72 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+
+#include "bench.h"
+#include "format.h"
+#include "object.h"
+#include "vm.h"
+
+// String building with counters mixed in: asString() on small integers,
+// booleans and none against formatting and interning them every time, plus
+// a script that concatenates a loop counter into a string.
+
+#define COUNT 2000000
+
+static const char* SCRIPT =
+    "var i = 0;\n"
+    "var line = \"\";\n"
+    "while (i < 300000) {\n"
+    "    line = \"row \" + (i % 512) + \" done \" + true + \" next \" + none;\n"
+    "    i = i + 1;\n"
+    "}\n";
+
+static ObjString* uncachedAsString(Value value) {
+    char chars[FORMAT_INTEGER_MAX];
+    switch (value.type) {
+        case VAL_BOOL:
+            return AS_BOOL(value) ? copyString("true", 4) : copyString("false", 5);
+        case VAL_NONE: return copyString("none", 4);
+        default: {
+            int length = formatInteger((long)AS_INTEGER(value), chars);
+            return copyString(chars, length);
+        }
+    }
+}
+
+static Value sample(int i) {
+    switch (i % 4) {
+        case 0: return BOOL_VAL(i % 8 == 0);
+        case 1: return NONE_VAL;
+        default: return INTEGER_VAL((ulong)(i % 1000));
+    }
+}
+
+int main(void) {
+    initVM();
+
+    size_t bytes = 0;
+    double start = now();
+    for (int i = 0; i < COUNT; i++) {
+        bytes += uncachedAsString(sample(i))->length;
+    }
+    double uncached = elapsed(start);
+    printf("asString  format+intern    %8.3f s %8.1f M/s  (checksum %zu)\n",
+           uncached, COUNT / uncached / 1e6, bytes);
+
+    bytes = 0;
+    start = now();
+    for (int i = 0; i < COUNT; i++) {
+        bytes += asString(sample(i))->length;
+    }
+    double cached = elapsed(start);
+    printf("asString  cached           %8.3f s %8.1f M/s  (checksum %zu)\n",
+           cached, COUNT / cached / 1e6, bytes);
+
+    start = now();
+    InterpretResult result = interpret(SCRIPT);
+    printf("script    counter concat   %8.3f s\n", elapsed(start));
+
+    freeVM();
+    return result == INTERPRET_OK ? 0 : 1;
+}
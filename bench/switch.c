@@ -0,0 +1,74 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+
+#include "bench.h"
+#include "vm.h"
+
+// A 200-case switch hit on every case in turn, once with literal labels,
+// which dispatch through a table, and once with a leading case that has
+// to be compared at runtime, which turns the rest into a comparison chain.
+
+#define CASES 200
+#define SOURCE_MAX (64 * 1024)
+
+typedef enum {
+    LABELS_DENSE,
+    LABELS_SPARSE,
+    LABELS_STRING,
+} Labels;
+
+static int label(char* out, Labels labels, int i) {
+    switch (labels) {
+        case LABELS_DENSE: return sprintf(out, "%d", i);
+        case LABELS_SPARSE: return sprintf(out, "%d", i * 7919);
+        default: return sprintf(out, "\"key%d\"", i);
+    }
+}
+
+static void buildScript(char* source, Labels labels, bool chain) {
+    char* out = source;
+    out += sprintf(out, "var keys = 0;\nvar total = 0;\nvar never = -1;\n");
+    out += sprintf(out, "fwunction pick(k) {\n    switch (k) {\n");
+    if (chain) out += sprintf(out, "        case never: return -1;\n");
+    for (int i = 0; i < CASES; i++) {
+        out += sprintf(out, "        case ");
+        out += label(out, labels, i);
+        out += sprintf(out, ": return %d;\n", i);
+    }
+    out += sprintf(out, "    }\n    return 0;\n}\n");
+
+    // Every label in turn, from the script's own list of them.
+    out += sprintf(out, "for (var round = 0; round < 150; round = round + 1) {\n");
+    for (int i = 0; i < CASES; i++) {
+        out += sprintf(out, "    total = total + pick(");
+        out += label(out, labels, i);
+        out += sprintf(out, ");\n");
+    }
+    sprintf(out, "}\n");
+}
+
+static double run(const char* source) {
+    initVM();
+    double start = now();
+    InterpretResult result = interpret(source);
+    double seconds = elapsed(start);
+    freeVM();
+    return result == INTERPRET_OK ? seconds : -1;
+}
+
+int main(void) {
+    static char source[SOURCE_MAX];
+    static const char* names[] = {"dense", "sparse", "string"};
+
+    printf("%-8s %10s %10s %8s\n", "labels", "chain s", "table s", "speedup");
+    for (int labels = LABELS_DENSE; labels <= LABELS_STRING; labels++) {
+        buildScript(source, (Labels)labels, true);
+        double chain = run(source);
+        buildScript(source, (Labels)labels, false);
+        double table = run(source);
+        if (chain < 0 || table < 0) return 1;
+        printf("%-8s %10.3f %10.3f %7.2fx\n", names[labels], chain, table, chain / table);
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "vm.h"
+
+// Separate VMs, each compiling and running the same script on a thread of
+// its own: the wall time for 1 to 8 of them at once, and how many times
+// the work of one they get through in the time one takes. That is the
+// thread count while there are cores to spare.
+
+#define ITERATIONS 1000000
+#define MAX_THREADS 8
+
+static char source[1024];
+
+static void generateSource(void) {
+    long expected = 0;
+    for (long i = 0; i < ITERATIONS; i++) {
+        expected += i % 3 == 0 ? i : -1;
+    }
+    // A wrong total reads an undefined global, so the run fails.
+    snprintf(source, sizeof(source),
+        "fwunction work(n) {\n"
+        "    var total = 0;\n"
+        "    for (var i = 0; i < n; i = i + 1) {\n"
+        "        if (i %% 3 == 0) total = total + i; else total = total - 1;\n"
+        "    }\n"
+        "    return total;\n"
+        "}\n"
+        "var label = \"\";\n"
+        "for (var i = 0; i < 1000; i = i + 1) label = \"run \" + i;\n"
+        "if (work(%d) != %ld) wrongTotal;\n",
+        ITERATIONS, expected);
+}
+
+static void* runOne(void* result) {
+    VM* instance = newVM();
+    *(InterpretResult*)result = interpretIn(instance, source);
+    destroyVM(instance);
+    return NULL;
+}
+
+static bool runThreads(int count, double* seconds) {
+    pthread_t threads[MAX_THREADS];
+    InterpretResult results[MAX_THREADS];
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        if (pthread_create(&threads[i], NULL, runOne, &results[i]) != 0) return false;
+    }
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+        ok = ok && results[i] == INTERPRET_OK;
+    }
+    *seconds = elapsed(start);
+    return ok;
+}
+
+int main(void) {
+    generateSource();
+
+    printf("%ld cores\n", sysconf(_SC_NPROCESSORS_ONLN));
+    printf("%-8s %10s %10s\n", "threads", "wall s", "scaling");
+    double single = 0;
+    for (int count = 1; count <= MAX_THREADS; count *= 2) {
+        double seconds;
+        if (!runThreads(count, &seconds)) {
+            fprintf(stderr, "a run with %d threads failed\n", count);
+            return 1;
+        }
+        if (count == 1) single = seconds;
+        printf("%-8d %10.3f %9.2fx\n", count, seconds, count * single / seconds);
+    }
+    return 0;
+}
@@ -0,0 +1,271 @@
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#include "arith.h"
+#include "memory.h"
+#include "object.h"
+
+// Integers are unsigned and stay integers under +, * and the integer-only
+// operators. Anything involving a double, and all division, is done in
+// doubles. Negation always gives a double.
+
+static double toDouble(Value value) {
+    return IS_INTEGER(value) ? (double)AS_INTEGER(value) : AS_NUMBER(value);
+}
+
+static bool fail(OperationError* error, const char* type, const char* message) {
+    error->type = type;
+    error->message = message;
+    return false;
+}
+
+static Value concatenate(Value a, Value b) {
+    if (!IS_STRINGLIKE(b)) b = OBJ_VAL(asString(b));
+
+    int aLength = stringLength(a);
+    int bLength = stringLength(b);
+    int length = aLength + bLength;
+    char* chars = ALLOCATE(char, length + 1);
+    memcpy(chars, stringChars(a), aLength);
+    memcpy(chars + aLength, stringChars(b), bLength);
+    chars[length] = '\0';
+
+    return OBJ_VAL(takeString(chars, length));
+}
+
+static bool repeat(Value string, ulong times, Value* result, OperationError* error) {
+    const char* part = stringChars(string);
+    int partLength = stringLength(string);
+    if (partLength > 0 && times > (ulong)(INT_MAX / partLength)) {
+        return fail(error, "ValueError: ", "Repeated string is too long.");
+    }
+    int length = (int)times * partLength;
+
+    char* chars = ALLOCATE(char, length + 1);
+    for (int i = 0; i < length; i += partLength) {
+        memcpy(chars + i, part, partLength);
+    }
+    chars[length] = '\0';
+
+    *result = OBJ_VAL(takeString(chars, length));
+    return true;
+}
+
+bool binaryOperation(OpCode op, Value a, Value b, Value* result, OperationError* error) {
+    switch (op) {
+        case OP_EQUAL:
+            *result = BOOL_VAL(valuesEqual(a, b));
+            return true;
+
+        case OP_ADD:
+            if (IS_STRINGLIKE(a)) {
+                *result = concatenate(a, b);
+                return true;
+            }
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                return fail(error, "ValueError: ",
+                            "Operands must be two numbers or first operand must be a string.");
+            }
+            if (IS_INTEGER(a) && IS_INTEGER(b)) {
+                *result = INTEGER_VAL(AS_INTEGER(a) + AS_INTEGER(b));
+            } else {
+                *result = NUMBER_VAL(toDouble(a) + toDouble(b));
+            }
+            return true;
+
+        case OP_MULTIPLY:
+            if (IS_STRINGLIKE(a)) {
+                if (!IS_INTEGER(b)) {
+                    return fail(error, "ValueError: ",
+                                "A string can only be repeated a whole number of times.");
+                }
+                return repeat(a, AS_INTEGER(b), result, error);
+            }
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                return fail(error, "ValueError: ",
+                            "Operands must be two numbers or first operand must be a string.");
+            }
+            if (IS_INTEGER(a) && IS_INTEGER(b)) {
+                *result = INTEGER_VAL(AS_INTEGER(a) * AS_INTEGER(b));
+            } else {
+                *result = NUMBER_VAL(toDouble(a) * toDouble(b));
+            }
+            return true;
+
+        case OP_DIVIDE:
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                return fail(error, "ValueError: ", "Operands must be numbers.");
+            }
+            if (toDouble(b) == 0) {
+                return fail(error, "ZeroDivisionError: ", "Division by zero.");
+            }
+            *result = NUMBER_VAL(toDouble(a) / toDouble(b));
+            return true;
+
+        case OP_GREATER:
+        case OP_LESS: {
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+                return fail(error, "ValueError: ", "Operands must be numbers.");
+            }
+            bool less;
+            bool greater;
+            if (IS_INTEGER(a) && IS_INTEGER(b)) {
+                less = AS_INTEGER(a) < AS_INTEGER(b);
+                greater = AS_INTEGER(a) > AS_INTEGER(b);
+            } else {
+                less = toDouble(a) < toDouble(b);
+                greater = toDouble(a) > toDouble(b);
+            }
+            *result = BOOL_VAL(op == OP_LESS ? less : greater);
+            return true;
+        }
+
+        case OP_MODULO:
+        case OP_LEFTSHIFT:
+        case OP_RIGHTSHIFT: {
+            if (!IS_INTEGER(a) || !IS_INTEGER(b)) {
+                return fail(error, "ValueError: ", "Operands must be Integers.");
+            }
+            ulong x = AS_INTEGER(a);
+            ulong y = AS_INTEGER(b);
+            if (op == OP_MODULO) {
+                if (y == 0) return fail(error, "ZeroDivisionError: ", "Modulo by zero.");
+                *result = INTEGER_VAL(x % y);
+            } else if (y >= sizeof(ulong) * CHAR_BIT) {
+                *result = INTEGER_VAL(0);
+            } else {
+                *result = INTEGER_VAL(op == OP_LEFTSHIFT ? x << y : x >> y);
+            }
+            return true;
+        }
+
+        default:
+            return fail(error, "ValueError: ", "Unknown binary operator.");
+    }
+}
+
+bool unaryOperation(OpCode op, Value a, Value* result, OperationError* error) {
+    switch (op) {
+        case OP_NOT:
+            *result = BOOL_VAL(isFalsey(a));
+            return true;
+
+        case OP_NEGATE:
+            if (!IS_NUMBER(a)) {
+                return fail(error, "ValueError: ", "Operand must be a number.");
+            }
+            *result = NUMBER_VAL(-toDouble(a));
+            return true;
+
+        default:
+            return fail(error, "ValueError: ", "Unknown unary operator.");
+    }
+}
+
+static bool foldable(Value value) {
+    return !IS_STRINGLIKE(value) || stringLength(value) <= FOLD_STRING_MAX;
+}
+
+static bool foldBinary(OpCode op, Value a, Value* value) {
+    OperationError error;
+    Value result;
+    if (!binaryOperation(op, a, *value, &result, &error) || !foldable(result)) return false;
+    *value = result;
+    return true;
+}
+
+static bool foldUnary(OpCode op, Value* value) {
+    OperationError error;
+    Value result;
+    if (!unaryOperation(op, *value, &result, &error)) return false;
+    *value = result;
+    return true;
+}
+
+// Follows the instruction sequences the compiler emits for each operator,
+// e.g. a - b is OP_NEGATE then OP_ADD.
+bool foldBinaryOperator(TokenType op, Value a, Value b, Value* result) {
+    Value value = b;
+    bool folded;
+    switch (op) {
+        case TOKEN_EXCLAM_EQ:
+            folded = foldBinary(OP_EQUAL, a, &value) && foldUnary(OP_NOT, &value);
+            break;
+        case TOKEN_EQ_EQ:      folded = foldBinary(OP_EQUAL, a, &value); break;
+        case TOKEN_GREATER:    folded = foldBinary(OP_GREATER, a, &value); break;
+        case TOKEN_GREATER_EQ:
+            folded = foldBinary(OP_LESS, a, &value) && foldUnary(OP_NOT, &value);
+            break;
+        case TOKEN_LESS:       folded = foldBinary(OP_LESS, a, &value); break;
+        case TOKEN_LESS_EQ:
+            folded = foldBinary(OP_GREATER, a, &value) && foldUnary(OP_NOT, &value);
+            break;
+        case TOKEN_PLUS:       folded = foldBinary(OP_ADD, a, &value); break;
+        case TOKEN_MINUS:
+            folded = foldUnary(OP_NEGATE, &value) && foldBinary(OP_ADD, a, &value);
+            break;
+        case TOKEN_STAR:       folded = foldBinary(OP_MULTIPLY, a, &value); break;
+        case TOKEN_SLASH:      folded = foldBinary(OP_DIVIDE, a, &value); break;
+        case TOKEN_PERCENT:    folded = foldBinary(OP_MODULO, a, &value); break;
+        case TOKEN_LSHIFT:     folded = foldBinary(OP_LEFTSHIFT, a, &value); break;
+        case TOKEN_RSHIFT:     folded = foldBinary(OP_RIGHTSHIFT, a, &value); break;
+        default:               folded = false; break;
+    }
+
+    if (folded) *result = value;
+    return folded;
+}
+
+bool foldUnaryOperator(TokenType op, Value a, Value* result) {
+    Value value = a;
+    if (!foldUnary(op == TOKEN_EXCLAM ? OP_NOT : OP_NEGATE, &value)) return false;
+    *result = value;
+    return true;
+}
+
+OperandKind operandKind(Value value) {
+    if (IS_INTEGER(value)) return KIND_INTEGER;
+    if (IS_DOUBLE(value)) return KIND_DOUBLE;
+    return KIND_UNKNOWN;
+}
+
+static bool isNumberKind(OperandKind kind) {
+    return kind == KIND_INTEGER || kind == KIND_DOUBLE || kind == KIND_NUMBER;
+}
+
+// Type of `a op b` when it can be told from the operand types alone.
+OperandKind resultKind(TokenType op, OperandKind a, OperandKind b) {
+    switch (op) {
+        case TOKEN_PERCENT:
+        case TOKEN_LSHIFT:
+        case TOKEN_RSHIFT: return KIND_INTEGER;
+        case TOKEN_SLASH: return KIND_DOUBLE;
+        case TOKEN_MINUS: return isNumberKind(a) ? KIND_DOUBLE : KIND_UNKNOWN;
+        case TOKEN_PLUS:
+        case TOKEN_STAR:
+            if (!isNumberKind(a) || !isNumberKind(b)) return KIND_UNKNOWN;
+            if (a == KIND_INTEGER && b == KIND_INTEGER) return KIND_INTEGER;
+            if (a == KIND_DOUBLE || b == KIND_DOUBLE) return KIND_DOUBLE;
+            return KIND_NUMBER;
+        default: return KIND_UNKNOWN;
+    }
+}
+
+// x * 1 for any number, x + 0 for integers, and x - 0 and x / 1 for
+// doubles are x itself, bit for bit. Other identities (x + 0 on a double
+// turns -0 into 0, x / 1 turns an integer into a double) are not.
+bool isIdentity(TokenType op, OperandKind kind, Value constant) {
+    bool one = (IS_INTEGER(constant) && AS_INTEGER(constant) == 1) ||
+               (IS_DOUBLE(constant) && AS_NUMBER(constant) == 1);
+    bool zero = (IS_INTEGER(constant) && AS_INTEGER(constant) == 0) ||
+                (IS_DOUBLE(constant) && AS_NUMBER(constant) == 0 && !signbit(AS_NUMBER(constant)));
+
+    switch (op) {
+        case TOKEN_STAR: return one && isNumberKind(kind);
+        case TOKEN_PLUS: return IS_INTEGER(constant) && zero && kind == KIND_INTEGER;
+        case TOKEN_MINUS: return zero && kind == KIND_DOUBLE;
+        case TOKEN_SLASH: return one && kind == KIND_DOUBLE;
+        default: return false;
+    }
+}
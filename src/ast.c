@@ -0,0 +1,563 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "ast.h"
+#include "memory.h"
+#include "object.h"
+#include "parser.h"
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+} ArenaBlock;
+
+static _Thread_local ArenaBlock* arena = NULL;
+
+static void* arenaAllocate(size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if (arena == NULL || arena->used + size > arena->size) {
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        ArenaBlock* block = (ArenaBlock*)reallocate(NULL, 0, sizeof(ArenaBlock) + 16 + blockSize);
+        block->next = arena;
+        block->size = blockSize;
+        block->used = 0;
+        arena = block;
+    }
+
+    char* data = (char*)arena + ((sizeof(ArenaBlock) + 15) & ~(size_t)15);
+    void* result = data + arena->used;
+    arena->used += size;
+    return result;
+}
+
+void freeNodes(void) {
+    while (arena != NULL) {
+        ArenaBlock* next = arena->next;
+        reallocate(arena, sizeof(ArenaBlock) + 16 + arena->size, 0);
+        arena = next;
+    }
+}
+
+Node* newNode(NodeType type, const Token* token) {
+    Node* node = (Node*)arenaAllocate(sizeof(Node));
+    memset(node, 0, sizeof(Node));
+    node->type = type;
+    node->token = *token;
+    node->end = *token;
+    node->kind = KIND_UNKNOWN;
+    return node;
+}
+
+InlineSite* newInlineSite(const InlineSite* caller, const Token* call, const Token* function) {
+    InlineSite* site = (InlineSite*)arenaAllocate(sizeof(InlineSite));
+    site->caller = caller;
+    site->call = *call;
+    site->function = *function;
+    return site;
+}
+
+void appendNode(NodeList* list, Node* node) {
+    if (list->capacity < list->count + 1) {
+        int capacity = GROW_CAPACITY(list->capacity);
+        Node** items = (Node**)arenaAllocate(sizeof(Node*) * capacity);
+        if (list->count > 0) memcpy(items, list->items, sizeof(Node*) * list->count);
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = node;
+}
+
+// The AST builder follows the grammar, precedence and error messages of
+// the direct compiler in compiler.c exactly; only what it produces differs.
+// Scoping errors (redeclared locals, too many locals) are left to the
+// lowering, which is where locals are resolved.
+
+typedef enum {
+    PREC_NONE,
+    PREC_ASSIGNMENT,
+    PREC_OR,
+    PREC_AND,
+    PREC_EQUALITY,
+    PREC_COMPARISON,
+    PREC_SHIFT,
+    PREC_TERM,
+    PREC_FACTOR,
+    PREC_UNARY,
+    PREC_CALL,
+    PREC_PRIMARY
+} Precedence;
+
+typedef Node* (*PrefixFn)(bool canAssign);
+typedef Node* (*InfixFn)(Node* left, bool canAssign);
+
+typedef struct {
+    PrefixFn prefix;
+    InfixFn infix;
+    Precedence precedence;
+} ParseRule;
+
+static _Thread_local int functionDepth = 0;
+static _Thread_local int loopDepth = 0;
+
+static Node* expression(void);
+static Node* statement(void);
+static Node* declaration(void);
+static const ParseRule* getRule(TokenType type);
+static Node* parsePrecedence(Precedence precedence);
+
+static Node* literalNode(const Token* token, Value value) {
+    Node* node = newNode(NODE_LITERAL, token);
+    node->as.literal = value;
+    node->kind = operandKind(value);
+    return node;
+}
+
+static Node* binary(Node* left, bool canAssign) {
+    Token operator = parser.previous;
+    const ParseRule* rule = getRule(operator.type);
+    Node* right = parsePrecedence((Precedence)(rule->precedence + 1));
+
+    Node* node = newNode(NODE_BINARY, &operator);
+    node->end = parser.previous;
+    node->as.binary.left = left;
+    node->as.binary.right = right;
+    return node;
+}
+
+static Node* and_(Node* left, bool canAssign) {
+    Token operator = parser.previous;
+    Node* right = parsePrecedence(PREC_AND);
+
+    Node* node = newNode(NODE_AND, &operator);
+    node->as.binary.left = left;
+    node->as.binary.right = right;
+    return node;
+}
+
+static Node* or_(Node* left, bool canAssign) {
+    Token operator = parser.previous;
+    Node* right = parsePrecedence(PREC_OR);
+
+    Node* node = newNode(NODE_OR, &operator);
+    node->as.binary.left = left;
+    node->as.binary.right = right;
+    return node;
+}
+
+static Node* call(Node* callee, bool canAssign) {
+    Node* node = newNode(NODE_CALL, &parser.previous);
+    node->as.call.callee = callee;
+
+    if (!check(TOKEN_RPAREN)) {
+        do {
+            Node* argument = expression();
+            if (node->as.call.arguments.count == 255) {
+                error("Can't have more than 255 arguments.");
+            }
+            appendNode(&node->as.call.arguments, argument);
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RPAREN, "Expected ')' after arguments.");
+    node->end = parser.previous;
+    return node;
+}
+
+static Node* literal(bool canAssign) {
+    switch (parser.previous.type) {
+        case TOKEN_FALSE: return literalNode(&parser.previous, BOOL_VAL(false));
+        case TOKEN_TRUE: return literalNode(&parser.previous, BOOL_VAL(true));
+        default: return literalNode(&parser.previous, NONE_VAL);
+    }
+}
+
+static Node* grouping(bool canAssign) {
+    Node* node = expression();
+    consume(TOKEN_RPAREN, "Expect ')' after expression.");
+    return node;
+}
+
+static Node* number(bool canAssign) {
+    short dots = 0;
+    for (int i = 0; i < parser.previous.length; i++) {
+        if (parser.previous.start[i] == '.') {
+            dots++;
+        }
+    }
+    if (dots == 0) {
+        ulong value = strtoul(parser.previous.start, NULL, 10);
+        return literalNode(&parser.previous, INTEGER_VAL(value));
+    } else if (dots == 1) {
+        double value = strtod(parser.previous.start, NULL);
+        return literalNode(&parser.previous, NUMBER_VAL(value));
+    }
+
+    error("Numbers may only have one decimal point.");
+    return literalNode(&parser.previous, NONE_VAL);
+}
+
+static Node* string(bool canAssign) {
+    ObjString* string;
+    if (parser.previous.decoded) {
+        string = takeString((char*)parser.previous.start, parser.previous.length);
+    } else {
+        string = copyString(parser.previous.start, parser.previous.length);
+    }
+    return literalNode(&parser.previous, OBJ_VAL(string));
+}
+
+static Node* variable(bool canAssign) {
+    Token name = parser.previous;
+    if (canAssign && match(TOKEN_EQ)) {
+        Node* node = newNode(NODE_ASSIGN, &name);
+        node->as.unary.operand = expression();
+        node->end = parser.previous;
+        return node;
+    }
+    return newNode(NODE_VARIABLE, &name);
+}
+
+static Node* unary(bool canAssign) {
+    Token operator = parser.previous;
+    Node* operand = parsePrecedence(PREC_UNARY);
+
+    Node* node = newNode(NODE_UNARY, &operator);
+    node->end = parser.previous;
+    node->as.unary.operand = operand;
+    return node;
+}
+
+static const ParseRule rules[] = {
+    [TOKEN_LPAREN]        = {grouping,  call,     PREC_CALL},
+    [TOKEN_MINUS]         = {unary,     binary,   PREC_TERM},
+    [TOKEN_PLUS]          = {NULL,      binary,   PREC_TERM},
+    [TOKEN_SLASH]         = {NULL,      binary,   PREC_FACTOR},
+    [TOKEN_STAR]          = {NULL,      binary,   PREC_FACTOR},
+    [TOKEN_PERCENT]       = {NULL,      binary,   PREC_FACTOR},
+    [TOKEN_EXCLAM]        = {unary,     NULL,     PREC_NONE},
+    [TOKEN_EXCLAM_EQ]     = {NULL,      binary,   PREC_EQUALITY},
+    [TOKEN_EQ_EQ]         = {NULL,      binary,   PREC_COMPARISON},
+    [TOKEN_GREATER]       = {NULL,      binary,   PREC_COMPARISON},
+    [TOKEN_GREATER_EQ]    = {NULL,      binary,   PREC_COMPARISON},
+    [TOKEN_LESS]          = {NULL,      binary,   PREC_COMPARISON},
+    [TOKEN_LESS_EQ]       = {NULL,      binary,   PREC_COMPARISON},
+    [TOKEN_LSHIFT]        = {NULL,      binary,   PREC_SHIFT},
+    [TOKEN_RSHIFT]        = {NULL,      binary,   PREC_SHIFT},
+    [TOKEN_IDENTIFIER]    = {variable,  NULL,     PREC_NONE},
+    [TOKEN_STR]           = {string,    NULL,     PREC_NONE},
+    [TOKEN_NUM]           = {number,    NULL,     PREC_NONE},
+    [TOKEN_AND]           = {NULL,      and_,     PREC_AND},
+    [TOKEN_FALSE]         = {literal,   NULL,     PREC_NONE},
+    [TOKEN_NONE]          = {literal,   NULL,     PREC_NONE},
+    [TOKEN_OR]            = {NULL,      or_,      PREC_OR},
+    [TOKEN_TRUE]          = {literal,   NULL,     PREC_NONE},
+    [TOKEN_EOF]           = {NULL,      NULL,     PREC_NONE},
+};
+
+static const ParseRule* getRule(TokenType type) {
+    return &rules[type];
+}
+
+static Node* parsePrecedence(Precedence precedence) {
+    advance();
+    PrefixFn prefixRule = getRule(parser.previous.type)->prefix;
+    if (prefixRule == NULL) {
+        error("Expect expression.");
+        return literalNode(&parser.previous, NONE_VAL);
+    }
+
+    bool canAssign = precedence <= PREC_ASSIGNMENT;
+    Node* node = prefixRule(canAssign);
+
+    while (precedence <= getRule(parser.current.type)->precedence) {
+        advance();
+        InfixFn infixRule = getRule(parser.previous.type)->infix;
+        node = infixRule(node, canAssign);
+    }
+
+    if (canAssign && match(TOKEN_EQ)) {
+        error("Invalid assignment target.");
+    }
+    return node;
+}
+
+static Node* expression(void) {
+    return parsePrecedence(PREC_ASSIGNMENT);
+}
+
+static Node* block(void) {
+    Node* node = newNode(NODE_BLOCK, &parser.previous);
+    while (!check(TOKEN_RBRACE) && !check(TOKEN_EOF)) {
+        appendNode(&node->as.list, declaration());
+    }
+
+    consume(TOKEN_RBRACE, "Expected '}' at end of block.");
+    node->end = parser.previous;
+    return node;
+}
+
+static Node* funcDeclaration(void) {
+    consume(TOKEN_IDENTIFIER, "Expected function name.");
+    Node* node = newNode(NODE_FUNCTION, &parser.previous);
+
+    int enclosingLoopDepth = loopDepth;
+    functionDepth++;
+    loopDepth = 0;
+
+    consume(TOKEN_LPAREN, "Expected '(' after function name.");
+    if (!check(TOKEN_RPAREN)) {
+        do {
+            if (node->as.function.parameters.count + 1 > 255) {
+                errorAtCurrent("Can't have more than 255 parameters.");
+            }
+            consume(TOKEN_IDENTIFIER, "Expected parameter name.");
+            Node* parameter = newNode(NODE_VAR, &parser.previous);
+            if (match(TOKEN_EQ)) {
+                node->as.function.defaults++;
+                parameter->as.unary.operand = expression();
+            }
+            appendNode(&node->as.function.parameters, parameter);
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RPAREN, "Expected ')' after function parameters.");
+    consume(TOKEN_LBRACE, "Expected '{' before function body.");
+    node->as.function.body = block()->as.list;
+    node->end = parser.previous;
+
+    functionDepth--;
+    loopDepth = enclosingLoopDepth;
+    return node;
+}
+
+static Node* varDeclaration(void) {
+    consume(TOKEN_IDENTIFIER, "Expect variable name.");
+    Node* node = newNode(NODE_VAR, &parser.previous);
+
+    if (match(TOKEN_EQ)) {
+        node->as.unary.operand = expression();
+    }
+
+    consume(TOKEN_SEMI, "Expected ';' after variable declaration.");
+    node->end = parser.previous;
+    return node;
+}
+
+static Node* expressionStatement(void) {
+    Node* value = expression();
+    Node* node = newNode(NODE_EXPRESSION, &parser.previous);
+    node->as.unary.operand = value;
+    consume(TOKEN_SEMI, "Expected ';' after expression.");
+    node->end = parser.previous;
+    return node;
+}
+
+static Node* forStatement(void) {
+    Node* node = newNode(NODE_FOR, &parser.previous);
+    consume(TOKEN_LPAREN, "Expected '(' after 'for'.");
+    if (match(TOKEN_SEMI)) {
+        //no initializer
+    } else if (match(TOKEN_VAR)) {
+        node->as.loop.initializer = varDeclaration();
+    } else {
+        node->as.loop.initializer = expressionStatement();
+    }
+
+    if (!match(TOKEN_SEMI)) {
+        node->as.loop.condition = expression();
+        consume(TOKEN_SEMI, "Expected ';'.");
+        node->end = parser.previous;
+    }
+
+    if (!match(TOKEN_RPAREN)) {
+        node->as.loop.increment = expression();
+        consume(TOKEN_RPAREN, "Expected ')' after for clause.");
+    }
+
+    loopDepth++;
+    node->as.loop.body = statement();
+    loopDepth--;
+    return node;
+}
+
+static Node* rangeStatement(void) {
+    Node* node = newNode(NODE_RANGE, &parser.current);
+    rangeHeader();
+    Token range = parser.previous;
+
+    Node* arguments[RANGE_MAX_ARGUMENTS];
+    int count = 0;
+    do {
+        if (count == RANGE_MAX_ARGUMENTS) error("range() takes at most 3 arguments.");
+        Node* argument = expression();
+        if (count < RANGE_MAX_ARGUMENTS) arguments[count] = argument;
+        count++;
+    } while (match(TOKEN_COMMA));
+    consume(TOKEN_RPAREN, "Expected ')' after range arguments.");
+
+    if (count == 1) {
+        node->as.range.start = literalNode(&range, INTEGER_VAL(0));
+        node->as.range.stop = arguments[0];
+    } else {
+        node->as.range.start = arguments[0];
+        node->as.range.stop = arguments[1];
+    }
+    node->as.range.step = count >= 3 ? arguments[2] : literalNode(&range, INTEGER_VAL(1));
+
+    loopDepth++;
+    node->as.range.body = statement();
+    loopDepth--;
+    return node;
+}
+
+static Node* ifStatement(void) {
+    Node* node = newNode(NODE_IF, &parser.previous);
+    consume(TOKEN_LPAREN, "Expects '(' after 'if'.");
+    node->as.branch.condition = expression();
+    consume(TOKEN_RPAREN, "Expects ')' after condition.");
+    node->end = parser.previous;
+
+    node->as.branch.thenBranch = statement();
+    if (match(TOKEN_ELSE)) node->as.branch.elseBranch = statement();
+    return node;
+}
+
+static Node* printStatement(void) {
+    Node* node = newNode(NODE_PRINT, &parser.previous);
+    node->as.unary.operand = expression();
+    consume(TOKEN_SEMI, "Expect ';' after value.");
+    node->end = parser.previous;
+    return node;
+}
+
+static Node* returnStatement(void) {
+    Node* node = newNode(NODE_RETURN, &parser.previous);
+    if (functionDepth == 0) {
+        error("Can't return from top-level code.");
+    }
+    if (!match(TOKEN_SEMI)) {
+        node->as.unary.operand = expression();
+        consume(TOKEN_SEMI, "Expected ';' after return value.");
+    }
+    node->end = parser.previous;
+    return node;
+}
+
+static Node* whileStatement(void) {
+    Node* node = newNode(NODE_WHILE, &parser.previous);
+    consume(TOKEN_LPAREN, "Expects '(' after 'while'.");
+    node->as.loop.condition = expression();
+    consume(TOKEN_RPAREN, "Expects ')' after condition.");
+    node->end = parser.previous;
+
+    loopDepth++;
+    node->as.loop.body = statement();
+    loopDepth--;
+    return node;
+}
+
+static Node* switchStatement(void) {
+    Node* node = newNode(NODE_SWITCH, &parser.previous);
+    consume(TOKEN_LPAREN, "Expected '(' after 'switch'.");
+    node->as.switchStmt.subject = expression();
+    consume(TOKEN_RPAREN, "Expected ')' after value.");
+    consume(TOKEN_LBRACE, "Expected '{' before cases.");
+
+    int state = 0;
+    Node* arm = NULL;
+    while (!match(TOKEN_RBRACE) && !check(TOKEN_EOF)) {
+        if (match(TOKEN_CASE) || match(TOKEN_DEFAULT)) {
+            TokenType caseType = parser.previous.type;
+
+            if (state == 2) {
+                error("Can't have extra cases after the default case.");
+            }
+
+            arm = newNode(NODE_CASE, &parser.previous);
+            if (caseType == TOKEN_CASE) {
+                state = 1;
+                arm->as.caseArm.value = expression();
+                consume(TOKEN_COLON, "Expected ':' after case value.");
+                arm->end = parser.previous;
+            } else {
+                state = 2;
+                consume(TOKEN_COLON, "Expected ':' after default.");
+            }
+            appendNode(&node->as.switchStmt.cases, arm);
+        } else {
+            if (state == 0) {
+                error("Can't have statements before case.");
+            }
+            Node* body = statement();
+            if (arm != NULL) appendNode(&arm->as.caseArm.body, body);
+        }
+    }
+    node->end = parser.previous;
+    return node;
+}
+
+static Node* continueStatement(void) {
+    Node* node = newNode(NODE_CONTINUE, &parser.previous);
+    if (loopDepth == 0) {
+        error("Can't use 'continue' outside of a loop.");
+    }
+
+    consume(TOKEN_SEMI, "Expected ';' after 'continue'.");
+    node->end = parser.previous;
+    return node;
+}
+
+static Node* declaration(void) {
+    Node* node;
+    if (match(TOKEN_DEF)) {
+        node = funcDeclaration();
+    } else if (match(TOKEN_VAR)) {
+        node = varDeclaration();
+    } else {
+        node = statement();
+    }
+
+    if (parser.panicMode) synchronize();
+    return node;
+}
+
+static Node* statement(void) {
+    if (match(TOKEN_PRINT)) {
+        return printStatement();
+    } else if (match(TOKEN_FOR)) {
+        return check(TOKEN_IDENTIFIER) ? rangeStatement() : forStatement();
+    } else if (match(TOKEN_IF)) {
+        return ifStatement();
+    } else if (match(TOKEN_RETURN)) {
+        return returnStatement();
+    } else if (match(TOKEN_WHILE)) {
+        return whileStatement();
+    } else if (match(TOKEN_SWITCH)) {
+        return switchStatement();
+    } else if (match(TOKEN_CONTINUE)) {
+        return continueStatement();
+    } else if (match(TOKEN_LBRACE)) {
+        return block();
+    } else {
+        return expressionStatement();
+    }
+}
+
+// The tree is a NODE_BLOCK of the script's top-level declarations, though
+// unlike a block statement it does not open a scope.
+Node* parseProgram(const char* source) {
+    initScanner(source);
+    parser.hadError = false;
+    parser.panicMode = false;
+    functionDepth = 0;
+    loopDepth = 0;
+
+    advance();
+    Node* program = newNode(NODE_BLOCK, &parser.current);
+    while (!match(TOKEN_EOF)) {
+        appendNode(&program->as.list, declaration());
+    }
+
+    return parser.hadError ? NULL : program;
+}
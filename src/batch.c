@@ -0,0 +1,100 @@
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "memory.h"
+#include "table.h"
+
+typedef struct {
+    ObjFunction* function;
+    VM* parent;
+    BatchJob* jobs;
+    int count;
+
+    pthread_mutex_t lock;
+    pthread_cond_t finished;    // signalled as each job is done
+    int next;                   // the first job no worker has taken
+    bool* done;
+} Batch;
+
+void runBatchJob(VM* parent, ObjFunction* function, BatchJob* job) {
+    VM* instance = newChildVM(parent);
+    VM* caller = useVM(instance);
+    redirectOutput(&vm->output, OUTPUT_MEMORY);
+    redirectOutput(&vm->errors, OUTPUT_MEMORY);
+    tableSet(&vm->globals, OBJ_VAL(copyString("input", 5)),
+             OBJ_VAL(copyString(job->input, job->length)));
+    job->result = interpretFunction(function);
+
+    // The job keeps what was collected, and the VM frees empty buffers.
+    job->output = vm->output;
+    job->errors = vm->errors;
+    initOutput(&vm->output, OUTPUT_MEMORY, 0);
+    initOutput(&vm->errors, OUTPUT_MEMORY, 0);
+    useVM(caller);
+    destroyVM(instance);
+}
+
+static void* work(void* argument) {
+    Batch* batch = argument;
+    pthread_mutex_lock(&batch->lock);
+    while (batch->next < batch->count) {
+        int index = batch->next++;
+        pthread_mutex_unlock(&batch->lock);
+
+        runBatchJob(batch->parent, batch->function, &batch->jobs[index]);
+
+        pthread_mutex_lock(&batch->lock);
+        batch->done[index] = true;
+        pthread_cond_signal(&batch->finished);
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+int runBatch(ObjFunction* function, BatchJob* jobs, int count, int workers,
+             BatchReportFn report) {
+    Batch batch;
+    batch.function = function;
+    batch.parent = vm;
+    batch.jobs = jobs;
+    batch.count = count;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.finished, NULL);
+    batch.next = 0;
+    batch.done = ALLOCATE(bool, count);
+    memset(batch.done, 0, sizeof(bool) * (size_t)count);
+
+#ifdef _SC_NPROCESSORS_ONLN
+    if (workers <= 0) workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (workers > count) workers = count;
+    if (workers < 1) workers = 1;
+    pthread_t* threads = ALLOCATE(pthread_t, workers);
+    int started = 0;
+    while (started < workers && pthread_create(&threads[started], NULL, work, &batch) == 0) {
+        started++;
+    }
+    // Without any thread to run them, the jobs run here, one by one.
+    if (started == 0) work(&batch);
+
+    int failed = 0;
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_lock(&batch.lock);
+        while (!batch.done[i]) pthread_cond_wait(&batch.finished, &batch.lock);
+        pthread_mutex_unlock(&batch.lock);
+
+        if (jobs[i].result != INTERPRET_OK) failed++;
+        if (report != NULL) report(&jobs[i], i);
+        freeOutput(&jobs[i].output);
+        freeOutput(&jobs[i].errors);
+    }
+
+    for (int i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    FREE_ARRAY(pthread_t, threads, workers);
+    FREE_ARRAY(bool, batch.done, count);
+    pthread_cond_destroy(&batch.finished);
+    pthread_mutex_destroy(&batch.lock);
+    return failed;
+}
@@ -0,0 +1,215 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "image.h"
+#include "memory.h"
+#include "passes.h"
+
+// The payload of a cache file is the script's function tree:
+//
+//   function: name, arity, default arity, code and line runs, constants
+//   constant: its ValueType, then for objects its ObjType, then its data
+//
+// Nested functions are written out in place, as compiled code never shares
+// them; strings are interned again on loading.
+
+#define CACHE_MAGIC 0x424f574fu     // "OWOB"
+
+// Everything that changes what the compiler makes of a source.
+static uint64_t scriptKey(const char* source, size_t length) {
+    uint64_t options[] = {
+        imageBuildKey(),
+        compilerOptions.pipeline,
+        compilerOptions.peephole,
+        compilerOptions.compactChunks,
+        enabledPasses(),
+        length,
+    };
+
+    uint64_t hash = hashImageBytes(0xcbf29ce484222325ull, options, sizeof(options));
+    return hashImageBytes(hash, source, length);
+}
+
+bool findCacheEntry(const char* directory, const char* source, size_t length, CacheEntry* entry) {
+    char fallback[CACHE_PATH_MAX];
+    if (directory == NULL) {
+        const char* base = getenv("XDG_CACHE_HOME");
+        const char* home = getenv("HOME");
+        int written;
+        if (base != NULL && base[0] != '\0') {
+            written = snprintf(fallback, sizeof(fallback), "%s/pythowon", base);
+        } else if (home != NULL && home[0] != '\0') {
+            written = snprintf(fallback, sizeof(fallback), "%s/.cache/pythowon", home);
+        } else {
+            return false;
+        }
+        if (written < 0 || written >= (int)sizeof(fallback)) return false;
+        directory = fallback;
+    }
+
+    entry->key = scriptKey(source, length);
+    int written = snprintf(entry->path, sizeof(entry->path), "%s/%016llx.owoc",
+                           directory, (unsigned long long)entry->key);
+    return written > 0 && written < (int)sizeof(entry->path);
+}
+
+static bool writeFunction(ImageWriter* writer, const ObjFunction* function);
+
+static bool writeValue(ImageWriter* writer, Value value) {
+    writeImageByte(writer, (uint8_t)value.type);
+    switch (value.type) {
+        case VAL_BOOL:
+            writeImageByte(writer, AS_BOOL(value));
+            return true;
+        case VAL_NUMBER:
+            writeImageBytes(writer, &AS_NUMBER(value), sizeof(double));
+            return true;
+        case VAL_INTEGER:
+            writeImageVarint(writer, AS_INTEGER(value));
+            return true;
+        case VAL_OBJ:
+            break;
+        default:
+            return true;
+    }
+
+    // A view loads as the plain string it reads as.
+    writeImageByte(writer, (uint8_t)(IS_STRINGLIKE(value) ? OBJ_STRING : OBJ_TYPE(value)));
+    switch (OBJ_TYPE(value)) {
+        case OBJ_FUNCTION:
+            return writeFunction(writer, AS_FUNCTION(value));
+        case OBJ_STRING:
+            writeImageString(writer, AS_CSTRING(value), AS_STRING(value)->length, AS_STRING(value)->hash);
+            return true;
+        case OBJ_STRING_VIEW:
+            writeImageString(writer, stringChars(value), stringLength(value),
+                             hashStringView(AS_STRING_VIEW(value)));
+            return true;
+        case OBJ_SWITCH: {
+            const ObjSwitch* table = AS_SWITCH(value);
+            Value* labels = ALLOCATE(Value, table->caseCount);
+            switchLabels(table, labels);
+
+            bool written = true;
+            writeImageVarint(writer, (uint64_t)table->caseCount);
+            for (int i = 0; i < table->caseCount && written; i++) {
+                written = writeValue(writer, labels[i]);
+            }
+            FREE_ARRAY(Value, labels, table->caseCount);
+            return written;
+        }
+        default:
+            return false;
+    }
+}
+
+static bool writeFunction(ImageWriter* writer, const ObjFunction* function) {
+    if (function->source != NULL) return false;
+
+    writeImageByte(writer, function->name != NULL);
+    if (function->name != NULL) {
+        writeImageString(writer, function->name->chars, function->name->length, function->name->hash);
+    }
+    writeImageVarint(writer, (uint64_t)function->arity);
+    writeImageVarint(writer, (uint64_t)function->defArity);
+
+    const Chunk* chunk = &function->chunk;
+    writeImageChunk(writer, chunk);
+    writeImageVarint(writer, (uint64_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        if (!writeValue(writer, chunk->constants.values[i])) return false;
+    }
+    return true;
+}
+
+bool storeCache(const CacheEntry* entry, ObjFunction* function) {
+    ImageWriter writer;
+    initImageWriter(&writer);
+    bool stored = writeFunction(&writer, function) &&
+                  saveImage(entry->path, CACHE_MAGIC, entry->key, &writer);
+    freeImageWriter(&writer);
+    return stored;
+}
+
+static ObjFunction* readFunction(ImageReader* reader);
+
+static Value readValue(ImageReader* reader) {
+    ValueType type = (ValueType)readImageByte(reader);
+    switch (type) {
+        case VAL_BOOL:
+            return BOOL_VAL(readImageByte(reader) != 0);
+        case VAL_NONE:
+            return NONE_VAL;
+        case VAL_EMPTY:
+            return EMPTY_VAL;
+        case VAL_NUMBER: {
+            double number = 0;
+            const uint8_t* bytes = readImageBytes(reader, sizeof(number));
+            if (bytes != NULL) memcpy(&number, bytes, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+        case VAL_INTEGER:
+            return INTEGER_VAL((ulong)readImageVarint(reader));
+        case VAL_OBJ:
+            break;
+        default:
+            reader->ok = false;
+            return NONE_VAL;
+    }
+
+    Obj* object = NULL;
+    switch ((ObjType)readImageByte(reader)) {
+        case OBJ_FUNCTION:
+            object = (Obj*)readFunction(reader);
+            break;
+        case OBJ_STRING:
+            object = (Obj*)readImageString(reader);
+            break;
+        case OBJ_SWITCH: {
+            int count = readImageCount(reader);
+            Value* labels = ALLOCATE(Value, count);
+            for (int i = 0; i < count; i++) {
+                labels[i] = readValue(reader);
+                if (!isSwitchLabel(labels[i])) reader->ok = false;
+            }
+            if (reader->ok) object = (Obj*)newSwitch(labels, count);
+            FREE_ARRAY(Value, labels, count);
+            break;
+        }
+        default:
+            break;
+    }
+    if (object == NULL) reader->ok = false;
+    return object != NULL ? OBJ_VAL(object) : NONE_VAL;
+}
+
+static ObjFunction* readFunction(ImageReader* reader) {
+    ObjFunction* function = newFunction();
+    if (readImageByte(reader)) function->name = readImageString(reader);
+    function->arity = (int)readImageVarint(reader);
+    function->defArity = (int)readImageVarint(reader);
+
+    Chunk* chunk = &function->chunk;
+    readImageChunk(reader, chunk);
+    int constantCount = readImageCount(reader);
+    ValueArray* constants = &chunk->constants;
+    constants->values = ALLOCATE(Value, constantCount);
+    constants->capacity = constantCount;
+    for (int i = 0; i < constantCount && reader->ok; i++) {
+        constants->values[constants->count++] = readValue(reader);
+    }
+    return reader->ok ? function : NULL;
+}
+
+ObjFunction* loadCache(const CacheEntry* entry) {
+    Image image;
+    if (!openImage(entry->path, CACHE_MAGIC, entry->key, &image)) return NULL;
+
+    ObjFunction* function = readFunction(&image.reader);
+    if (image.reader.at != image.reader.end) function = NULL;
+    closeImage(&image);
+    return function;
+}
@@ -9,12 +9,18 @@ void initChunk(Chunk* chunk) {
     chunk->capacity = 0;
     chunk->code = NULL;
     chunk->lines = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
+    chunk->inlined = NULL;
+    chunk->inlinedCount = 0;
+    chunk->inlinedCapacity = 0;
     initValueArray(&chunk->constants);
 }
 
 void freeChunk(Chunk* chunk) {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(LineRun, chunk->lines, chunk->lineCapacity);
+    FREE_ARRAY(InlinedLine, chunk->inlined, chunk->inlinedCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
@@ -25,15 +31,132 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
         chunk->capacity = GROW_CAPACITY(oldCapacity);
         chunk->code = GROW_ARRAY(uint8_t, chunk->code,
             oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines,
-            oldCapacity, chunk->capacity);
     }
 
+    writeLine(chunk, chunk->count, line);
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
 }
 
+// Records that the code from offset on comes from line. Offsets must only
+// ever go up, as they do while code is written.
+void writeLine(Chunk* chunk, int offset, int line) {
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) return;
+
+    if (chunk->lineCapacity < chunk->lineCount + 1) {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(LineRun, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+    chunk->lines[chunk->lineCount].offset = offset;
+    chunk->lines[chunk->lineCount].line = line;
+    chunk->lineCount++;
+}
+
+// The line of the instruction byte at offset: the last run starting at or
+// before it.
+int getLine(const Chunk* chunk, int offset) {
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    while (low < high) {
+        int middle = low + (high - low + 1) / 2;
+        if (chunk->lines[middle].offset <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return chunk->lineCount > 0 ? chunk->lines[low].line : 0;
+}
+
+// The line to write code inlined from function's line with, when the call
+// it replaced was on caller.
+int addInlinedLine(Chunk* chunk, int line, int caller, ObjString* function) {
+    for (int i = 0; i < chunk->inlinedCount; i++) {
+        const InlinedLine* inlined = &chunk->inlined[i];
+        if (inlined->line == line && inlined->caller == caller && inlined->function == function) {
+            return -1 - i;
+        }
+    }
+
+    if (chunk->inlinedCapacity < chunk->inlinedCount + 1) {
+        int oldCapacity = chunk->inlinedCapacity;
+        chunk->inlinedCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->inlined = GROW_ARRAY(InlinedLine, chunk->inlined, oldCapacity,
+                                    chunk->inlinedCapacity);
+    }
+    chunk->inlined[chunk->inlinedCount] = (InlinedLine){line, caller, function};
+    return -1 - chunk->inlinedCount++;
+}
+
+// The line in the source a line from getLine() stands for: for inlined
+// code, its line in the function it came from.
+int sourceLine(const Chunk* chunk, int line) {
+    return line < 0 ? chunk->inlined[-1 - line].line : line;
+}
+
+// Lets the compiler take back code (and the constants it added) that it
+// has only just emitted, e.g. to replace it with a folded constant.
+void truncateChunk(Chunk* chunk, int count, int constantCount) {
+    chunk->count = count;
+    chunk->constants.count = constantCount;
+    while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= count) {
+        chunk->lineCount--;
+    }
+}
+
+// Gives back the room the arrays grew into, once the chunk is finished.
+void shrinkChunk(Chunk* chunk) {
+    chunk->code = GROW_ARRAY(uint8_t, chunk->code, chunk->capacity, chunk->count);
+    chunk->capacity = chunk->count;
+    chunk->lines = GROW_ARRAY(LineRun, chunk->lines, chunk->lineCapacity, chunk->lineCount);
+    chunk->lineCapacity = chunk->lineCount;
+    chunk->inlined = GROW_ARRAY(InlinedLine, chunk->inlined, chunk->inlinedCapacity,
+                                chunk->inlinedCount);
+    chunk->inlinedCapacity = chunk->inlinedCount;
+
+    ValueArray* constants = &chunk->constants;
+    constants->values = GROW_ARRAY(Value, constants->values, constants->capacity, constants->count);
+    constants->capacity = constants->count;
+}
+
+// Size of an instruction in bytes, operands included.
+int instructionLength(uint8_t instruction) {
+    switch (instruction) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_STORE_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEF_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_STORE_GLOBAL:
+        case OP_CALL:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_FALSE:
+        case OP_POP_JUMP_FALSE:
+        case OP_LOOP:
+            return 3;
+        case OP_CONSTANT_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEF_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_STORE_GLOBAL_LONG:
+        case OP_SWITCH:
+            return 4;
+        case OP_JUMP_LONG:
+        case OP_JUMP_FALSE_LONG:
+        case OP_POP_JUMP_FALSE_LONG:
+        case OP_LOOP_LONG:
+            return 5;
+        case OP_FOR_RANGE:
+            return 6;
+        default:
+            return 1;
+    }
+}
+
 int addConstant(Chunk* chunk, Value value) {
     push(value);
     writeValueArray(&chunk->constants, value);
@@ -1,11 +1,18 @@
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "arith.h"
+#include "ast.h"
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
 #include "scanner.h"
 #include "object.h"
+#include "parser.h"
+#include "passes.h"
+#include "peephole.h"
 #include "value.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -54,86 +61,61 @@ typedef struct Compiler {
     Local locals[UINT8_MAX+1];     //TODO: increase to UINT16_MAX
     int localCount;
     int scopeDepth;
+
+    // Constant index of each identifier name this function has used,
+    // indexed by symbol ID, -1 where it has not been used yet.
+    int* symbolConstants;
+    int symbolConstantCapacity;
+
+    // Hash index over the constant table, so equal constants share one
+    // entry. Each slot holds a constant index, -1 when empty; slots left
+    // pointing past the end of the table by truncateChunk() are skipped.
+    int* constantSlots;
+    int constantSlotCount;
+    int constantSlotCapacity;
+
+    // Set once the code being compiled can't be reached, e.g. after a
+    // return. Declarations compiled while it is set are thrown away.
+    bool unreachable;
 } Compiler;
 
-Parser parser;
-Compiler* current = NULL;
-Table stringConstants;
+_Thread_local Parser parser;
+_Thread_local Compiler* current = NULL;
+CompilerOptions compilerOptions = {false, false, true, true, false};
+
+_Thread_local int innerLoopStart = -1;
+_Thread_local int innerLoopScopeDepth = 0;
 
-int innerLoopStart = -1;
-int innerLoopScopeDepth = 0;
+// The last operand compiled, as the range of the chunk its code occupies.
+// Operators check that their operands' code is exactly such a range to
+// fold them: a constant operand is a single load of `value`.
+typedef struct {
+    int start;
+    int end;                // -1 when nothing is being tracked
+    int constantCount;      // size of the constant table before start
+    bool isConstant;
+    Value value;
+    OperandKind kind;
+} Operand;
+
+_Thread_local Operand lastOperand = {0, -1, 0, false, {VAL_NONE, {.integer = 0}}, KIND_UNKNOWN};
+_Thread_local int infixOperandStart = 0;  // where the left operand of the current infix rule begins
+
+// While the lowering emits code the inliner copied in, the line from the
+// chunk's inlined lines it goes on instead of parser.previous's; 0 other
+// times.
+static _Thread_local int inlinedLine = 0;
 
 static Chunk* currentChunk(void) {
     return &current->function->chunk;
 }
 
-static void slice(const char *str, char *result, size_t start, size_t end)
-{
-    strncpy(result, str + start, end - start);
-    result[end] = '\0';
-}
-
-static void errorAt(const Token* token, const char* message) {
-    if (parser.panicMode) return;
-    parser.panicMode = true;
-    fprintf(stderr, "[line %d] Error", token->line);
-
-    if (token->type == TOKEN_EOF) {
-        fprintf(stderr, " at end");
-    } else if (token->type == TOKEN_ERROR) {
-        // empty
-    } else {
-        char* line = (char*)malloc(token->length);
-    //    char line[token->length+1];
-        slice(token->start, line, 0, token->length);
-        fprintf(stderr, " at '%s'", line);
-        free(line);
-    }
-
-    fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
-}
-
-static void error(const char* message) {
-    errorAt(&parser.previous, message);
-}
-
-static void errorAtCurrent(const char* message) {
-    errorAt(&parser.current, message);
-}
-
-static void advance(void) {
-    parser.previous = parser.current;
-
-    for (;;) {
-        parser.current = scanToken();
-        if(parser.current.type != TOKEN_ERROR) break;
-
-        errorAtCurrent(parser.current.start);
-    }
-}
-
-static void consume(TokenType type, const char* message) {
-    if (parser.current.type == type) {
-        advance();
-        return;
-    }
-
-    errorAtCurrent(message);
-}
-
-static bool check(TokenType type) {
-    return parser.current.type == type;
-}
-
-static bool match(TokenType type) {
-    if (!check(type)) return false;
-    advance();
-    return true;
+static int currentLine(void) {
+    return inlinedLine != 0 ? inlinedLine : parser.previous.line;
 }
 
 static void emitByte(uint8_t byte) {
-    writeChunk(currentChunk(), byte, parser.previous.line);
+    writeChunk(currentChunk(), byte, currentLine());
 }
 
 static void emitBytes(uint8_t byte1, uint8_t byte2) {
@@ -184,13 +166,103 @@ static void emitReturn(void) {
     emitByte(OP_RETURN);
 }
 
+// Constants are shared when they have the same type and the same bits, so
+// 1 and 1.0, or 0.0 and -0.0, stay apart. Strings are interned, and
+// other objects are only ever equal to themselves.
+static bool sameConstant(Value a, Value b) {
+    if (a.type != b.type) return false;
+    switch (a.type) {
+        case VAL_BOOL:    return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_NUMBER:  return memcmp(&AS_NUMBER(a), &AS_NUMBER(b), sizeof(double)) == 0;
+        case VAL_INTEGER: return AS_INTEGER(a) == AS_INTEGER(b);
+        case VAL_OBJ:     return AS_OBJ(a) == AS_OBJ(b);
+        default:          return true;
+    }
+}
+
+static uint32_t constantHash(Value value) {
+    uint64_t bits = 0;
+    switch (value.type) {
+        case VAL_BOOL:    bits = AS_BOOL(value); break;
+        case VAL_NUMBER:  memcpy(&bits, &AS_NUMBER(value), sizeof(double)); break;
+        case VAL_INTEGER: bits = AS_INTEGER(value); break;
+        case VAL_OBJ:     bits = (uint64_t)(uintptr_t)AS_OBJ(value); break;
+        default:          break;
+    }
+    bits = (bits ^ (uint64_t)value.type) * 0x9e3779b97f4a7c15ull;
+    return (uint32_t)(bits >> 32);
+}
+
+// Where value's slot is, or the free slot it would go in.
+static int findConstantSlot(Value value, int* index) {
+    const ValueArray* constants = &currentChunk()->constants;
+    int mask = current->constantSlotCapacity - 1;
+    int slot = (int)(constantHash(value) & (uint32_t)mask);
+    int reusable = -1;
+
+    for (;;) {
+        int candidate = current->constantSlots[slot];
+        if (candidate == -1) break;
+        if (candidate >= constants->count) {
+            if (reusable == -1) reusable = slot;
+        } else if (sameConstant(constants->values[candidate], value)) {
+            *index = candidate;
+            return slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    *index = -1;
+    return reusable != -1 ? reusable : slot;
+}
+
+// Rebuilds the index from the constant table, dropping stale slots.
+static void rebuildConstantSlots(void) {
+    const ValueArray* constants = &currentChunk()->constants;
+    int capacity = current->constantSlotCapacity < 8 ? 8 : current->constantSlotCapacity;
+    while (capacity < (constants->count + 1) * 2) capacity *= 2;
+
+    current->constantSlots = GROW_ARRAY(int, current->constantSlots,
+                                        current->constantSlotCapacity, capacity);
+    current->constantSlotCapacity = capacity;
+    current->constantSlotCount = 0;
+    for (int i = 0; i < capacity; i++) current->constantSlots[i] = -1;
+
+    for (int i = 0; i < constants->count; i++) {
+        int existing;
+        int slot = findConstantSlot(constants->values[i], &existing);
+        if (existing != -1) continue;
+        current->constantSlots[slot] = i;
+        current->constantSlotCount++;
+    }
+}
+
+// Adds a value to the constant table, or finds the entry it already has.
+static int makeConstant(Value value) {
+    Chunk* chunk = currentChunk();
+    if (!compilerOptions.compactChunks) return addConstant(chunk, value);
+
+    if ((current->constantSlotCount + 1) * 4 > current->constantSlotCapacity * 3) {
+        rebuildConstantSlots();
+    }
+
+    int index;
+    int slot = findConstantSlot(value, &index);
+    if (index != -1) return index;
+
+    if (current->constantSlots[slot] == -1) current->constantSlotCount++;
+    index = addConstant(chunk, value);
+    current->constantSlots[slot] = index;
+    return index;
+}
+
 static uint8_t emitConstant(Value value) {
-    int index = addConstant(currentChunk(), value);
+    int index = makeConstant(value);
     if (index > UINT16_MAX) {
         error("Too many constants in one chunk.");
         return 0;
     } else {
-        writeConstant(index, currentChunk(), parser.previous.line);
+        writeConstant(index, currentChunk(), currentLine());
         return (uint8_t)index;
     }
 }
@@ -219,15 +291,23 @@ static void patchJumpLong(int offset) {
     currentChunk()->code[offset + 3] = jump & 0xff;
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
+// Compiles into `function` when it is given, or else into a new one.
+static void initCompiler(Compiler* compiler, FunctionType type, ObjFunction* function) {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
+    compiler->symbolConstants = NULL;
+    compiler->symbolConstantCapacity = 0;
+    compiler->constantSlots = NULL;
+    compiler->constantSlotCount = 0;
+    compiler->constantSlotCapacity = 0;
+    compiler->unreachable = false;
+    compiler->function = function != NULL ? function : newFunction();
+    lastOperand.end = -1;
     current = compiler;
-    if (type != TYPE_SCRIPT) {
+    if (type != TYPE_SCRIPT && function == NULL) {
         current->function->name = copyString(parser.previous.start,
                                             parser.previous.length);
     }
@@ -236,11 +316,20 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
     local->depth = 0;
     local->name.start = "";
     local->name.length = 0;
+    local->name.symbol = -1;
 }
 
 static ObjFunction* endCompiler(void) {
     emitReturn();
     ObjFunction* function = current->function;
+    if (!parser.hadError) {
+        if (compilerOptions.peephole) {
+            optimizeChunk(currentChunk());
+        } else {
+            relaxChunk(currentChunk());
+        }
+        if (compilerOptions.compactChunks) shrinkChunk(currentChunk());
+    }
 
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
@@ -250,7 +339,10 @@ static ObjFunction* endCompiler(void) {
     }
 #endif
 
+    FREE_ARRAY(int, current->symbolConstants, current->symbolConstantCapacity);
+    FREE_ARRAY(int, current->constantSlots, current->constantSlotCapacity);
     current = current->enclosing;
+    lastOperand.end = -1;
     return function;
 }
 
@@ -275,21 +367,98 @@ static void declaration(void);
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
-static uint8_t identifierConstant(const Token* name) {   //could be more efficient but we have 65535 slots per chunk
-    Value string = OBJ_VAL(copyString(name->start, name->length));
-    Value indexValue;
-    if (tableGet(&stringConstants, string, &indexValue)) {
-        pop();
+// Adds the name to the constant table, once per function, and returns its
+// index for the global variable instructions to use as their operand.
+static int identifierConstant(const Token* name) {
+    if (name->symbol >= current->symbolConstantCapacity) {
+        int oldCapacity = current->symbolConstantCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        while (capacity <= name->symbol) capacity = GROW_CAPACITY(capacity);
+        current->symbolConstants = GROW_ARRAY(int, current->symbolConstants,
+                                              oldCapacity, capacity);
+        for (int i = oldCapacity; i < capacity; i++) current->symbolConstants[i] = -1;
+        current->symbolConstantCapacity = capacity;
     }
 
-    uint8_t index = emitConstant(string);
-    tableSet(&stringConstants, string, NUMBER_VAL((double)index));
+    int index = current->symbolConstants[name->symbol];
+    if (index != -1) return index;
+
+    ObjString* string = copyStringHashed(name->start, name->length,
+                                         symbolHash(name->symbol));
+    index = makeConstant(OBJ_VAL(string));
+    if (index > UINT16_MAX) {
+        error("Too many constants in one chunk.");
+        return 0;
+    }
+    current->symbolConstants[name->symbol] = index;
     return index;
 }
 
+static void emitGlobalOp(OpCode op, OpCode longOp, int index) {
+    if (index <= UINT8_MAX) {
+        emitBytes(op, (uint8_t)index);
+    } else {
+        emitByte(longOp);
+        emitByte((uint8_t)(index & 0xff));
+        emitByte((uint8_t)((index >> 8) & 0xff));
+        emitByte((uint8_t)((index >> 16) & 0xff));
+    }
+}
+
+static void trackOperand(int start, int constantCount, OperandKind kind) {
+    lastOperand.start = start;
+    lastOperand.end = currentChunk()->count;
+    lastOperand.constantCount = constantCount;
+    lastOperand.isConstant = false;
+    lastOperand.kind = kind;
+}
+
+// Emits the cheapest load of a compile-time value and tracks it as the
+// last operand.
+static void emitValue(Value value) {
+    int start = currentChunk()->count;
+    int constantCount = currentChunk()->constants.count;
+
+    if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else if (IS_NONE(value)) {
+        emitByte(OP_NONE);
+    } else {
+        emitConstant(value);
+    }
+
+    trackOperand(start, constantCount, operandKind(value));
+    lastOperand.isConstant = true;
+    lastOperand.value = value;
+}
+
+// The last operand, if its code is all that has been emitted since start.
+static bool operandAt(int start, Operand* operand) {
+    if (lastOperand.end != currentChunk()->count || lastOperand.start != start) {
+        return false;
+    }
+    *operand = lastOperand;
+    return true;
+}
+
+// Throws away the code emitted since start. Constants stay, as the
+// compiler may have cached their indices by name.
+static void discardCode(int start) {
+    truncateChunk(currentChunk(), start, currentChunk()->constants.count);
+    lastOperand.end = -1;
+}
+
+// The condition just compiled from start, if it is a compile-time
+// constant, and whether the VM would treat it as true.
+static bool constantCondition(int start, bool* isTrue) {
+    Operand condition;
+    if (!operandAt(start, &condition) || !condition.isConstant) return false;
+    *isTrue = !isFalsey(condition.value);
+    return true;
+}
+
 static bool identifiersEqual(const Token* a, const Token* b) {
-    if (a->length != b->length) return false;
-    return memcmp(a->start, b->start, a->length) == 0;
+    return a->symbol == b->symbol;
 }
 
 static int resolveLocal(const Compiler* compiler, const Token* name) {
@@ -335,27 +504,40 @@ static void declareVariable(void) {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
-    consume(TOKEN_IDENTIFIER, errorMessage);
-
+// Declares the variable named by parser.previous, returning the constant
+// index of its name if it is a global.
+static int declareNamedVariable(void) {
     declareVariable();
     if (current->scopeDepth > 0) return 0;
 
     return identifierConstant(&parser.previous);
 }
 
+static int parseVariable(const char* errorMessage) {
+    consume(TOKEN_IDENTIFIER, errorMessage);
+    return declareNamedVariable();
+}
+
 static void markInitialized(void) {
     if (current->scopeDepth == 0) return;
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+// Turns the value on top of the stack into a local no name resolves to.
+static void addHiddenLocal(void) {
+    Token name = parser.previous;
+    name.symbol = hiddenSymbol();
+    addLocal(name);
+    markInitialized();
+}
+
+static void defineVariable(int global) {
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
 
-    emitBytes(OP_DEF_GLOBAL, global);
+    emitGlobalOp(OP_DEF_GLOBAL, OP_DEF_GLOBAL_LONG, global);
 }
 
 static uint8_t argumentList(void) {
@@ -382,11 +564,43 @@ static void and_(bool canAssign) {
     patchJumpLong(endJump);
 }
 
+static void emitBinaryOperator(TokenType opType);
+
 static void binary(bool canAssign) {
     TokenType opType = parser.previous.type;
     const ParseRule* rule = getRule(opType);
+
+    int leftStart = infixOperandStart;
+    Operand left;
+    bool leftKnown = operandAt(leftStart, &left);
+    int rightStart = currentChunk()->count;
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    Operand right;
+    if (leftKnown && operandAt(rightStart, &right) && right.isConstant) {
+        if (left.isConstant) {
+            Value value;
+            if (foldBinaryOperator(opType, left.value, right.value, &value)) {
+                truncateChunk(currentChunk(), left.start, left.constantCount);
+                emitValue(value);
+                return;
+            }
+        } else if (isIdentity(opType, left.kind, right.value)) {
+            truncateChunk(currentChunk(), right.start, right.constantCount);
+            lastOperand = left;
+            return;
+        }
+    }
+
+    OperandKind leftKind = leftKnown ? left.kind : KIND_UNKNOWN;
+    OperandKind rightKind = operandAt(rightStart, &right) ? right.kind : KIND_UNKNOWN;
+    int constantCount = leftKnown ? left.constantCount : currentChunk()->constants.count;
+
+    emitBinaryOperator(opType);
+    trackOperand(leftStart, constantCount, resultKind(opType, leftKind, rightKind));
+}
+
+static void emitBinaryOperator(TokenType opType) {
     switch (opType) {
         case TOKEN_EXCLAM_EQ:    emitBytes(OP_EQUAL, OP_NOT); break;
         case TOKEN_EQ_EQ:   emitByte(OP_EQUAL); break;
@@ -412,9 +626,9 @@ static void call(bool canAssign) {
 
 static void literal(bool canAssign) {
     switch (parser.previous.type) {
-        case TOKEN_FALSE: emitByte(OP_FALSE); break;
-        case TOKEN_TRUE: emitByte(OP_TRUE); break;
-        case TOKEN_NONE: emitByte(OP_NONE); break;
+        case TOKEN_FALSE: emitValue(BOOL_VAL(false)); break;
+        case TOKEN_TRUE: emitValue(BOOL_VAL(true)); break;
+        case TOKEN_NONE: emitValue(NONE_VAL); break;
         default: break;
     }
 }
@@ -433,11 +647,10 @@ static void number(bool canAssign) {
     }
     if (dots == 0) {
         ulong value = strtoul(parser.previous.start, NULL, 10);
-        emitConstant(INTEGER_VAL(value));
+        emitValue(INTEGER_VAL(value));
     } else if (dots == 1) {
         double value = strtod(parser.previous.start, NULL);
-        emitConstant(NUMBER_VAL(value));
-        fprintf(stdout, "double: %g\n", value);
+        emitValue(NUMBER_VAL(value));
     } else {
         error("Numbers may only have one decimal point.");
     }
@@ -455,27 +668,47 @@ static void or_(bool canAssign) {
 }
 
 static void string(bool canAssign) {
-    emitConstant(OBJ_VAL(newString(parser.previous.start,
-                                    parser.previous.length)));
+    ObjString* string;
+    if (parser.previous.decoded) {
+        string = takeString((char*)parser.previous.start, parser.previous.length);
+    } else {
+        string = copyString(parser.previous.start, parser.previous.length);
+    }
+    emitValue(OBJ_VAL(string));
 }
 
-static void namedVariable(Token name, bool canAssign) {
-    uint8_t getOp;
-    uint8_t setOp;
-    int arg = resolveLocal(current, &name);
-    if (arg != -1) {
-        getOp = OP_GET_LOCAL;
-        setOp = OP_SET_LOCAL;
+// Slot of a local, or the name constant of a global, with `isLocal` saying
+// which.
+static int resolveVariable(const Token* name, bool* isLocal) {
+    int arg = resolveLocal(current, name);
+    *isLocal = arg != -1;
+    return *isLocal ? arg : identifierConstant(name);
+}
+
+static void emitGetVariable(bool isLocal, int arg) {
+    if (isLocal) {
+        emitBytes(OP_GET_LOCAL, (uint8_t)arg);
     } else {
-        arg = identifierConstant(&name);
-        getOp = OP_GET_GLOBAL;
-        setOp = OP_SET_GLOBAL;
+        emitGlobalOp(OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, arg);
     }
+}
+
+static void emitSetVariable(bool isLocal, int arg) {
+    if (isLocal) {
+        emitBytes(OP_SET_LOCAL, (uint8_t)arg);
+    } else {
+        emitGlobalOp(OP_SET_GLOBAL, OP_SET_GLOBAL_LONG, arg);
+    }
+}
+
+static void namedVariable(Token name, bool canAssign) {
+    bool isLocal;
+    int arg = resolveVariable(&name, &isLocal);
     if (canAssign && match(TOKEN_EQ)) {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        emitSetVariable(isLocal, arg);
     } else {
-        emitBytes(getOp, (uint8_t)arg);
+        emitGetVariable(isLocal, arg);
     }
 }
 
@@ -485,14 +718,24 @@ static void variable(bool canAssign) {
 
 static void unary(bool canAssign) {
     TokenType operatorType = parser.previous.type;
+    OpCode op = operatorType == TOKEN_EXCLAM ? OP_NOT : OP_NEGATE;
 
+    int start = currentChunk()->count;
+    int constantCount = currentChunk()->constants.count;
     parsePrecedence(PREC_UNARY);
 
-    switch (operatorType) {
-        case TOKEN_EXCLAM: emitByte(OP_NOT); break;
-        case TOKEN_MINUS: emitByte(OP_NEGATE); break;
-        default: return;
+    Operand operand;
+    if (operandAt(start, &operand) && operand.isConstant) {
+        Value value;
+        if (foldUnaryOperator(operatorType, operand.value, &value)) {
+            truncateChunk(currentChunk(), operand.start, operand.constantCount);
+            emitValue(value);
+            return;
+        }
     }
+
+    emitByte(op);
+    trackOperand(start, constantCount, op == OP_NEGATE ? KIND_DOUBLE : KIND_UNKNOWN);
 }
 
 ParseRule rules[] = {  //    prefix   | infix  |  precedence
@@ -552,12 +795,14 @@ static void parsePrecedence(Precedence prec) {
         return;
     }
 
+    int start = currentChunk()->count;
     bool canAssign = prec <= PREC_ASSIGNMENT;
     prefixRule(canAssign);
 
     while (prec <= getRule(parser.current.type)->precedence) {
         advance();
         ParseFn infixRule = getRule(parser.previous.type)->infix;
+        infixOperandStart = start;
         infixRule(canAssign);
     }
 
@@ -582,9 +827,8 @@ static void block(void) {
     consume(TOKEN_RBRACE, "Expected '}' at end of block.");
 }
 
-static void function(FunctionType type) {
-    Compiler compiler;
-    initCompiler(&compiler, type);
+// Parameters and body, from the '(' on, into the current compiler.
+static void functionBody(void) {
     beginScope();
 
     consume(TOKEN_LPAREN, "Expected '(' after function name.");
@@ -594,7 +838,7 @@ static void function(FunctionType type) {
             if ((current->function->arity + current->function->defArity) > 255) {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expected parameter name.");
+            int constant = parseVariable("Expected parameter name.");
             if (match(TOKEN_EQ)) {
                 current->function->defArity++;
                 expression();
@@ -605,20 +849,107 @@ static void function(FunctionType type) {
     consume(TOKEN_RPAREN, "Expected ')' after function parameters.");
     consume(TOKEN_LBRACE, "Expected '{' before function body.");
     block();
+}
+
+// Skips tokens up to the `close` or `stop` that isn't nested in an inner
+// open/close pair, or to the end of the script.
+static void skipTokens(TokenType open, TokenType close, TokenType stop) {
+    int depth = 0;
+    while (!check(TOKEN_EOF)) {
+        if (depth == 0 && (check(close) || check(stop))) return;
+        if (check(open)) depth++;
+        if (check(close)) depth--;
+
+        if (parser.current.decoded) {
+            FREE_ARRAY(char, (char*)parser.current.start, parser.current.length + 1);
+        }
+        advance();
+    }
+}
+
+// Notes the function's signature and where its parameters start, and
+// skips its defaults and body; compileFunction() compiles them on the
+// function's first call. Only errors in the signature are found here.
+static void lazyFunction(void) {
+    ObjFunction* function = newFunction();
+    function->name = copyString(parser.previous.start, parser.previous.length);
+    function->source = parser.current.start;
+    function->line = parser.current.line;
+
+    consume(TOKEN_LPAREN, "Expected '(' after function name.");
+    if (!check(TOKEN_RPAREN)) {
+        do {
+            function->arity++;
+            if ((function->arity + function->defArity) > 255) {
+                errorAtCurrent("Can't have more than 255 parameters.");
+            }
+            consume(TOKEN_IDENTIFIER, "Expected parameter name.");
+            if (match(TOKEN_EQ)) {
+                function->defArity++;
+                skipTokens(TOKEN_LPAREN, TOKEN_RPAREN, TOKEN_COMMA);
+            }
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RPAREN, "Expected ')' after function parameters.");
+    consume(TOKEN_LBRACE, "Expected '{' before function body.");
+    skipTokens(TOKEN_LBRACE, TOKEN_RBRACE, TOKEN_RBRACE);
+    consume(TOKEN_RBRACE, "Expected '}' at end of block.");
+
+    emitConstant(OBJ_VAL(function));
+}
+
+static void function(FunctionType type) {
+    if (compilerOptions.lazy) {
+        lazyFunction();
+        return;
+    }
+
+    Compiler compiler;
+    initCompiler(&compiler, type, NULL);
+    functionBody();
 
     ObjFunction* function = endCompiler();
-    emitBytes(OP_CONSTANT, emitConstant(OBJ_VAL(function)));
+    emitConstant(OBJ_VAL(function));
+}
+
+// Compiles the body of a function lazyFunction() skipped, reporting any
+// compile errors in it. The function is left as it was if there are any.
+bool compileFunction(ObjFunction* function) {
+    int arity = function->arity;
+    int defArity = function->defArity;
+    function->arity = 0;
+    function->defArity = 0;
+
+    initScannerAt(function->source, function->line);
+    parser.hadError = false;
+    parser.panicMode = false;
+    innerLoopStart = -1;
+
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_FUNCTION, function);
+    advance();
+    functionBody();
+    endCompiler();
+
+    if (parser.hadError) {
+        freeChunk(&function->chunk);
+        function->arity = arity;
+        function->defArity = defArity;
+        return false;
+    }
+    function->source = NULL;
+    return true;
 }
 
 static void funcDeclaration(void) {
-    uint8_t global = parseVariable("Expected function name.");
+    int global = parseVariable("Expected function name.");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
 }
 
 static void varDeclaration(void) {
-    uint8_t global = parseVariable("Expect variable name.");
+    int global = parseVariable("Expect variable name.");
 
     if (match(TOKEN_EQ)) {
         expression();
@@ -631,6 +962,15 @@ static void varDeclaration(void) {
     defineVariable(global);
 }
 
+// Compiles a statement that can never run, only for its errors.
+static void deadStatement(void) {
+    int start = currentChunk()->count;
+    bool unreachable = current->unreachable;
+    statement();
+    discardCode(start);
+    current->unreachable = unreachable;
+}
+
 static void expressionStatement(void) {
     expression();
     consume(TOKEN_SEMI, "Expected ';' after expression.");
@@ -653,49 +993,180 @@ static void forStatement(void) {
     innerLoopStart = currentChunk()->count;
     innerLoopScopeDepth = current->scopeDepth;
 
+    // There is no break, so a loop that never tests false never ends.
     int exitJump = -1;
+    bool endless = true;
+    bool isTrue = true;
     if (!match(TOKEN_SEMI)) {
+        int conditionStart = currentChunk()->count;
         expression();
         consume(TOKEN_SEMI, "Expected ';'.");
 
-        exitJump = emitJumpLong(OP_JUMP_FALSE_LONG);
-        emitByte(OP_POP);
+        if (constantCondition(conditionStart, &isTrue)) {
+            discardCode(conditionStart);
+        } else {
+            exitJump = emitJumpLong(OP_JUMP_FALSE_LONG);
+            emitByte(OP_POP);
+            endless = false;
+        }
     }
 
-    if (!match(TOKEN_RPAREN)) {
-        int bodyJump = emitJumpLong(OP_JUMP_LONG);
-        int incStart = currentChunk()->count;
-        expression();
-        emitByte(OP_POP);
-        consume(TOKEN_RPAREN, "Expected ')' after for clause.");
+    if (!isTrue) {
+        // Only the initializer ever runs.
+        int deadStart = currentChunk()->count;
+        if (!match(TOKEN_RPAREN)) {
+            expression();
+            consume(TOKEN_RPAREN, "Expected ')' after for clause.");
+        }
+        deadStatement();
+        discardCode(deadStart);
+        endless = false;
+    } else {
+        if (!match(TOKEN_RPAREN)) {
+            int bodyJump = emitJumpLong(OP_JUMP_LONG);
+            int incStart = currentChunk()->count;
+            expression();
+            emitByte(OP_POP);
+            consume(TOKEN_RPAREN, "Expected ')' after for clause.");
 
-        emitLoopLong(innerLoopStart);
-        innerLoopStart = incStart;
-        patchJumpLong(bodyJump);
-    }
+            emitLoopLong(innerLoopStart);
+            innerLoopStart = incStart;
+            patchJumpLong(bodyJump);
+        }
 
-    statement();
-    emitLoopLong(innerLoopStart);
+        statement();
+        emitLoopLong(innerLoopStart);
 
-    if (exitJump != -1) {
-        patchJumpLong(exitJump);
-        emitByte(OP_POP);
+        if (exitJump != -1) {
+            patchJumpLong(exitJump);
+            emitByte(OP_POP);
+        }
     }
 
     innerLoopStart = surroundingLoopStart;
     innerLoopScopeDepth = surroundingLoopScopeDepth;
 
     endScope();
+    current->unreachable = endless;
+}
+
+// A range loop runs
+//
+//     entry:  jump to next
+//     body:   ...
+//     next:   OP_FOR_RANGE slot, loop back to body
+//
+// with the counter, stop and step in hidden locals from slot on and the
+// loop variable after them. OP_FOR_RANGE stores the counter in the loop
+// variable, steps it and jumps back in one go, while it is in range.
+// Continue goes back to the entry jump, which the peephole pass threads.
+typedef struct {
+    int slot;
+    int entryJump;
+    int bodyStart;
+    int surroundingLoopStart;
+    int surroundingLoopScopeDepth;
+} RangeLoop;
+
+// Called with the counter, stop and step declared, before the body.
+static void beginRangeBody(RangeLoop* loop, const Token* variable) {
+    emitByte(OP_NONE);
+    addLocal(*variable);
+    markInitialized();
+    loop->slot = current->localCount - 4;
+
+    loop->entryJump = emitJumpLong(OP_JUMP_LONG);
+    loop->surroundingLoopStart = innerLoopStart;
+    loop->surroundingLoopScopeDepth = innerLoopScopeDepth;
+    innerLoopStart = loop->entryJump - 1;
+    innerLoopScopeDepth = current->scopeDepth;
+    loop->bodyStart = currentChunk()->count;
+}
+
+// The range check is attributed to the loop's own line, not the body's last.
+static void endRange(RangeLoop* loop, int line) {
+    patchJumpLong(loop->entryJump);
+
+    Chunk* chunk = currentChunk();
+    writeChunk(chunk, OP_FOR_RANGE, line);
+    writeChunk(chunk, (uint8_t)loop->slot, line);
+    long long offset = (chunk->count - loop->bodyStart) + 4;
+    if (offset > UINT32_MAX) error("Loop body too large.");
+    writeChunk(chunk, (offset >> 24) & 0xff, line);
+    writeChunk(chunk, (offset >> 16) & 0xff, line);
+    writeChunk(chunk, (offset >> 8) & 0xff, line);
+    writeChunk(chunk, offset & 0xff, line);
+
+    innerLoopStart = loop->surroundingLoopStart;
+    innerLoopScopeDepth = loop->surroundingLoopScopeDepth;
+    endScope();
+    current->unreachable = false;
+}
+
+// for name in range([start,] stop[, step]) statement
+static void rangeStatement(void) {
+    int line = parser.previous.line;
+    beginScope();
+    Token variable = rangeHeader();
+
+    int arguments = 0;
+    do {
+        if (arguments == RANGE_MAX_ARGUMENTS) error("range() takes at most 3 arguments.");
+        expression();
+        addHiddenLocal();
+        arguments++;
+    } while (match(TOKEN_COMMA));
+    consume(TOKEN_RPAREN, "Expected ')' after range arguments.");
+
+    if (arguments == 1) {
+        // The one argument is the stop, so it moves up a slot to make way
+        // for a counter starting at 0.
+        int slot = current->localCount - 1;
+        emitBytes(OP_GET_LOCAL, (uint8_t)slot);
+        emitConstant(INTEGER_VAL(0));
+        emitBytes(OP_SET_LOCAL, (uint8_t)slot);
+        emitByte(OP_POP);
+        addHiddenLocal();
+    }
+    if (arguments < RANGE_MAX_ARGUMENTS) {
+        emitConstant(INTEGER_VAL(1));
+        addHiddenLocal();
+    }
+
+    RangeLoop loop;
+    beginRangeBody(&loop, &variable);
+    statement();
+    endRange(&loop, line);
 }
 
 static void ifStatement(void) {
     consume(TOKEN_LPAREN, "Expects '(' after 'if'.");
+    int conditionStart = currentChunk()->count;
     expression();
     consume(TOKEN_RPAREN, "Expects ')' after condition.");
 
+    bool unreachable = current->unreachable;
+    bool isTrue;
+    if (constantCondition(conditionStart, &isTrue)) {
+        // Only one branch can ever run, so it is compiled without a test.
+        discardCode(conditionStart);
+        if (isTrue) {
+            statement();
+            bool thenUnreachable = current->unreachable;
+            if (match(TOKEN_ELSE)) deadStatement();
+            current->unreachable = thenUnreachable;
+        } else {
+            deadStatement();
+            if (match(TOKEN_ELSE)) statement();
+        }
+        return;
+    }
+
     int thenJump = emitJumpLong(OP_JUMP_FALSE_LONG);
     emitByte(OP_POP);
     statement();
+    bool thenUnreachable = current->unreachable;
+    current->unreachable = unreachable;
 
     int elseJump = emitJumpLong(OP_JUMP_LONG);
 
@@ -704,6 +1175,7 @@ static void ifStatement(void) {
 
     if (match(TOKEN_ELSE)) statement();
     patchJumpLong(elseJump);
+    current->unreachable = current->unreachable && thenUnreachable;
 }
 
 static void printStatement(void) {
@@ -723,33 +1195,180 @@ static void returnStatement(void) {
         consume(TOKEN_SEMI, "Expected ';' after return value.");
         emitByte(OP_RETURN);
     }
+    current->unreachable = true;
 }
 
 static void whileStatement(void) {
-    int loopStart = currentChunk()->count;
+    int surroundingLoopStart = innerLoopStart;
+    int surroundingLoopScopeDepth = innerLoopScopeDepth;
+    innerLoopStart = currentChunk()->count;
+    innerLoopScopeDepth = current->scopeDepth;
+
     consume(TOKEN_LPAREN, "Expects '(' after 'while'.");
+    int conditionStart = currentChunk()->count;
     expression();
     consume(TOKEN_RPAREN, "Expects ')' after condition.");
 
-    int exitJump = emitJumpLong(OP_JUMP_FALSE_LONG);
-    emitByte(OP_POP);
-    statement();
-    emitLoopLong(loopStart);
+    bool isTrue;
+    if (constantCondition(conditionStart, &isTrue)) {
+        discardCode(conditionStart);
+        if (isTrue) {
+            // No break, so nothing after an endless loop runs.
+            statement();
+            emitLoopLong(innerLoopStart);
+        } else {
+            deadStatement();
+        }
+        current->unreachable = isTrue;
+    } else {
+        int exitJump = emitJumpLong(OP_JUMP_FALSE_LONG);
+        emitByte(OP_POP);
+        statement();
+        emitLoopLong(innerLoopStart);
 
-    patchJumpLong(exitJump);
-    emitByte(OP_POP);
+        patchJumpLong(exitJump);
+        emitByte(OP_POP);
+        current->unreachable = false;
+    }
+
+    innerLoopStart = surroundingLoopStart;
+    innerLoopScopeDepth = surroundingLoopScopeDepth;
+}
+
+// Jumps and dispatch state for one switch statement. While every case so
+// far has an integer or string literal label, the cases are only
+// recorded; their bodies follow one another, and after the last one
+// comes an OP_SWITCH that jumps straight to the right body. From the
+// first case that must be compared at runtime on, cases are compiled as
+// a chain of comparisons, which the dispatch falls back to when nothing
+// in its table matches.
+typedef struct {
+    int dispatchJump;   // jump over the bodies to the dispatch, -1 until there is a label
+    bool compared;      // a case is compiled as a comparison
+    int fallback;       // where the dispatch goes on no match, -1 for the end
+
+    Value* labels;
+    int* bodies;        // where the body for each label starts
+    int labelCount;
+    int labelCapacity;
+
+    int* ends;          // jumps to the end of the switch
+    int endCount;
+    int endCapacity;
+} SwitchJumps;
+
+static void initSwitchJumps(SwitchJumps* jumps) {
+    jumps->dispatchJump = -1;
+    jumps->compared = false;
+    jumps->fallback = -1;
+    jumps->labels = NULL;
+    jumps->bodies = NULL;
+    jumps->labelCount = 0;
+    jumps->labelCapacity = 0;
+    jumps->ends = NULL;
+    jumps->endCount = 0;
+    jumps->endCapacity = 0;
+}
+
+// The subject stays on the stack for the whole switch. Holding it in a
+// hidden local keeps the slots of locals declared in the cases right, and
+// lets continue pop it.
+static void beginSwitch(void) {
+    beginScope();
+    addHiddenLocal();
+}
+
+static void emitSwitchEnd(SwitchJumps* jumps) {
+    if (jumps->endCapacity < jumps->endCount + 1) {
+        int oldCapacity = jumps->endCapacity;
+        jumps->endCapacity = GROW_CAPACITY(oldCapacity);
+        jumps->ends = GROW_ARRAY(int, jumps->ends, oldCapacity, jumps->endCapacity);
+    }
+    jumps->ends[jumps->endCount++] = emitJumpLong(OP_JUMP_LONG);
+}
+
+static bool canDispatch(const SwitchJumps* jumps, Value label) {
+    return !jumps->compared && isSwitchLabel(label);
+}
+
+// A case whose label went into the table; its body starts here.
+static void addSwitchLabel(SwitchJumps* jumps, Value label) {
+    if (jumps->dispatchJump == -1) jumps->dispatchJump = emitJumpLong(OP_JUMP_LONG);
+
+    if (jumps->labelCapacity < jumps->labelCount + 1) {
+        int oldCapacity = jumps->labelCapacity;
+        jumps->labelCapacity = GROW_CAPACITY(oldCapacity);
+        jumps->labels = GROW_ARRAY(Value, jumps->labels, oldCapacity, jumps->labelCapacity);
+        jumps->bodies = GROW_ARRAY(int, jumps->bodies, oldCapacity, jumps->labelCapacity);
+    }
+    jumps->labels[jumps->labelCount] = label;
+    jumps->bodies[jumps->labelCount] = currentChunk()->count;
+    jumps->labelCount++;
+}
+
+// A case compiled as a comparison, starting at start.
+static void addSwitchComparison(SwitchJumps* jumps, int start) {
+    if (!jumps->compared) jumps->fallback = start;
+    jumps->compared = true;
+}
+
+static void addSwitchDefault(SwitchJumps* jumps) {
+    if (!jumps->compared) jumps->fallback = currentChunk()->count;
+}
+
+// Emits the dispatch, if there is one, and patches the jumps to the end.
+// Everything before the dispatch has already jumped or falls through to
+// the end.
+static void endSwitch(SwitchJumps* jumps) {
+    if (jumps->dispatchJump != -1) {
+        emitSwitchEnd(jumps);
+        patchJumpLong(jumps->dispatchJump);
+
+        ObjSwitch* table = newSwitch(jumps->labels, jumps->labelCount);
+        int constant = addConstant(currentChunk(), OBJ_VAL(table));
+        emitByte(OP_SWITCH);
+        emitByte(constant & 0xff);
+        emitByte((constant >> 8) & 0xff);
+        emitByte((constant >> 16) & 0xff);
+
+        for (int i = 0; i < jumps->labelCount; i++) emitLoopLong(jumps->bodies[i]);
+        if (jumps->fallback != -1) {
+            emitLoopLong(jumps->fallback);
+        } else {
+            emitSwitchEnd(jumps);
+        }
+    }
+
+    for (int i = 0; i < jumps->endCount; i++) patchJumpLong(jumps->ends[i]);
+    endScope();
+
+    FREE_ARRAY(Value, jumps->labels, jumps->labelCapacity);
+    FREE_ARRAY(int, jumps->bodies, jumps->labelCapacity);
+    FREE_ARRAY(int, jumps->ends, jumps->endCapacity);
 }
 
 static void switchStatement(void) {
     consume(TOKEN_LPAREN, "Expected '(' after 'switch'.");
+    int subjectStart = currentChunk()->count;
     expression();
     consume(TOKEN_RPAREN, "Expected ')' after value.");
     consume(TOKEN_LBRACE, "Expected '{' before cases.");
 
+    Operand subject;
+    bool constantSubject = operandAt(subjectStart, &subject) && subject.isConstant;
+    beginSwitch();
+
     int state = 0;
-    int caseEnds[256];
-    int caseCount = 0;
+    SwitchJumps jumps;
+    initSwitchJumps(&jumps);
     int previousCaseSkip = -1;
+    bool inBody = false;
+
+    // With a constant subject, a case with a constant value either never
+    // matches, and is dropped, or always does, and everything after it is
+    // dead.
+    bool deadCase = false;
+    bool matched = false;
 
     while (!match(TOKEN_RBRACE) && !check(TOKEN_EOF)) {
         if (match(TOKEN_CASE) || match(TOKEN_DEFAULT)) {
@@ -759,29 +1378,55 @@ static void switchStatement(void) {
                 error("Can't have extra cases after the default case.");
             }
 
-            if (state == 1) {
-                caseEnds[caseCount++] = emitJumpLong(OP_JUMP_LONG);
-
+            if (inBody) {
+                emitSwitchEnd(&jumps);
+                inBody = false;
+            }
+            if (previousCaseSkip != -1) {
                 patchJumpLong(previousCaseSkip);
                 emitByte(OP_POP);
+                previousCaseSkip = -1;
             }
+            current->unreachable = false;
 
             if (caseType == TOKEN_CASE) {
                 state = 1;
 
+                int caseStart = currentChunk()->count;
                 emitByte(OP_DUP);
+                int valueStart = currentChunk()->count;
                 expression();
 
                 consume(TOKEN_COLON, "Expected ':' after case value.");
 
-                emitByte(OP_EQUAL);
-                previousCaseSkip = emitJumpLong(OP_JUMP_FALSE_LONG);
-
-                emitByte(OP_POP);
+                Operand value;
+                bool constantValue = operandAt(valueStart, &value) && value.isConstant;
+                if (matched) {
+                    discardCode(caseStart);
+                    deadCase = true;
+                } else if (constantSubject && constantValue) {
+                    discardCode(caseStart);
+                    deadCase = !valuesEqual(subject.value, value.value);
+                    matched = !deadCase;
+                } else if (constantValue && canDispatch(&jumps, value.value)) {
+                    discardCode(caseStart);
+                    addSwitchLabel(&jumps, value.value);
+                    deadCase = false;
+                    inBody = true;
+                } else {
+                    addSwitchComparison(&jumps, caseStart);
+                    emitByte(OP_EQUAL);
+                    previousCaseSkip = emitJumpLong(OP_JUMP_FALSE_LONG);
+
+                    emitByte(OP_POP);
+                    deadCase = false;
+                    inBody = true;
+                }
             } else if (caseType == TOKEN_DEFAULT) {
                 state = 2;
                 consume(TOKEN_COLON, "Expected ':' after default.");
-                previousCaseSkip = -1;
+                deadCase = matched;
+                if (!matched) addSwitchDefault(&jumps);
             } else {
                 error("Only 'case' and 'default' allowed with switch statement.");
             }
@@ -789,29 +1434,25 @@ static void switchStatement(void) {
             if (state == 0) {
                 error("Can't have statements before case.");
             }
-            statement();
+            if (deadCase) {
+                deadStatement();
+            } else {
+                statement();
+            }
         }
     }
 
-    if (state == 1) {
+    if (previousCaseSkip != -1) {
+        emitSwitchEnd(&jumps);
         patchJumpLong(previousCaseSkip);
         emitByte(OP_POP);
     }
 
-    for (int i = 0; i < caseCount; i++) {
-        patchJumpLong(caseEnds[i]);
-    }
-
-    emitByte(OP_POP);
+    endSwitch(&jumps);
+    current->unreachable = false;
 }
 
-static void continueStatement(void) {
-    if (innerLoopStart == -1) {
-        error("Can't use 'continue' outside of a loop.");
-    }
-
-    consume(TOKEN_SEMI, "Expected ';' after 'continue'.");
-
+static void emitContinue(void) {
     for (int i = current->localCount - 1;
          i > 0 && current->locals[i].depth > innerLoopScopeDepth;
          i--) {
@@ -821,28 +1462,21 @@ static void continueStatement(void) {
          emitLoopLong(innerLoopStart);
 }
 
-static void synchronize(void) {
-    parser.panicMode = false;
-
-    while (parser.previous.type != TOKEN_EOF) {
-        if (parser.previous.type == TOKEN_SEMI) return;
-        switch (parser.current.type) {
-            case TOKEN_CLASS:
-            case TOKEN_DEF:
-            case TOKEN_VAR:
-            case TOKEN_FOR:
-            case TOKEN_IF:
-            case TOKEN_WHILE:
-            case TOKEN_PRINT:
-            case TOKEN_RETURN: return;
-            default: ;
-        }
-
-        advance();
+static void continueStatement(void) {
+    if (innerLoopStart == -1) {
+        error("Can't use 'continue' outside of a loop.");
     }
+
+    consume(TOKEN_SEMI, "Expected ';' after 'continue'.");
+    emitContinue();
+    current->unreachable = true;
 }
 
 static void declaration(void) {
+    int start = currentChunk()->count;
+    int localCount = current->localCount;
+    bool unreachable = current->unreachable;
+
     if (match(TOKEN_DEF)) {
         funcDeclaration();
     } else if (match(TOKEN_VAR)) {
@@ -851,6 +1485,13 @@ static void declaration(void) {
         statement();
     }
 
+    // Dead code is still compiled, for its errors, then dropped. A local
+    // declared here keeps its slot, though, so its code has to stay.
+    if (unreachable) {
+        if (current->localCount == localCount) discardCode(start);
+        current->unreachable = true;
+    }
+
     if (parser.panicMode) synchronize();
 }
 
@@ -858,7 +1499,11 @@ static void statement(void) {
     if (match(TOKEN_PRINT)) {
         printStatement();
     } else if (match(TOKEN_FOR)) {
-        forStatement();
+        if (check(TOKEN_IDENTIFIER)) {
+            rangeStatement();
+        } else {
+            forStatement();
+        }
     } else if (match(TOKEN_IF)) {
         ifStatement();
     } else if (match(TOKEN_RETURN)) {
@@ -878,13 +1523,396 @@ static void statement(void) {
     }
 }
 
+// Lowering of the AST built by the optimising pipeline. It emits the same
+// instruction sequences as the direct compiler above, through the same
+// helpers, and points parser.previous at each node's token, or at its end
+// token for the node's own instruction, so that lines and error locations
+// come out as if the node had just been parsed.
+
+static void lowerExpression(Node* node);
+static void lowerStatement(Node* node);
+
+// The line to give code on line of a node the inliner copied in from site.
+static int siteLine(const InlineSite* site, int line) {
+    if (site == NULL) return line;
+    int caller = siteLine(site->caller, site->call.line);
+    ObjString* function = copyStringHashed(site->function.start, site->function.length,
+                                           symbolHash(site->function.symbol));
+    return addInlinedLine(currentChunk(), line, caller, function);
+}
+
+static void at(const Node* node) {
+    parser.previous = node->token;
+    inlinedLine = node->site != NULL ? siteLine(node->site, node->token.line) : 0;
+}
+
+static void atEnd(const Node* node) {
+    parser.previous = node->end;
+    inlinedLine = node->site != NULL ? siteLine(node->site, node->end.line) : 0;
+}
+
+static void lowerExpression(Node* node) {
+    switch (node->type) {
+        case NODE_LITERAL:
+            at(node);
+            emitValue(node->as.literal);
+            break;
+
+        case NODE_VARIABLE: {
+            at(node);
+            bool isLocal;
+            int arg = resolveVariable(&node->token, &isLocal);
+            emitGetVariable(isLocal, arg);
+            break;
+        }
+
+        case NODE_ASSIGN: {
+            at(node);
+            bool isLocal;
+            int arg = resolveVariable(&node->token, &isLocal);
+            lowerExpression(node->as.unary.operand);
+            atEnd(node);
+            emitSetVariable(isLocal, arg);
+            break;
+        }
+
+        case NODE_UNARY:
+            lowerExpression(node->as.unary.operand);
+            atEnd(node);
+            emitByte(node->token.type == TOKEN_EXCLAM ? OP_NOT : OP_NEGATE);
+            break;
+
+        case NODE_BINARY:
+            lowerExpression(node->as.binary.left);
+            lowerExpression(node->as.binary.right);
+            atEnd(node);
+            emitBinaryOperator(node->token.type);
+            break;
+
+        case NODE_AND: {
+            lowerExpression(node->as.binary.left);
+            at(node);
+            int endJump = emitJumpLong(OP_JUMP_FALSE_LONG);
+            emitByte(OP_POP);
+            lowerExpression(node->as.binary.right);
+            patchJumpLong(endJump);
+            break;
+        }
+
+        case NODE_OR: {
+            lowerExpression(node->as.binary.left);
+            at(node);
+            int elseJump = emitJumpLong(OP_JUMP_FALSE_LONG);
+            int endJump = emitJumpLong(OP_JUMP_LONG);
+            patchJumpLong(elseJump);
+            emitByte(OP_POP);
+            lowerExpression(node->as.binary.right);
+            patchJumpLong(endJump);
+            break;
+        }
+
+        case NODE_CALL: {
+            lowerExpression(node->as.call.callee);
+            NodeList* arguments = &node->as.call.arguments;
+            for (int i = 0; i < arguments->count; i++) {
+                lowerExpression(arguments->items[i]);
+            }
+            atEnd(node);
+            emitBytes(OP_CALL, (uint8_t)arguments->count);
+            break;
+        }
+
+        default:
+            break;
+    }
+}
+
+static void lowerFunction(Node* node) {
+    Compiler compiler;
+    at(node);
+    initCompiler(&compiler, TYPE_FUNCTION, NULL);
+    beginScope();
+
+    NodeList* parameters = &node->as.function.parameters;
+    for (int i = 0; i < parameters->count; i++) {
+        Node* parameter = parameters->items[i];
+        current->function->arity++;
+        at(parameter);
+        declareNamedVariable();
+        if (parameter->as.unary.operand != NULL) {
+            current->function->defArity++;
+            lowerExpression(parameter->as.unary.operand);
+        }
+        defineVariable(0);
+    }
+
+    NodeList* body = &node->as.function.body;
+    for (int i = 0; i < body->count; i++) {
+        lowerStatement(body->items[i]);
+    }
+
+    atEnd(node);
+    ObjFunction* function = endCompiler();
+    emitConstant(OBJ_VAL(function));
+}
+
+static void lowerLoopBody(Node* body, int loopStart) {
+    int surroundingLoopStart = innerLoopStart;
+    int surroundingLoopScopeDepth = innerLoopScopeDepth;
+    innerLoopStart = loopStart;
+    innerLoopScopeDepth = current->scopeDepth;
+
+    lowerStatement(body);
+    emitLoopLong(innerLoopStart);
+
+    innerLoopStart = surroundingLoopStart;
+    innerLoopScopeDepth = surroundingLoopScopeDepth;
+}
+
+static void lowerStatement(Node* node) {
+    parser.panicMode = false;
+
+    switch (node->type) {
+        case NODE_EXPRESSION:
+            lowerExpression(node->as.unary.operand);
+            atEnd(node);
+            emitByte(OP_POP);
+            break;
+
+        case NODE_PRINT:
+            lowerExpression(node->as.unary.operand);
+            atEnd(node);
+            emitByte(OP_PRINT);
+            break;
+
+        case NODE_VAR: {
+            at(node);
+            int global = declareNamedVariable();
+            if (node->as.unary.operand != NULL) {
+                lowerExpression(node->as.unary.operand);
+            } else {
+                emitByte(OP_NONE);
+            }
+            atEnd(node);
+            defineVariable(global);
+            break;
+        }
+
+        case NODE_FUNCTION: {
+            at(node);
+            int global = declareNamedVariable();
+            markInitialized();
+            lowerFunction(node);
+            atEnd(node);
+            defineVariable(global);
+            break;
+        }
+
+        case NODE_BLOCK:
+            beginScope();
+            for (int i = 0; i < node->as.list.count; i++) {
+                lowerStatement(node->as.list.items[i]);
+            }
+            atEnd(node);
+            endScope();
+            break;
+
+        case NODE_IF: {
+            lowerExpression(node->as.branch.condition);
+            atEnd(node);
+            int thenJump = emitJumpLong(OP_JUMP_FALSE_LONG);
+            emitByte(OP_POP);
+            lowerStatement(node->as.branch.thenBranch);
+
+            int elseJump = emitJumpLong(OP_JUMP_LONG);
+            patchJumpLong(thenJump);
+            emitByte(OP_POP);
+
+            if (node->as.branch.elseBranch != NULL) lowerStatement(node->as.branch.elseBranch);
+            patchJumpLong(elseJump);
+            break;
+        }
+
+        case NODE_WHILE: {
+            // The dead code pass clears the condition of an endless loop.
+            int loopStart = currentChunk()->count;
+            int exitJump = -1;
+            if (node->as.loop.condition != NULL) {
+                lowerExpression(node->as.loop.condition);
+                atEnd(node);
+                exitJump = emitJumpLong(OP_JUMP_FALSE_LONG);
+                emitByte(OP_POP);
+            }
+            lowerLoopBody(node->as.loop.body, loopStart);
+
+            if (exitJump != -1) {
+                patchJumpLong(exitJump);
+                emitByte(OP_POP);
+            }
+            break;
+        }
+
+        case NODE_FOR: {
+            beginScope();
+            if (node->as.loop.initializer != NULL) lowerStatement(node->as.loop.initializer);
+
+            int loopStart = currentChunk()->count;
+            int exitJump = -1;
+            if (node->as.loop.condition != NULL) {
+                lowerExpression(node->as.loop.condition);
+                atEnd(node);
+                exitJump = emitJumpLong(OP_JUMP_FALSE_LONG);
+                emitByte(OP_POP);
+            }
+
+            if (node->as.loop.increment != NULL) {
+                int bodyJump = emitJumpLong(OP_JUMP_LONG);
+                int incrementStart = currentChunk()->count;
+                lowerExpression(node->as.loop.increment);
+                emitByte(OP_POP);
+                emitLoopLong(loopStart);
+                loopStart = incrementStart;
+                patchJumpLong(bodyJump);
+            }
+
+            lowerLoopBody(node->as.loop.body, loopStart);
+
+            if (exitJump != -1) {
+                patchJumpLong(exitJump);
+                emitByte(OP_POP);
+            }
+            endScope();
+            break;
+        }
+
+        case NODE_RANGE: {
+            beginScope();
+            lowerExpression(node->as.range.start);
+            at(node);
+            addHiddenLocal();
+            lowerExpression(node->as.range.stop);
+            at(node);
+            addHiddenLocal();
+            lowerExpression(node->as.range.step);
+            at(node);
+            addHiddenLocal();
+
+            RangeLoop loop;
+            beginRangeBody(&loop, &node->token);
+            lowerStatement(node->as.range.body);
+            endRange(&loop, node->token.line);
+            break;
+        }
+
+        case NODE_RETURN:
+            if (node->as.unary.operand == NULL) {
+                atEnd(node);
+                emitReturn();
+            } else {
+                lowerExpression(node->as.unary.operand);
+                atEnd(node);
+                emitByte(OP_RETURN);
+            }
+            break;
+
+        case NODE_SWITCH: {
+            lowerExpression(node->as.switchStmt.subject);
+            at(node);
+            beginSwitch();
+
+            SwitchJumps jumps;
+            initSwitchJumps(&jumps);
+            int previousCaseSkip = -1;
+            bool inBody = false;
+
+            NodeList* cases = &node->as.switchStmt.cases;
+            for (int i = 0; i < cases->count; i++) {
+                Node* arm = cases->items[i];
+                at(arm);
+                if (inBody) {
+                    emitSwitchEnd(&jumps);
+                    inBody = false;
+                }
+                if (previousCaseSkip != -1) {
+                    patchJumpLong(previousCaseSkip);
+                    emitByte(OP_POP);
+                    previousCaseSkip = -1;
+                }
+
+                Node* value = arm->as.caseArm.value;
+                if (value == NULL) {
+                    addSwitchDefault(&jumps);
+                } else if (value->type == NODE_LITERAL && canDispatch(&jumps, value->as.literal)) {
+                    atEnd(arm);
+                    addSwitchLabel(&jumps, value->as.literal);
+                    inBody = true;
+                } else {
+                    addSwitchComparison(&jumps, currentChunk()->count);
+                    emitByte(OP_DUP);
+                    lowerExpression(value);
+                    atEnd(arm);
+                    emitByte(OP_EQUAL);
+                    previousCaseSkip = emitJumpLong(OP_JUMP_FALSE_LONG);
+                    emitByte(OP_POP);
+                    inBody = true;
+                }
+
+                for (int j = 0; j < arm->as.caseArm.body.count; j++) {
+                    lowerStatement(arm->as.caseArm.body.items[j]);
+                }
+            }
+
+            atEnd(node);
+            if (previousCaseSkip != -1) {
+                emitSwitchEnd(&jumps);
+                patchJumpLong(previousCaseSkip);
+                emitByte(OP_POP);
+            }
+            endSwitch(&jumps);
+            break;
+        }
+
+        case NODE_CONTINUE:
+            atEnd(node);
+            emitContinue();
+            break;
+
+        default:
+            break;
+    }
+}
+
+static ObjFunction* compileProgram(const char* source) {
+    Node* program = parseProgram(source);
+    if (program == NULL) {
+        freeNodes();
+        return NULL;
+    }
+    Token end = parser.previous;
+
+    runPasses(program);
+
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_SCRIPT, NULL);
+    for (int i = 0; i < program->as.list.count; i++) {
+        lowerStatement(program->as.list.items[i]);
+    }
+    parser.previous = end;
+    inlinedLine = 0;
+    ObjFunction* function = endCompiler();
+
+    freeNodes();
+    return parser.hadError ? NULL : function;
+}
+
 ObjFunction* compile(const char* source) {
+    if (compilerOptions.pipeline) return compileProgram(source);
+
     initScanner(source);
     Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+    initCompiler(&compiler, TYPE_SCRIPT, NULL);
     parser.hadError = false;
     parser.panicMode = false;
-    initTable(&stringConstants);
 
     advance();
 
@@ -893,6 +1921,10 @@ ObjFunction* compile(const char* source) {
     }
 
     ObjFunction* function = endCompiler();
-    freeTable(&stringConstants);
     return parser.hadError ? NULL : function;
 }
+
+void freeCompiler(void) {
+    freeSymbols();
+    freePeephole();
+}
@@ -2,6 +2,7 @@
 
 #include "debug.h"
 #include "value.h"
+#include "vm.h"
 
 void disassembleChunk(const Chunk* chunk, const char* name) {
     printf("== %s == \n", name);
@@ -14,7 +15,9 @@ void disassembleChunk(const Chunk* chunk, const char* name) {
 static int constantInstruction(const char* name, const Chunk* chunk, int offset) {
     uint8_t constant = chunk->code[offset + 1];
     printf("%-16s %4d '", name, constant);
+    flushOutput(&vm->output);
     printValue(chunk->constants.values[constant]);
+    flushOutput(&vm->output);
     printf("'\n");
     return offset + 2;
 }
@@ -24,7 +27,9 @@ static int longConstantInstruction(const char* name, const Chunk* chunk, int off
                         (chunk->code[offset + 2] << 8) |
                         (chunk->code[offset + 3] << 16);
     printf("%-16s %4d '", name, constant);
+    flushOutput(&vm->output);
     printValue(chunk->constants.values[constant]);
+    flushOutput(&vm->output);
     printf("'\n");
     return offset + 4;
 }
@@ -56,14 +61,24 @@ static int jumpInstructionLong(const char* name, int sign, const Chunk* chunk, i
     return offset + 5;
 }
 
+static int rangeInstruction(const char* name, const Chunk* chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint32_t jump = (uint32_t)(chunk->code[offset + 2] << 24);
+    jump |= (chunk->code[offset + 3] << 16);
+    jump |= (chunk->code[offset + 4] << 8);
+    jump |= chunk->code[offset + 5];
+    printf("%-16s %4d %4d -> %d\n", name, slot, offset, offset + 6 - jump);
+    return offset + 6;
+}
+
 int disassembleInstruction(const Chunk* chunk, int offset) {
     printf("%04d ", offset);
 
-    if (offset > 0 &&
-        chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", sourceLine(chunk, line));
     }
 
     uint8_t instruction = chunk->code[offset];
@@ -84,12 +99,24 @@ int disassembleInstruction(const Chunk* chunk, int offset) {
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
         case OP_SET_LOCAL:
             return byteInstruction("OP_SET_LOCAL", chunk, offset);
+        case OP_STORE_LOCAL:
+            return byteInstruction("OP_STORE_LOCAL", chunk, offset);
         case OP_GET_GLOBAL:
             return constantInstruction("OP_GET_GLOBAL", chunk, offset);
         case OP_DEF_GLOBAL:
             return constantInstruction("OP_DEF_GLOBAL", chunk, offset);
         case OP_SET_GLOBAL:
             return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+        case OP_STORE_GLOBAL:
+            return constantInstruction("OP_STORE_GLOBAL", chunk, offset);
+        case OP_GET_GLOBAL_LONG:
+            return longConstantInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
+        case OP_DEF_GLOBAL_LONG:
+            return longConstantInstruction("OP_DEF_GLOBAL_LONG", chunk, offset);
+        case OP_SET_GLOBAL_LONG:
+            return longConstantInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+        case OP_STORE_GLOBAL_LONG:
+            return longConstantInstruction("OP_STORE_GLOBAL_LONG", chunk, offset);
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
         case OP_GREATER:
@@ -120,10 +147,18 @@ int disassembleInstruction(const Chunk* chunk, int offset) {
             return jumpInstructionLong("OP_JUMP_LONG", 1, chunk, offset);
         case OP_JUMP_FALSE_LONG:
             return jumpInstructionLong("OP_JUMP_FALSE_LONG", 1, chunk, offset);
+        case OP_POP_JUMP_FALSE:
+            return jumpInstruction("OP_POP_JUMP_FALSE", 1, chunk, offset);
+        case OP_POP_JUMP_FALSE_LONG:
+            return jumpInstructionLong("OP_POP_JUMP_FALSE_LONG", 1, chunk, offset);
         case OP_LOOP:
-            return jumpInstructionLong("OP_LOOP", -1, chunk, offset);
+            return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_LOOP_LONG:
             return jumpInstructionLong("OP_LOOP_LONG", -1, chunk, offset);
+        case OP_SWITCH:
+            return longConstantInstruction("OP_SWITCH", chunk, offset);
+        case OP_FOR_RANGE:
+            return rangeInstruction("OP_FOR_RANGE", chunk, offset);
         case OP_RETURN:
             return simpleInstruction("OP_RETURN", offset);
         case OP_PRINT:
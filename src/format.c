@@ -0,0 +1,320 @@
+#include <string.h>
+
+#include "format.h"
+#include "format_tables.h"
+
+// Number to text conversion for printValue() and asString(). Neither
+// formatter allocates or touches stdio (and so the C locale), they write
+// straight into the buffer they are given and return the length written.
+
+#define DOUBLE_MANTISSA_BITS 52
+#define DOUBLE_EXPONENT_BITS 11
+#define DOUBLE_BIAS 1023
+
+typedef __uint128_t uint128_t;
+
+static const char DIGIT_PAIRS[200] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+static int decimalLength(uint64_t value) {
+    int length = 1;
+    while (value >= 10) {
+        value /= 10;
+        length++;
+    }
+    return length;
+}
+
+// Writes exactly `length` digits of value, right to left.
+static void writeDigits(uint64_t value, char* dest, int length) {
+    char* cursor = dest + length;
+    while (value >= 100) {
+        uint32_t pair = (uint32_t)(value % 100) * 2;
+        value /= 100;
+        *--cursor = DIGIT_PAIRS[pair + 1];
+        *--cursor = DIGIT_PAIRS[pair];
+    }
+    if (value >= 10) {
+        uint32_t pair = (uint32_t)value * 2;
+        *--cursor = DIGIT_PAIRS[pair + 1];
+        *--cursor = DIGIT_PAIRS[pair];
+    } else {
+        *--cursor = (char)('0' + value);
+    }
+}
+
+int formatInteger(long value, char* dest) {
+    char* cursor = dest;
+    uint64_t magnitude = (uint64_t)value;
+    if (value < 0) {
+        *cursor++ = '-';
+        magnitude = 0 - magnitude;
+    }
+
+    int length = decimalLength(magnitude);
+    writeDigits(magnitude, cursor, length);
+    cursor += length;
+    *cursor = '\0';
+    return (int)(cursor - dest);
+}
+
+// Ryu (Ulf Adams, PLDI 2018) finds the shortest decimal that still reads back
+// as the same double, which is what "%g" gets wrong for values like 0.1 + 0.2.
+
+static int32_t pow5bits(int32_t e) {
+    return (int32_t)(((((uint32_t)e) * 1217359) >> 19) + 1);
+}
+
+static uint32_t log10Pow2(int32_t e) {
+    return (((uint32_t)e) * 78913) >> 18;
+}
+
+static uint32_t log10Pow5(int32_t e) {
+    return (((uint32_t)e) * 732923) >> 20;
+}
+
+static uint32_t pow5Factor(uint64_t value) {
+    uint32_t count = 0;
+    for (;;) {
+        uint64_t q = value / 5;
+        uint32_t r = (uint32_t)(value - 5 * q);
+        if (r != 0) break;
+        value = q;
+        count++;
+    }
+    return count;
+}
+
+static bool multipleOfPowerOf5(uint64_t value, uint32_t p) {
+    return pow5Factor(value) >= p;
+}
+
+static bool multipleOfPowerOf2(uint64_t value, uint32_t p) {
+    return (value & ((1ull << p) - 1)) == 0;
+}
+
+static uint64_t mulShift64(uint64_t m, const uint64_t* mul, int32_t j) {
+    uint128_t b0 = ((uint128_t)m) * mul[0];
+    uint128_t b2 = ((uint128_t)m) * mul[1];
+    return (uint64_t)(((b0 >> 64) + b2) >> (j - 64));
+}
+
+static uint64_t mulShiftAll64(uint64_t m, const uint64_t* mul, int32_t j,
+                              uint64_t* vp, uint64_t* vm, uint32_t mmShift) {
+    *vp = mulShift64(4 * m + 2, mul, j);
+    *vm = mulShift64(4 * m - 1 - mmShift, mul, j);
+    return mulShift64(4 * m, mul, j);
+}
+
+// Converts a finite, non-zero double into mantissa * 10^exponent with the
+// fewest mantissa digits.
+static uint64_t shortestDecimal(uint64_t ieeeMantissa, uint32_t ieeeExponent,
+                                int32_t* exponent) {
+    int32_t e2;
+    uint64_t m2;
+    if (ieeeExponent == 0) {
+        e2 = 1 - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+        m2 = ieeeMantissa;
+    } else {
+        e2 = (int32_t)ieeeExponent - DOUBLE_BIAS - DOUBLE_MANTISSA_BITS - 2;
+        m2 = (1ull << DOUBLE_MANTISSA_BITS) | ieeeMantissa;
+    }
+    bool acceptBounds = (m2 & 1) == 0;
+
+    uint64_t mv = 4 * m2;
+    uint32_t mmShift = ieeeMantissa != 0 || ieeeExponent <= 1;
+
+    uint64_t vr, vp, vm;
+    int32_t e10;
+    bool vmIsTrailingZeros = false;
+    bool vrIsTrailingZeros = false;
+    if (e2 >= 0) {
+        uint32_t q = log10Pow2(e2) - (e2 > 3);
+        e10 = (int32_t)q;
+        int32_t k = DOUBLE_POW5_INV_BITCOUNT + pow5bits((int32_t)q) - 1;
+        int32_t i = -e2 + (int32_t)q + k;
+        vr = mulShiftAll64(m2, DOUBLE_POW5_INV_SPLIT[q], i, &vp, &vm, mmShift);
+        if (q <= 21) {
+            if (mv % 5 == 0) {
+                vrIsTrailingZeros = multipleOfPowerOf5(mv, q);
+            } else if (acceptBounds) {
+                vmIsTrailingZeros = multipleOfPowerOf5(mv - 1 - mmShift, q);
+            } else {
+                vp -= multipleOfPowerOf5(mv + 2, q);
+            }
+        }
+    } else {
+        uint32_t q = log10Pow5(-e2) - (-e2 > 1);
+        e10 = (int32_t)q + e2;
+        int32_t i = -e2 - (int32_t)q;
+        int32_t k = pow5bits(i) - DOUBLE_POW5_BITCOUNT;
+        int32_t j = (int32_t)q - k;
+        vr = mulShiftAll64(m2, DOUBLE_POW5_SPLIT[i], j, &vp, &vm, mmShift);
+        if (q <= 1) {
+            vrIsTrailingZeros = true;
+            if (acceptBounds) {
+                vmIsTrailingZeros = mmShift == 1;
+            } else {
+                vp--;
+            }
+        } else if (q < 63) {
+            vrIsTrailingZeros = multipleOfPowerOf2(mv, q);
+        }
+    }
+
+    int32_t removed = 0;
+    uint8_t lastRemovedDigit = 0;
+    uint64_t output;
+    if (vmIsTrailingZeros || vrIsTrailingZeros) {
+        for (;;) {
+            uint64_t vpDiv10 = vp / 10;
+            uint64_t vmDiv10 = vm / 10;
+            if (vpDiv10 <= vmDiv10) break;
+            uint32_t vmMod10 = (uint32_t)(vm - 10 * vmDiv10);
+            uint64_t vrDiv10 = vr / 10;
+            uint32_t vrMod10 = (uint32_t)(vr - 10 * vrDiv10);
+            vmIsTrailingZeros &= vmMod10 == 0;
+            vrIsTrailingZeros &= lastRemovedDigit == 0;
+            lastRemovedDigit = (uint8_t)vrMod10;
+            vr = vrDiv10;
+            vp = vpDiv10;
+            vm = vmDiv10;
+            removed++;
+        }
+        if (vmIsTrailingZeros) {
+            for (;;) {
+                uint64_t vmDiv10 = vm / 10;
+                uint32_t vmMod10 = (uint32_t)(vm - 10 * vmDiv10);
+                if (vmMod10 != 0) break;
+                uint64_t vpDiv10 = vp / 10;
+                uint64_t vrDiv10 = vr / 10;
+                uint32_t vrMod10 = (uint32_t)(vr - 10 * vrDiv10);
+                vrIsTrailingZeros &= lastRemovedDigit == 0;
+                lastRemovedDigit = (uint8_t)vrMod10;
+                vr = vrDiv10;
+                vp = vpDiv10;
+                vm = vmDiv10;
+                removed++;
+            }
+        }
+        if (vrIsTrailingZeros && lastRemovedDigit == 5 && vr % 2 == 0) {
+            lastRemovedDigit = 4;  // the exact value ends in ...50..0, round to even
+        }
+        output = vr + ((vr == vm && (!acceptBounds || !vmIsTrailingZeros)) ||
+                       lastRemovedDigit >= 5);
+    } else {
+        bool roundUp = false;
+        uint64_t vpDiv100 = vp / 100;
+        uint64_t vmDiv100 = vm / 100;
+        if (vpDiv100 > vmDiv100) {
+            uint64_t vrDiv100 = vr / 100;
+            uint32_t vrMod100 = (uint32_t)(vr - 100 * vrDiv100);
+            roundUp = vrMod100 >= 50;
+            vr = vrDiv100;
+            vp = vpDiv100;
+            vm = vmDiv100;
+            removed += 2;
+        }
+        for (;;) {
+            uint64_t vpDiv10 = vp / 10;
+            uint64_t vmDiv10 = vm / 10;
+            if (vpDiv10 <= vmDiv10) break;
+            uint64_t vrDiv10 = vr / 10;
+            uint32_t vrMod10 = (uint32_t)(vr - 10 * vrDiv10);
+            roundUp = vrMod10 >= 5;
+            vr = vrDiv10;
+            vp = vpDiv10;
+            vm = vmDiv10;
+            removed++;
+        }
+        output = vr + (vr == vm || roundUp);
+    }
+
+    *exponent = e10 + removed;
+    return output;
+}
+
+int formatDouble(double value, char* dest) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bool sign = ((bits >> (DOUBLE_MANTISSA_BITS + DOUBLE_EXPONENT_BITS)) & 1) != 0;
+    uint64_t ieeeMantissa = bits & ((1ull << DOUBLE_MANTISSA_BITS) - 1);
+    uint32_t ieeeExponent = (uint32_t)((bits >> DOUBLE_MANTISSA_BITS) &
+                                       ((1u << DOUBLE_EXPONENT_BITS) - 1));
+
+    char* cursor = dest;
+    if (ieeeExponent == ((1u << DOUBLE_EXPONENT_BITS) - 1)) {
+        if (ieeeMantissa != 0) {
+            memcpy(cursor, "nan", 4);
+            return 3;
+        }
+        if (sign) *cursor++ = '-';
+        memcpy(cursor, "inf", 4);
+        return (int)(cursor - dest) + 3;
+    }
+
+    if (sign) *cursor++ = '-';
+    if (ieeeExponent == 0 && ieeeMantissa == 0) {
+        *cursor++ = '0';
+        *cursor = '\0';
+        return (int)(cursor - dest);
+    }
+
+    int32_t exponent;
+    uint64_t mantissa = shortestDecimal(ieeeMantissa, ieeeExponent, &exponent);
+    int length = decimalLength(mantissa);
+    int scientific = exponent + length - 1;
+
+    // Same layout as "%g" and Python's repr(): plain notation for
+    // 1e-5 <= |value| < 1e16, scientific with a two digit exponent otherwise.
+    if (scientific < -4 || scientific >= 16) {
+        writeDigits(mantissa, cursor + 1, length);
+        cursor[0] = cursor[1];
+        if (length > 1) {
+            cursor[1] = '.';
+            cursor += length + 1;
+        } else {
+            cursor += 1;
+        }
+        *cursor++ = 'e';
+        *cursor++ = scientific < 0 ? '-' : '+';
+        int magnitude = scientific < 0 ? -scientific : scientific;
+        if (magnitude >= 100) {
+            *cursor++ = (char)('0' + magnitude / 100);
+            magnitude %= 100;
+        }
+        *cursor++ = DIGIT_PAIRS[magnitude * 2];
+        *cursor++ = DIGIT_PAIRS[magnitude * 2 + 1];
+    } else if (exponent >= 0) {
+        writeDigits(mantissa, cursor, length);
+        cursor += length;
+        memset(cursor, '0', exponent);
+        cursor += exponent;
+    } else if (scientific >= 0) {
+        int integral = scientific + 1;
+        writeDigits(mantissa, cursor + 1, length);
+        memmove(cursor, cursor + 1, integral);
+        cursor[integral] = '.';
+        cursor += length + 1;
+    } else {
+        int zeros = -scientific - 1;
+        *cursor++ = '0';
+        *cursor++ = '.';
+        memset(cursor, '0', zeros);
+        cursor += zeros;
+        writeDigits(mantissa, cursor, length);
+        cursor += length;
+    }
+
+    *cursor = '\0';
+    return (int)(cursor - dest);
+}
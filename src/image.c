@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <direct.h>
+#include <io.h>
+#include <process.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#ifdef __linux__
+#include <link.h>
+#endif
+
+#include "image.h"
+#include "memory.h"
+
+// Bumped whenever the layout of an image or the meaning of any opcode
+// changes.
+#define IMAGE_FORMAT 2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t format;
+    uint64_t key;
+    uint64_t payloadLength;
+    uint64_t payloadHash;
+} ImageHeader;
+
+uint64_t hashImageBytes(uint64_t hash, const void* bytes, size_t length) {
+    const uint8_t* at = bytes;
+    for (; length >= 8; length -= 8, at += 8) {
+        uint64_t word;
+        memcpy(&word, at, sizeof(word));
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ull;
+        hash ^= hash >> 32;
+    }
+    for (; length > 0; length--, at++) {
+        hash = (hash ^ *at) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+void initImageWriter(ImageWriter* writer) {
+    writer->bytes = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
+}
+
+void freeImageWriter(ImageWriter* writer) {
+    FREE_ARRAY(uint8_t, writer->bytes, writer->capacity);
+    initImageWriter(writer);
+}
+
+void writeImageBytes(ImageWriter* writer, const void* bytes, size_t length) {
+    if (writer->count + length > writer->capacity) {
+        size_t oldCapacity = writer->capacity;
+        while (writer->count + length > writer->capacity) {
+            writer->capacity = GROW_CAPACITY(writer->capacity);
+        }
+        writer->bytes = GROW_ARRAY(uint8_t, writer->bytes, oldCapacity, writer->capacity);
+    }
+    memcpy(writer->bytes + writer->count, bytes, length);
+    writer->count += length;
+}
+
+void writeImageByte(ImageWriter* writer, uint8_t byte) {
+    writeImageBytes(writer, &byte, 1);
+}
+
+void writeImageVarint(ImageWriter* writer, uint64_t value) {
+    while (value >= 0x80) {
+        writeImageByte(writer, (uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    writeImageByte(writer, (uint8_t)value);
+}
+
+// Strings carry their hash, so loading interns them without hashing them
+// again.
+void writeImageString(ImageWriter* writer, const char* chars, int length, uint32_t hash) {
+    writeImageVarint(writer, (uint64_t)length);
+    writeImageBytes(writer, &hash, sizeof(hash));
+    writeImageBytes(writer, chars, (size_t)length);
+}
+
+// The code, line runs and inlined lines of a chunk, but not its constants.
+// Each run is stored as the distance from the one before, with the line
+// delta zigzag encoded, so most take two bytes.
+void writeImageChunk(ImageWriter* writer, const Chunk* chunk) {
+    writeImageVarint(writer, (uint64_t)chunk->count);
+    writeImageBytes(writer, chunk->code, (size_t)chunk->count);
+
+    writeImageVarint(writer, (uint64_t)chunk->lineCount);
+    int offset = 0;
+    int line = 0;
+    for (int i = 0; i < chunk->lineCount; i++) {
+        int64_t delta = (int64_t)chunk->lines[i].line - line;
+        writeImageVarint(writer, (uint64_t)(chunk->lines[i].offset - offset));
+        writeImageVarint(writer, ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63));
+        offset = chunk->lines[i].offset;
+        line = chunk->lines[i].line;
+    }
+
+    writeImageVarint(writer, (uint64_t)chunk->inlinedCount);
+    for (int i = 0; i < chunk->inlinedCount; i++) {
+        const InlinedLine* inlined = &chunk->inlined[i];
+        int64_t caller = inlined->caller;
+        writeImageVarint(writer, (uint64_t)inlined->line);
+        writeImageVarint(writer, ((uint64_t)caller << 1) ^ (uint64_t)(caller >> 63));
+        writeImageString(writer, inlined->function->chars, inlined->function->length,
+                         inlined->function->hash);
+    }
+}
+
+// Makes each missing directory along the way to a file.
+static void makeDirectories(const char* path) {
+    char directory[4096];
+    for (const char* slash = strchr(path + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/')) {
+        size_t length = (size_t)(slash - path);
+        if (length >= sizeof(directory)) return;
+        memcpy(directory, path, length);
+        directory[length] = '\0';
+#ifdef _WIN32
+        _mkdir(directory);
+#else
+        mkdir(directory, 0755);
+#endif
+    }
+}
+
+static bool writeFile(const char* path, const ImageHeader* header, const ImageWriter* payload) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) return false;
+    bool written = fwrite(header, sizeof(*header), 1, file) == 1 &&
+                   fwrite(payload->bytes, 1, payload->count, file) == payload->count;
+    return fclose(file) == 0 && written;
+}
+
+bool saveImage(const char* path, uint32_t magic, uint64_t key, const ImageWriter* payload) {
+    if (imageBuildKey() == 0) return false;
+    ImageHeader header = {magic, IMAGE_FORMAT, key, payload->count,
+                          hashImageBytes(0, payload->bytes, payload->count)};
+
+    // Written aside and renamed into place, so a reader never sees half a
+    // file and concurrent writers don't trip over each other.
+    size_t length = strlen(path) + 32;
+    char* temporary = ALLOCATE(char, length);
+    snprintf(temporary, length, "%s.%ld.tmp", path, (long)getpid());
+    makeDirectories(path);
+
+    bool saved = writeFile(temporary, &header, payload) && rename(temporary, path) == 0;
+    if (!saved) remove(temporary);
+    FREE_ARRAY(char, temporary, length);
+    return saved;
+}
+
+// The next length bytes, or NULL past the end of the payload.
+const uint8_t* readImageBytes(ImageReader* reader, size_t length) {
+    if (!reader->ok || (size_t)(reader->end - reader->at) < length) {
+        reader->ok = false;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->at;
+    reader->at += length;
+    return bytes;
+}
+
+uint8_t readImageByte(ImageReader* reader) {
+    const uint8_t* byte = readImageBytes(reader, 1);
+    return byte != NULL ? *byte : 0;
+}
+
+uint64_t readImageVarint(ImageReader* reader) {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t byte = readImageByte(reader);
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return value;
+    }
+    reader->ok = false;
+    return 0;
+}
+
+// A count of things each at least one byte long, so no more of them than
+// there are bytes left.
+int readImageCount(ImageReader* reader) {
+    uint64_t count = readImageVarint(reader);
+    if (count > (uint64_t)(reader->end - reader->at) || count > INT32_MAX) {
+        reader->ok = false;
+        return 0;
+    }
+    return (int)count;
+}
+
+ObjString* readImageString(ImageReader* reader) {
+    int length = readImageCount(reader);
+    uint32_t hash;
+    const uint8_t* bytes = readImageBytes(reader, sizeof(hash));
+    if (bytes == NULL) return NULL;
+    memcpy(&hash, bytes, sizeof(hash));
+
+    const char* chars = (const char*)readImageBytes(reader, (size_t)length);
+    return chars != NULL ? copyStringHashed(chars, length, hash) : NULL;
+}
+
+void readImageChunk(ImageReader* reader, Chunk* chunk) {
+    int count = readImageCount(reader);
+    const uint8_t* code = readImageBytes(reader, (size_t)count);
+    if (code == NULL) return;
+    chunk->code = ALLOCATE(uint8_t, count);
+    memcpy(chunk->code, code, (size_t)count);
+    chunk->count = count;
+    chunk->capacity = count;
+
+    int lineCount = readImageCount(reader);
+    chunk->lines = ALLOCATE(LineRun, lineCount);
+    chunk->lineCapacity = lineCount;
+    int offset = 0;
+    int line = 0;
+    for (int i = 0; i < lineCount && reader->ok; i++) {
+        offset += (int)readImageVarint(reader);
+        uint64_t delta = readImageVarint(reader);
+        line += (int)((delta >> 1) ^ (~(delta & 1) + 1));
+        chunk->lines[i].offset = offset;
+        chunk->lines[i].line = line;
+        chunk->lineCount++;
+    }
+
+    int inlinedCount = readImageCount(reader);
+    chunk->inlined = ALLOCATE(InlinedLine, inlinedCount);
+    chunk->inlinedCapacity = inlinedCount;
+    for (int i = 0; i < inlinedCount && reader->ok; i++) {
+        InlinedLine* inlined = &chunk->inlined[i];
+        inlined->line = (int)readImageVarint(reader);
+        uint64_t caller = readImageVarint(reader);
+        inlined->caller = (int)((caller >> 1) ^ (~(caller & 1) + 1));
+        inlined->function = readImageString(reader);
+        if (inlined->function == NULL) break;
+        chunk->inlinedCount++;
+    }
+}
+
+// Maps the file read-only; it is only needed while its objects are rebuilt.
+static const uint8_t* mapImageFile(const char* path, size_t* length) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+
+    struct stat info;
+    const uint8_t* bytes = NULL;
+    if (fstat(fd, &info) == 0 && info.st_size >= (off_t)sizeof(ImageHeader)) {
+        *length = (size_t)info.st_size;
+#ifdef _WIN32
+        uint8_t* buffer = malloc(*length);
+        if (buffer != NULL && read(fd, buffer, (unsigned)*length) == (int)*length) {
+            bytes = buffer;
+        } else {
+            free(buffer);
+        }
+#else
+        void* mapped = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) bytes = mapped;
+#endif
+    }
+    close(fd);
+    return bytes;
+}
+
+static void unmapImageFile(const uint8_t* bytes, size_t length) {
+#ifdef _WIN32
+    free((void*)bytes);
+#else
+    munmap((void*)bytes, length);
+#endif
+}
+
+#ifdef __linux__
+// Hashes the build ID the linker put in the executable, itself a hash of
+// everything linked into it, if there is one. Only the executable is
+// looked at, which comes first.
+static int hashBuildId(struct dl_phdr_info* info, size_t size, void* data) {
+    uint64_t* hash = data;
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr)* segment = &info->dlpi_phdr[i];
+        if (segment->p_type != PT_NOTE) continue;
+
+        const uint8_t* at = (const uint8_t*)(info->dlpi_addr + segment->p_vaddr);
+        const uint8_t* end = at + segment->p_memsz;
+        while (at + sizeof(ElfW(Nhdr)) <= end) {
+            const ElfW(Nhdr)* note = (const ElfW(Nhdr)*)at;
+            const uint8_t* name = at + sizeof(*note);
+            const uint8_t* description = name + ((note->n_namesz + 3) & ~3u);
+            if (note->n_type == NT_GNU_BUILD_ID && note->n_namesz == 4 &&
+                memcmp(name, "GNU", 4) == 0 && description + note->n_descsz <= end) {
+                *hash = hashImageBytes(*hash, description, note->n_descsz);
+                return 1;
+            }
+            at = description + ((note->n_descsz + 3) & ~3u);
+        }
+    }
+    return -1;
+}
+#endif
+
+// Hashes the build ID if there is one, or else the whole executable.
+static bool hashExecutable(uint64_t* hash) {
+#ifdef __linux__
+    if (dl_iterate_phdr(hashBuildId, hash) == 1) return true;
+#endif
+
+    char path[4096];
+#ifdef _WIN32
+    DWORD written = GetModuleFileNameA(NULL, path, sizeof(path));
+    if (written == 0 || written >= sizeof(path)) return false;
+#elif defined(__linux__)
+    strcpy(path, "/proc/self/exe");
+#else
+    return false;
+#endif
+
+    size_t length;
+    const uint8_t* bytes = mapImageFile(path, &length);
+    if (bytes == NULL) return false;
+    *hash = hashImageBytes(*hash, bytes, length);
+    unmapImageFile(bytes, length);
+    return true;
+}
+
+// Identifies the build, so a rebuilt interpreter never reads another's
+// files: a hash of the executable, which changes with any change to the
+// code or to how it was compiled, and only then. Worked out once per
+// thread. 0 when the executable can't be read, as then no build could
+// tell its own images from another's.
+uint64_t imageBuildKey(void) {
+    static _Thread_local bool known = false;
+    static _Thread_local uint64_t key = 0;
+    if (known) return key;
+
+    uint32_t format = IMAGE_FORMAT;
+    uint64_t hash = hashImageBytes(0xcbf29ce484222325ull, &format, sizeof(format));
+    key = hashExecutable(&hash) && hash != 0 ? hash : 0;
+    known = true;
+    return key;
+}
+
+bool openImage(const char* path, uint32_t magic, uint64_t key, Image* image) {
+    if (imageBuildKey() == 0) return false;
+    image->bytes = mapImageFile(path, &image->length);
+    if (image->bytes == NULL) return false;
+
+    ImageHeader header;
+    memcpy(&header, image->bytes, sizeof(header));
+    const uint8_t* payload = image->bytes + sizeof(header);
+    size_t payloadLength = image->length - sizeof(header);
+
+    if (header.magic != magic || header.format != IMAGE_FORMAT || header.key != key ||
+        header.payloadLength != payloadLength ||
+        header.payloadHash != hashImageBytes(0, payload, payloadLength)) {
+        unmapImageFile(image->bytes, image->length);
+        image->bytes = NULL;
+        return false;
+    }
+
+    image->reader.at = payload;
+    image->reader.end = payload + payloadLength;
+    image->reader.ok = true;
+    return true;
+}
+
+void closeImage(Image* image) {
+    if (image->bytes != NULL) unmapImageFile(image->bytes, image->length);
+    image->bytes = NULL;
+    image->length = 0;
+}
@@ -0,0 +1,46 @@
+#ifndef pythowon_arith_h
+#define pythowon_arith_h
+
+#include "common.h"
+#include "chunk.h"
+#include "value.h"
+
+// The operators behind OP_ADD, OP_NEGATE and friends. The VM and the
+// compiler's constant folder both go through these, so a folded
+// expression always has the value the VM would have computed.
+
+typedef struct {
+    const char* type;       // prefix for runtimeError(), e.g. "ValueError: "
+    const char* message;
+} OperationError;
+
+// Each returns true and stores the result, or returns false and describes
+// the runtime error the operation raises.
+bool binaryOperation(OpCode op, Value a, Value b, Value* result, OperationError* error);
+bool unaryOperation(OpCode op, Value a, Value* result, OperationError* error);
+
+// Compile-time evaluation of source operators, for the constant folders.
+
+// Folded strings longer than this are left to be built at runtime rather
+// than kept in the constant table.
+#define FOLD_STRING_MAX 4096
+
+// What is known about an expression's value at compile time.
+typedef enum {
+    KIND_UNKNOWN,
+    KIND_INTEGER,
+    KIND_DOUBLE,
+    KIND_NUMBER,        // an integer or a double
+} OperandKind;
+
+// Evaluate `a op b` / `op a` the way the emitted bytecode would. Operators
+// that would raise a runtime error are not folded, so that the error still
+// happens at runtime.
+bool foldBinaryOperator(TokenType op, Value a, Value b, Value* result);
+bool foldUnaryOperator(TokenType op, Value a, Value* result);
+
+OperandKind operandKind(Value value);
+OperandKind resultKind(TokenType op, OperandKind a, OperandKind b);
+bool isIdentity(TokenType op, OperandKind kind, Value constant);
+
+#endif
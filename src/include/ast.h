@@ -0,0 +1,127 @@
+#ifndef pythowon_ast_h
+#define pythowon_ast_h
+
+#include "common.h"
+#include "arith.h"
+#include "scanner.h"
+#include "value.h"
+
+// The syntax tree the optimising pipeline works on. It is built for a
+// whole script at once by parseProgram(), rewritten in place by the passes
+// in passes.c and then lowered to bytecode by the compiler.
+//
+// Every node keeps the token it was built from (an operator, a name or a
+// keyword), which gives the lowering its error locations, and the token the
+// direct compiler would just have consumed when emitting the node's own
+// instruction, which gives it the same line numbers.
+
+typedef enum {
+    // Expressions
+    NODE_LITERAL,       // literal
+    NODE_VARIABLE,      // token is the name
+    NODE_ASSIGN,        // token is the name, value in unary.operand
+    NODE_UNARY,         // token is the operator
+    NODE_BINARY,        // token is the operator
+    NODE_AND,           // binary
+    NODE_OR,            // binary
+    NODE_CALL,          // call
+
+    // Statements
+    NODE_EXPRESSION,    // unary.operand
+    NODE_PRINT,         // unary.operand
+    NODE_VAR,           // token is the name, initializer in unary.operand (or NULL)
+    NODE_FUNCTION,      // function
+    NODE_BLOCK,         // list
+    NODE_IF,            // branch
+    NODE_WHILE,         // loop
+    NODE_FOR,           // loop
+    NODE_RANGE,         // range, token is the loop variable
+    NODE_RETURN,        // unary.operand, NULL for a bare return
+    NODE_SWITCH,        // switchStmt
+    NODE_CASE,          // caseArm, value is NULL for default
+    NODE_CONTINUE,
+} NodeType;
+
+typedef struct Node Node;
+
+// Where code the inliner copied out of a function was called from. The
+// copied nodes keep the callee's tokens and point at one of these, so that
+// the lowering can give their code the lines of the call as well.
+typedef struct InlineSite {
+    const struct InlineSite* caller;    // the call was itself inlined code
+    Token call;                         // the end token of the call
+    Token function;                     // the name of the function called
+} InlineSite;
+
+typedef struct {
+    Node** items;
+    int count;
+    int capacity;
+} NodeList;
+
+struct Node {
+    NodeType type;
+    Token token;
+    Token end;          // the token itself unless the parser moves it on
+    const InlineSite* site;     // NULL unless the inliner copied the node in
+    OperandKind kind;   // expressions only, filled in by the passes
+
+    union {
+        Value literal;
+        struct {
+            Node* operand;
+        } unary;
+        struct {
+            Node* left;
+            Node* right;
+        } binary;
+        struct {
+            Node* callee;
+            NodeList arguments;
+        } call;
+        struct {
+            NodeList parameters;    // NODE_VARs, initializer is the default
+            int defaults;
+            NodeList body;
+        } function;
+        NodeList list;
+        struct {
+            Node* condition;
+            Node* thenBranch;
+            Node* elseBranch;
+        } branch;
+        struct {
+            Node* initializer;      // for only, may be NULL
+            Node* condition;        // may be NULL in a for
+            Node* increment;        // for only, may be NULL
+            Node* body;
+        } loop;
+        struct {
+            Node* start;            // literals where range() leaves them out
+            Node* stop;
+            Node* step;
+            Node* body;
+        } range;
+        struct {
+            Node* subject;
+            NodeList cases;
+        } switchStmt;
+        struct {
+            Node* value;
+            NodeList body;
+        } caseArm;
+    } as;
+};
+
+// Nodes and lists live in an arena that is thrown away in one go once the
+// tree has been lowered.
+Node* newNode(NodeType type, const Token* token);
+InlineSite* newInlineSite(const InlineSite* caller, const Token* call, const Token* function);
+void appendNode(NodeList* list, Node* node);
+void freeNodes(void);
+
+// Parses a whole script, reporting syntax errors the same way the direct
+// compiler does. Returns NULL if there were any.
+Node* parseProgram(const char* source);
+
+#endif
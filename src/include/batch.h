@@ -0,0 +1,37 @@
+#ifndef pythowon_batch_h
+#define pythowon_batch_h
+
+#include "common.h"
+#include "object.h"
+#include "output.h"
+#include "vm.h"
+
+// Runs one compiled script over many inputs. The script is compiled once,
+// in the current VM, and each job runs it in a child VM of its own on one
+// of a pool of threads. The children share the script's code, constants
+// and strings, which nothing writes to while they run, so the current VM
+// must not run anything until the batch is over, and the script can't have
+// functions still to be compiled lazily.
+
+typedef struct {
+    const char* input;      // the global `input` while the job runs
+    int length;
+
+    InterpretResult result;
+    OutputBuffer output;    // what the job printed, kept in memory
+    OutputBuffer errors;    // and the runtime error it stopped at, if any
+} BatchJob;
+
+// Runs a single job on the calling thread, in a child VM of parent.
+void runBatchJob(VM* parent, ObjFunction* function, BatchJob* job);
+
+// Called on the thread running the batch for each job in turn, as soon as
+// it and every job before it are done. The job's buffers are freed after.
+typedef void (*BatchReportFn)(BatchJob* job, int index);
+
+// Runs the jobs on `workers` threads, or one per core when workers is 0.
+// Returns how many failed.
+int runBatch(ObjFunction* function, BatchJob* jobs, int count, int workers,
+             BatchReportFn report);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef pythowon_cache_h
+#define pythowon_cache_h
+
+#include "common.h"
+#include "object.h"
+
+#define CACHE_PATH_MAX 4096
+
+// Compiled scripts are kept in a cache directory, one file per script,
+// named after a hash of its text, the compiler options and the build of
+// the interpreter. Any change to one of those gives another name, so a
+// stale file is never read; it just stops being used.
+typedef struct {
+    char path[CACHE_PATH_MAX];
+    uint64_t key;
+} CacheEntry;
+
+// The cache entry for a source. A NULL directory means the default:
+// $XDG_CACHE_HOME/pythowon, or ~/.cache/pythowon. Returns false when no
+// directory could be found.
+bool findCacheEntry(const char* directory, const char* source, size_t length, CacheEntry* entry);
+
+// The compiled script stored for an entry, or NULL when there is no
+// usable one, in which case the script is compiled as usual.
+ObjFunction* loadCache(const CacheEntry* entry);
+
+// Stores a compiled script for an entry, creating the directory if need
+// be. Scripts with functions still to be compiled lazily aren't stored.
+bool storeCache(const CacheEntry* entry, ObjFunction* function);
+
+#endif
@@ -16,6 +16,12 @@ typedef enum {
     OP_GET_GLOBAL,
     OP_DEF_GLOBAL,
     OP_SET_GLOBAL,
+    OP_GET_GLOBAL_LONG,
+    OP_DEF_GLOBAL_LONG,
+    OP_SET_GLOBAL_LONG,
+    OP_STORE_LOCAL,         // OP_SET_* followed by OP_POP, from the peephole pass
+    OP_STORE_GLOBAL,
+    OP_STORE_GLOBAL_LONG,
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
@@ -32,25 +38,60 @@ typedef enum {
     OP_JUMP_FALSE,
     OP_JUMP_LONG,
     OP_JUMP_FALSE_LONG,
+    OP_POP_JUMP_FALSE,      // pops the condition either way
+    OP_POP_JUMP_FALSE_LONG,
     OP_LOOP,
     OP_LOOP_LONG,
+    OP_SWITCH,              // 24-bit ObjSwitch constant, then a 5-byte jump per case and one for no match
+    OP_FOR_RANGE,           // slot of a range's counter, stop and step, then a 32-bit loop offset
     OP_DUP,
     OP_CALL,
     OP_RETURN,
 } OpCode;
 
+// Source lines are kept run-length encoded: each run gives the line of
+// the code from its offset up to the next run's. Only error reporting and
+// the disassembler look lines up, so the cost of a search is fine there.
+typedef struct {
+    int offset;
+    int line;
+} LineRun;
+
+// A line of code the optimiser inlined from another function. A line run
+// whose line is negative stands for the inlined line at index -1 - line,
+// which gives the line in the function the code came from and the line,
+// itself possibly inlined, of the call it replaced, so that errors can
+// still report the call.
+typedef struct {
+    int line;
+    int caller;
+    ObjString* function;
+} InlinedLine;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
-    int* lines;
+    LineRun* lines;
+    int lineCount;
+    int lineCapacity;
+    InlinedLine* inlined;
+    int inlinedCount;
+    int inlinedCapacity;
     ValueArray constants;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
+void writeLine(Chunk* chunk, int offset, int line);
+int getLine(const Chunk* chunk, int offset);
+int addInlinedLine(Chunk* chunk, int line, int caller, ObjString* function);
+int sourceLine(const Chunk* chunk, int line);
 void writeConstant(int index, Chunk* chunk, int line);
 int addConstant(Chunk* chunk, Value value);
+void truncateChunk(Chunk* chunk, int count, int constantCount);
+void shrinkChunk(Chunk* chunk);
+int instructionLength(uint8_t instruction);
 
 #endif
@@ -5,8 +5,10 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#ifndef PYTHOWON_RELEASE
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#endif
 
 typedef unsigned long ulong;
 
@@ -6,14 +6,24 @@
 #include "scanner.h"
 
 typedef struct {
-    Token current;
-    Token previous;
-    bool hadError;
-    bool panicMode;
-} Parser;
+    // Build an AST of the whole script and run the optimisation passes
+    // over it before emitting bytecode, instead of emitting as it parses.
+    bool pipeline;
+    bool passStats;     // report what each pass did on stderr at exit
+    bool peephole;      // clean up each chunk's bytecode once it is finished
+    bool compactChunks; // share equal constants and trim each chunk to size
+    // Only note each function's signature while compiling the script and
+    // compile its body on its first call. The source has to outlive the
+    // run. Has no effect with `pipeline`, whose passes need every body.
+    bool lazy;
+} CompilerOptions;
 
-extern Parser parser;
+// Set before anything is compiled and shared by every thread.
+extern CompilerOptions compilerOptions;
 
 ObjFunction* compile(const char* source);
+bool compileFunction(ObjFunction* function);
+// Frees what the calling thread keeps from one compile to the next.
+void freeCompiler(void);
 
 #endif
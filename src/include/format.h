@@ -0,0 +1,13 @@
+#ifndef pythowon_format_h
+#define pythowon_format_h
+
+#include "common.h"
+
+// Largest number of bytes either formatter writes, including a trailing NUL.
+#define FORMAT_INTEGER_MAX 21
+#define FORMAT_DOUBLE_MAX 25
+
+int formatInteger(long value, char* dest);
+int formatDouble(double value, char* dest);
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef pythowon_image_h
+#define pythowon_image_h
+
+#include "common.h"
+#include "chunk.h"
+#include "object.h"
+
+// Binary images of compiled code and objects, as kept by the bytecode
+// cache and by heap snapshots. An image file is a header, which identifies
+// the kind of image, the build that wrote it and a hash of the payload,
+// followed by the payload. Counts and integers in it are unsigned LEB128
+// varints; anything else is in the machine's own byte order, as an image
+// is only ever read by the build that wrote it.
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+} ImageWriter;
+
+typedef struct {
+    const uint8_t* at;
+    const uint8_t* end;
+    bool ok;            // cleared by any read past the end or of bad data
+} ImageReader;
+
+// A mapped image file, whose payload is read through `reader`.
+typedef struct {
+    const uint8_t* bytes;
+    size_t length;
+    ImageReader reader;
+} Image;
+
+uint64_t hashImageBytes(uint64_t hash, const void* bytes, size_t length);
+// Changes with every change to the interpreter's code and version of the
+// format. 0 where it can't be worked out, and then no image is saved or
+// opened.
+uint64_t imageBuildKey(void);
+
+void initImageWriter(ImageWriter* writer);
+void freeImageWriter(ImageWriter* writer);
+void writeImageBytes(ImageWriter* writer, const void* bytes, size_t length);
+void writeImageByte(ImageWriter* writer, uint8_t byte);
+void writeImageVarint(ImageWriter* writer, uint64_t value);
+void writeImageString(ImageWriter* writer, const char* chars, int length, uint32_t hash);
+void writeImageChunk(ImageWriter* writer, const Chunk* chunk);
+// Writes the header and payload to path, through a file renamed into
+// place, creating missing directories on the way.
+bool saveImage(const char* path, uint32_t magic, uint64_t key, const ImageWriter* payload);
+
+const uint8_t* readImageBytes(ImageReader* reader, size_t length);
+uint8_t readImageByte(ImageReader* reader);
+uint64_t readImageVarint(ImageReader* reader);
+int readImageCount(ImageReader* reader);
+ObjString* readImageString(ImageReader* reader);
+void readImageChunk(ImageReader* reader, Chunk* chunk);
+// Maps an image file whose header matches magic and key and whose payload
+// is intact. Returns false, with nothing to close, otherwise.
+bool openImage(const char* path, uint32_t magic, uint64_t key, Image* image);
+void closeImage(Image* image);
+
+#endif
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "table.h"
 #include "value.h"
 
 #define OBJ_TYPE(value)        (AS_OBJ(value)->type)
@@ -10,17 +11,24 @@
 #define IS_FUNCTION(value)     isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
 #define IS_STRING(value)       isObjType(value, OBJ_STRING)
+#define IS_STRING_VIEW(value)  isObjType(value, OBJ_STRING_VIEW)
+#define IS_STRINGLIKE(value)   (IS_STRING(value) || IS_STRING_VIEW(value))
+#define IS_SWITCH(value)       isObjType(value, OBJ_SWITCH)
 
 #define AS_FUNCTION(value)     ((ObjFunction*)AS_OBJ(value))
 #define AS_NATIVE(value)       (((ObjNative*)AS_OBJ(value))->function)
 #define AS_STRING(value)       ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value)      (((ObjString*)AS_OBJ(value))->chars)
+#define AS_STRING_VIEW(value)  ((ObjStringView*)AS_OBJ(value))
+#define AS_SWITCH(value)       ((ObjSwitch*)AS_OBJ(value))
 
 
 typedef enum {
     OBJ_FUNCTION,
     OBJ_NATIVE,
     OBJ_STRING,
+    OBJ_STRING_VIEW,
+    OBJ_SWITCH,
 } ObjType;
 
 struct Obj {
@@ -34,6 +42,10 @@ typedef struct {
     int defArity;        // Default arity
     Chunk chunk;
     ObjString* name;
+    // Where the parameter list of a function compiled lazily starts, until
+    // its first call compiles it; NULL once it has code.
+    const char* source;
+    int line;
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, const Value* args);
@@ -50,11 +62,49 @@ struct ObjString {
     uint32_t hash;
 };
 
+// A view shares the bytes of its parent string, so it is not NUL terminated
+// and is never interned. Views are always taken of a plain ObjString, never
+// of another view, so a chain of slices keeps a single parent alive.
+typedef struct {
+    Obj obj;
+    ObjString* parent;
+    int start;
+    int length;
+    bool hashed;
+    uint32_t hash;
+} ObjStringView;
+
+// Integer labels spanning more than this are looked up by hash.
+#define SWITCH_DENSE_MAX 1024
+// Integer labels must be below this, where every integer is exact as a
+// double, so a double subject matches exactly the label OP_EQUAL would.
+#define SWITCH_LABEL_LIMIT (1ULL << 53)
+
+// The dispatch table of a switch whose case labels are integer or string
+// literals, kept in the constant table. It maps the subject to the index
+// of the case it selects, or to caseCount when none matches.
+typedef struct {
+    Obj obj;
+    int caseCount;
+    int* dense;         // integer labels only: index of label low + i, or caseCount
+    ulong low;
+    int span;
+    Table sparse;       // otherwise label -> INTEGER_VAL(index)
+} ObjSwitch;
+
 ObjFunction* newFunction(void);
 ObjNative* newNative(NativeFn function);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
-ObjString* newString(const char* chars, int length);
+ObjString* copyStringHashed(const char* chars, int length, uint32_t hash);
+ObjStringView* newStringView(ObjString* parent, int start, int length);
+ObjString* materializeView(ObjStringView* view);
+bool isSwitchLabel(Value value);
+ObjSwitch* newSwitch(const Value* labels, int count);
+void switchLabels(const ObjSwitch* table, Value* labels);
+int switchCase(ObjSwitch* table, Value subject);
+uint32_t hashString(const char* key, int length);
+uint32_t hashStringView(ObjStringView* view);
 
 void printObject(Value value);
 
@@ -62,4 +112,17 @@ static inline bool isObjType(Value value, ObjType type) {
     return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+static inline const char* stringChars(Value value) {
+    if (IS_STRING_VIEW(value)) {
+        const ObjStringView* view = AS_STRING_VIEW(value);
+        return view->parent->chars + view->start;
+    }
+    return AS_CSTRING(value);
+}
+
+static inline int stringLength(Value value) {
+    if (IS_STRING_VIEW(value)) return AS_STRING_VIEW(value)->length;
+    return AS_STRING(value)->length;
+}
+
 #endif
@@ -0,0 +1,34 @@
+#ifndef pythowon_output_h
+#define pythowon_output_h
+
+#include <stdarg.h>
+
+#include "common.h"
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#define STDOUT_FD 1
+#define STDERR_FD 2
+// Output sent here stays in the buffer, which grows to hold all of it,
+// until it is redirected to a real file descriptor and flushed.
+#define OUTPUT_MEMORY -1
+
+// Program output (print and friends) is collected here and handed to the
+// OS in large write(2) calls. A capacity of zero means unbuffered: every
+// write goes straight through, which is what the REPL wants.
+typedef struct {
+    int fd;
+    char* buffer;
+    size_t count;
+    size_t capacity;
+} OutputBuffer;
+
+void initOutput(OutputBuffer* output, int fd, size_t capacity);
+void freeOutput(OutputBuffer* output);
+void setOutputCapacity(OutputBuffer* output, size_t capacity);
+void redirectOutput(OutputBuffer* output, int fd);
+void writeOutput(OutputBuffer* output, const char* chars, size_t length);
+void printOutput(OutputBuffer* output, const char* format, ...);
+void vprintOutput(OutputBuffer* output, const char* format, va_list args);
+void flushOutput(OutputBuffer* output);
+
+#endif
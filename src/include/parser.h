@@ -0,0 +1,115 @@
+#ifndef pythowon_parser_h
+#define pythowon_parser_h
+
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "scanner.h"
+
+// Token-level parsing state and helpers, shared by the direct bytecode
+// compiler and the AST builder. There is only ever one parse going on, so
+// both work on the one global `parser`.
+
+typedef struct {
+    Token current;
+    Token previous;
+    bool hadError;
+    bool panicMode;
+} Parser;
+
+extern _Thread_local Parser parser;
+
+static inline void errorAt(const Token* token, const char* message) {
+    if (parser.panicMode) return;
+    parser.panicMode = true;
+    fprintf(stderr, "[line %d] Error", token->line);
+
+    if (token->type == TOKEN_EOF) {
+        fprintf(stderr, " at end");
+    } else if (token->type == TOKEN_ERROR) {
+        // empty
+    } else {
+        fprintf(stderr, " at '%.*s'", token->length, token->start);
+    }
+
+    fprintf(stderr, ": %s\n", message);
+    parser.hadError = true;
+}
+
+static inline void error(const char* message) {
+    errorAt(&parser.previous, message);
+}
+
+static inline void errorAtCurrent(const char* message) {
+    errorAt(&parser.current, message);
+}
+
+static inline void advance(void) {
+    parser.previous = parser.current;
+
+    for (;;) {
+        parser.current = scanToken();
+        if(parser.current.type != TOKEN_ERROR) break;
+
+        errorAtCurrent(parser.current.start);
+    }
+}
+
+static inline void consume(TokenType type, const char* message) {
+    if (parser.current.type == type) {
+        advance();
+        return;
+    }
+
+    errorAtCurrent(message);
+}
+
+static inline bool check(TokenType type) {
+    return parser.current.type == type;
+}
+
+static inline bool match(TokenType type) {
+    if (!check(type)) return false;
+    advance();
+    return true;
+}
+
+// The most arguments range() takes: start, stop and step.
+#define RANGE_MAX_ARGUMENTS 3
+
+// Parses `name in range(` after a `for`, returning the loop variable.
+static inline Token rangeHeader(void) {
+    consume(TOKEN_IDENTIFIER, "Expect variable name.");
+    Token variable = parser.previous;
+    consume(TOKEN_IN, "Expected 'in' after loop variable.");
+    consume(TOKEN_IDENTIFIER, "Expected 'range' after 'in'.");
+    if (parser.previous.length != 5 || memcmp(parser.previous.start, "range", 5) != 0) {
+        error("Can only loop over range().");
+    }
+    consume(TOKEN_LPAREN, "Expected '(' after 'range'.");
+    return variable;
+}
+
+static inline void synchronize(void) {
+    parser.panicMode = false;
+
+    while (parser.previous.type != TOKEN_EOF) {
+        if (parser.previous.type == TOKEN_SEMI) return;
+        switch (parser.current.type) {
+            case TOKEN_CLASS:
+            case TOKEN_DEF:
+            case TOKEN_VAR:
+            case TOKEN_FOR:
+            case TOKEN_IF:
+            case TOKEN_WHILE:
+            case TOKEN_PRINT:
+            case TOKEN_RETURN: return;
+            default: ;
+        }
+
+        advance();
+    }
+}
+
+#endif
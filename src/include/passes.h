@@ -0,0 +1,29 @@
+#ifndef pythowon_passes_h
+#define pythowon_passes_h
+
+#include <stdio.h>
+
+#include "common.h"
+#include "ast.h"
+
+// A pass rewrites the tree in place and returns how many rewrites it made.
+typedef int (*PassFn)(Node* program);
+
+typedef struct {
+    const char* name;
+    const char* description;
+    PassFn run;
+    bool enabled;
+} Pass;
+
+void runPasses(Node* program);
+
+// Enables exactly the passes named in a comma separated list ("none" for
+// no passes at all). Returns false, changing nothing, on an unknown name.
+bool selectPasses(const char* list);
+// Bit i is set when the i-th pass is enabled.
+uint32_t enabledPasses(void);
+void listPasses(FILE* out);
+void printPassStats(FILE* out);
+
+#endif
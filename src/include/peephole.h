@@ -0,0 +1,31 @@
+#ifndef pythowon_peephole_h
+#define pythowon_peephole_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+
+typedef struct {
+    long chunks;
+    long before;    // instructions going in
+    long after;     // and coming out
+    long shortJumps;
+    long longJumps;
+} PeepholeStats;
+
+extern _Thread_local PeepholeStats peepholeStats;
+
+// Cleans up a finished chunk in place: threads chains of jumps, fuses a
+// store with the pop after it, drops sequences that do nothing and code
+// that can't be reached, then re-encodes the jumps (as relaxChunk does)
+// and line table.
+void optimizeChunk(Chunk* chunk);
+
+// Only re-encodes the jumps, each in the shortest form that reaches. The
+// compiler emits every jump long, as it can't know the distance up front.
+void relaxChunk(Chunk* chunk);
+// Frees the scratch space kept from one chunk to the next.
+void freePeephole(void);
+void printPeepholeStats(FILE* out);
+
+#endif
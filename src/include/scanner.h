@@ -1,6 +1,8 @@
 #ifndef pythowon_scanner_h
 #define pythowon_scanner_h
 
+#include "common.h"
+
 typedef enum {                  //TODO: add const token (maybe?)
     // single char tokens
     TOKEN_LPAREN, TOKEN_RPAREN,
@@ -39,21 +41,30 @@ typedef struct {
     const char* start;
     int length;
     int line;
+    bool decoded;       // start is a heap copy with escapes resolved, owned by whoever consumes the token
+    int symbol;         // identifiers and keywords only, -1 otherwise
 } Token;
 
 typedef struct {
     const char* start;
     const char* current;
     int line;
-
-    char* currentString;
-    int currentStringLength;
-    int currentChar;
 } Scanner;
 
-extern Scanner scanner;
+extern _Thread_local Scanner scanner;
+
+// How often, in bytes of source, the scanner reports how far it has got.
+#define SCAN_PROGRESS_INTERVAL (256 * 1024)
+
+typedef void (*ScanProgressFn)(const char* position);
 
 void initScanner(const char* source);
+void initScannerAt(const char* source, int line);
+// Frees the symbol table the scanner keeps from one source to the next.
+void freeSymbols(void);
+void setScanProgress(ScanProgressFn callback);
 Token scanToken(void);
+int hiddenSymbol(void);
+uint32_t symbolHash(int symbol);
 
 #endif
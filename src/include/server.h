@@ -0,0 +1,47 @@
+#ifndef pythowon_server_h
+#define pythowon_server_h
+
+#include "common.h"
+#include "object.h"
+#include "output.h"
+
+// A server compiles its scripts once and forks worker processes, which
+// inherit the compiled code and interned strings and only ever read them,
+// so the pages holding them stay shared between all of the workers. Each
+// request runs one script, as a batch job does, with its input in the
+// global `input`, in a child VM of the worker's.
+//
+// Requests arrive over a Unix domain socket. A request is the name of the
+// script and the input, each a 32-bit length followed by the bytes, and
+// the reply is a ServerReply followed by the output and then the errors.
+// Both ends run on the same machine, so lengths are in its byte order.
+
+typedef struct {
+    uint32_t status;        // what the script would have exited with
+    uint32_t outputLength;
+    uint32_t errorLength;
+} ServerReply;
+
+#define SERVER_UNKNOWN_SCRIPT 66
+
+typedef struct {
+    const char* name;       // what requests call it by
+    ObjFunction* function;
+} ServedScript;
+
+typedef struct {
+    const char* socketPath;
+    int workers;            // 0 for one per core
+} ServerOptions;
+
+// Serves the scripts, compiled in the current VM, until a SIGINT or
+// SIGTERM. Returns false, with a message on stderr, if the socket couldn't
+// be set up.
+bool runServer(const ServedScript* scripts, int count, const ServerOptions* options);
+
+// Sends a request and passes on the reply's output and errors. Returns
+// the script's status, or -1 when there was no server to answer.
+int sendRequest(const char* socketPath, const char* name, const char* input, int length,
+                OutputBuffer* output, OutputBuffer* errors);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef pythowon_snapshot_h
+#define pythowon_snapshot_h
+
+#include "common.h"
+
+// A snapshot is the VM's globals once a script has run, with every object
+// they reach, so a later process can load it and start from one of its
+// functions without running the script's setup again.
+
+// Writes the current globals to path. Functions still to be compiled
+// lazily are compiled first, so the script's source must still be there.
+bool saveSnapshot(const char* path);
+
+// Defines the globals of a snapshot in a freshly initialized VM.
+bool loadSnapshot(const char* path);
+
+#endif
@@ -0,0 +1,23 @@
+#ifndef pythowon_source_h
+#define pythowon_source_h
+
+#include "common.h"
+
+// Distance the scanner keeps between itself and the source it lets the OS
+// reclaim when streaming.
+#define SOURCE_STREAM_WINDOW (1024 * 1024)
+
+// A script's text, NUL terminated for the scanner. Regular files are
+// mapped read-only instead of being copied into the heap; stdin, pipes and
+// anything else that cannot be mapped are read into a buffer.
+typedef struct {
+    const char* chars;
+    size_t length;
+    size_t mappedLength;    // 0 when chars is a heap buffer
+} Source;
+
+bool openSource(const char* path, Source* source);
+void streamSource(const Source* source);
+void closeSource(Source* source);
+
+#endif
@@ -77,6 +77,7 @@ void freeValueArray(ValueArray* array);
 void printValue(Value value);
 ObjString* asString(Value value);
 Value asBool(Value value);
+bool isFalsey(Value value);
 uint32_t hashValue(Value value);
 
 #endif
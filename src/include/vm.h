@@ -4,16 +4,25 @@
 #include "chunk.h"
 #include "table.h"
 #include "object.h"
+#include "output.h"
 
 #define FRAMES_MAX 255
 
+// Integers in [0, INT_STRING_CACHE_SIZE) keep the string asString() made
+// for them, so counters mixed into strings skip formatting and interning.
+#ifndef INT_STRING_CACHE_SIZE
+#define INT_STRING_CACHE_SIZE 1024
+#endif
+
 typedef struct {
     ObjFunction* function;
     uint8_t* ip;
     Value* slots;
 } CallFrame;
 
-typedef struct {
+typedef struct VM VM;
+
+struct VM {
     CallFrame frames[FRAMES_MAX];
     int frameCount;
     Value* stack;
@@ -22,7 +31,17 @@ typedef struct {
     Table globals;
     Table strings;
     Obj* objects;
-} VM;
+    OutputBuffer output;
+    OutputBuffer errors;    // runtime errors, unbuffered on stderr by default
+    // The VM whose code this one runs and whose interned strings it
+    // looks up before its own, or NULL.
+    VM* parent;
+
+    ObjString* trueString;
+    ObjString* falseString;
+    ObjString* noneString;
+    ObjString* intStrings[INT_STRING_CACHE_SIZE];
+};
 
 typedef enum {
     INTERPRET_OK,
@@ -30,12 +49,31 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+extern _Thread_local VM* vm;
 
+// Sets up the calling thread's own VM, or frees it along with what the
+// thread keeps between compiles.
 void initVM(void);
 void freeVM(void);
+
+// Separate VMs for embedding, each with its own globals, strings and
+// objects. Any number can run at once on different threads, but each one
+// only on one thread at a time.
+VM* newVM(void);
+void destroyVM(VM* instance);
+InterpretResult interpretIn(VM* instance, const char* source);
+// A VM that runs code compiled in parent: it has globals, a stack and
+// objects of its own, but shares parent's strings. Any number of children
+// can run at once as long as nothing runs in parent until they are gone.
+VM* newChildVM(VM* parent);
+// Makes instance the calling thread's current VM and returns the one it
+// replaces, for running or building values in it directly.
+VM* useVM(VM* instance);
+
 InterpretResult interpret(const char* source);
+InterpretResult interpretFunction(ObjFunction* function);
 void runtimeError(const char* errorType, const char* format, ...);
+const char* nativeName(NativeFn function);
 void push(Value value);
 Value pop(void);
 Value peek(int distance);
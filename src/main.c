@@ -3,9 +3,18 @@
 #include <string.h>
 #include <signal.h>
 
+#include "batch.h"
+#include "cache.h"
 #include "common.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
+#include "passes.h"
+#include "peephole.h"
+#include "server.h"
+#include "snapshot.h"
+#include "source.h"
 #include "vm.h"
 
 void sigCtrlC(int signum);
@@ -14,6 +23,7 @@ static void repl(void) {
    char line[1024];
     for (;;) {
         printf("PythOwOn <<< ");
+        fflush(stdout);
 
    //     signal(SIGINT, sigCtrlC);
 
@@ -37,56 +47,284 @@ void sigCtrlC(int signum) {
     }
 }
 
-static char* readFile(const char* path) {
-    FILE* file = fopen(path, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
-        exit(74);
+typedef struct {
+    bool stream;
+    const char* cacheDirectory;     // NULL for the default, "" with --no-cache
+    const char* snapshot;           // where to save the globals once the script has run
+    const char* batch;              // inputs to run the script over, one per line
+    int workers;                    // threads running a batch or processes serving, 0 for one per core
+} RunOptions;
+
+static void exitWith(InterpretResult result) {
+    flushOutput(&vm->output);
+    if (compilerOptions.passStats) {
+        printPassStats(stderr);
+        printPeepholeStats(stderr);
+    }
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);  //TODO: Error messages/stacktrace
+    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+// Prints what a job printed, and why it failed if it did.
+static void reportJob(BatchJob* job, int index) {
+    redirectOutput(&job->output, STDOUT_FD);
+    flushOutput(&job->output);
+    if (job->result != INTERPRET_OK) {
+        fprintf(stderr, "Job %d (%.*s) failed:\n", index + 1, job->length, job->input);
+        redirectOutput(&job->errors, STDERR_FD);
+        flushOutput(&job->errors);
     }
+}
 
-    fseek(file, 0L, SEEK_END);
-    size_t fileSize = ftell(file);
-    rewind(file);
+// Runs the script once for each line of the batch file, with the line in
+// `input`, and prints what each run printed in the order of the lines.
+static InterpretResult runBatchFile(ObjFunction* function, const RunOptions* options) {
+    Source inputs;
+    if (!openSource(options->batch, &inputs)) exit(74);
 
-    char* buffer = (char*)malloc(fileSize + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74);
+    int count = 0;
+    for (size_t i = 0; i < inputs.length; i++) {
+        if (inputs.chars[i] == '\n' || i + 1 == inputs.length) count++;
+    }
+    BatchJob* jobs = ALLOCATE(BatchJob, count);
+    const char* line = inputs.chars;
+    const char* end = inputs.chars + inputs.length;
+    for (int i = 0; i < count; i++) {
+        const char* next = memchr(line, '\n', (size_t)(end - line));
+        if (next == NULL) next = end;
+        jobs[i].input = line;
+        jobs[i].length = (int)(next - line);
+        if (jobs[i].length > 0 && line[jobs[i].length - 1] == '\r') jobs[i].length--;
+        line = next + 1;
     }
 
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize) {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
+    int failed = runBatch(function, jobs, count, options->workers, reportJob);
+    FREE_ARRAY(BatchJob, jobs, count);
+    closeSource(&inputs);
+    if (failed == 0) return INTERPRET_OK;
+    fprintf(stderr, "%d of %d jobs failed.\n", failed, count);
+    return INTERPRET_RUNTIME_ERROR;
+}
+
+// The cached bytecode for the script when there is any, or what it
+// compiles to, which is then cached. NULL after a compile error.
+static ObjFunction* loadScript(const char* path, const RunOptions* options, Source* source) {
+    if (!openSource(path, source)) exit(74);
+    if (options->stream) streamSource(source);
+
+    CacheEntry entry;
+    bool cached = (options->cacheDirectory == NULL || options->cacheDirectory[0] != '\0') &&
+                  findCacheEntry(options->cacheDirectory, source->chars, source->length, &entry);
+    ObjFunction* function = cached ? loadCache(&entry) : NULL;
+    if (function == NULL) {
+        function = compile(source->chars);
+        if (function != NULL && cached) storeCache(&entry, function);
+    }
+    return function;
+}
+
+static void runFile(const char* path, const RunOptions* options) {
+    Source source;
+    ObjFunction* function = loadScript(path, options, &source);
+
+    InterpretResult result = INTERPRET_COMPILE_ERROR;
+    if (function != NULL) {
+        result = options->batch != NULL ? runBatchFile(function, options)
+                                        : interpretFunction(function);
+    }
+    if (result == INTERPRET_OK && options->snapshot != NULL && !saveSnapshot(options->snapshot)) {
+        fprintf(stderr, "Could not write snapshot \"%s\".\n", options->snapshot);
         exit(74);
     }
+    closeSource(&source);
+    exitWith(result);
+}
 
-    buffer[bytesRead] = '\0';
+// Compiles the scripts and serves them on a socket until stopped. Requests
+// name a script by its path as given here.
+static void serve(const char* socketPath, const char** paths, int count, const RunOptions* options) {
+    ServedScript* scripts = ALLOCATE(ServedScript, count);
+    for (int i = 0; i < count; i++) {
+        Source source;
+        scripts[i].name = paths[i];
+        scripts[i].function = loadScript(paths[i], options, &source);
+        closeSource(&source);
+        if (scripts[i].function == NULL) exitWith(INTERPRET_COMPILE_ERROR);
+    }
 
-    fclose(file);
-    return buffer;
+    ServerOptions server = {socketPath, options->workers};
+    if (!runServer(scripts, count, &server)) exit(74);
+    exit(0);
 }
 
-static void runFile(const char* path) {
-    char* source = readFile(path);
-    InterpretResult result = interpret(source);
-    free(source);
+// Has a server run a script and passes on what it printed and its status.
+static void request(const char* socketPath, const char* name, const char* input) {
+    OutputBuffer output;
+    OutputBuffer errors;
+    initOutput(&output, STDOUT_FD, OUTPUT_BUFFER_SIZE);
+    // Held back too, so they come out after the output as they would have.
+    initOutput(&errors, STDERR_FD, OUTPUT_BUFFER_SIZE);
+    signal(SIGPIPE, SIG_IGN);
+    int status = sendRequest(socketPath, name, input, (int)strlen(input), &output, &errors);
+    freeOutput(&output);
+    freeOutput(&errors);
+    if (status < 0) {
+        fprintf(stderr, "No server answered on \"%s\".\n", socketPath);
+        exit(69);
+    }
+    exit(status);
+}
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);  //TODO: Error messages/stacktrace
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+// Loads a snapshot in place of running a script and calls one of its
+// functions.
+static void runImage(const char* path, const char* entry) {
+    if (!loadSnapshot(path)) {
+        fprintf(stderr, "Could not load snapshot \"%s\".\n", path);
+        exit(74);
+    }
+
+    Value function;
+    if (!tableGet(&vm->globals, OBJ_VAL(copyString(entry, (int)strlen(entry))), &function) ||
+        !IS_FUNCTION(function)) {
+        fprintf(stderr, "Snapshot \"%s\" has no function '%s'.\n", path, entry);
+        exit(70);
+    }
+    exitWith(interpretFunction(AS_FUNCTION(function)));
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: PythOwOn [options] [path | -]\n"
+                    "       PythOwOn --serve=SOCKET [options] path...\n"
+                    "  --buffer-size=N  buffer up to N bytes of output (default %d)\n"
+                    "  --unbuffered     write output as soon as it is printed\n"
+                    "  --stream         release the script's text as it is compiled\n"
+                    "  -O               compile through the syntax tree and run its passes\n"
+                    "  --passes=LIST    run only the comma-separated passes in LIST\n"
+                    "                   (or none), implies -O\n"
+                    "  --no-peephole    leave the emitted bytecode as it is\n"
+                    "  --lazy           compile each function on its first call\n"
+                    "  --cache-dir=DIR  keep compiled scripts in DIR\n"
+                    "                   (default $XDG_CACHE_HOME/pythowon or ~/.cache/pythowon)\n"
+                    "  --no-cache       always compile the script from source\n"
+                    "  --snapshot=FILE  save the globals to FILE once the script has run\n"
+                    "  --image=FILE     load the globals from a snapshot instead of a script\n"
+                    "  --entry=NAME     function to call in the snapshot (default main)\n"
+                    "  --batch=FILE     run the script once for each line of FILE, with\n"
+                    "                   the line in `input`, on several threads\n"
+                    "  --serve=SOCKET   compile the scripts given and run them for requests\n"
+                    "                   on a Unix socket, in worker processes\n"
+                    "  --connect=SOCKET have the server on SOCKET run the script named\n"
+                    "  --input=TEXT     what a request sets `input` to (default empty)\n"
+                    "  --jobs=N         run a batch on N threads, or serve with N workers\n"
+                    "                   (default one per core)\n"
+                    "  --pass-stats     report what each pass did on exit\n"
+                    "  -                read the script from stdin\n",
+                    OUTPUT_BUFFER_SIZE);
+    fprintf(stderr, "Passes (all enabled by default):\n");
+    listPasses(stderr);
+    exit(64);
 }
 
 int main(int argc, const char* argv[]) {
     initVM();
 
-    if (argc == 1) {
+    const char** paths = ALLOCATE(const char*, argc);
+    int pathCount = 0;
+    const char* image = NULL;
+    const char* entry = "main";
+    const char* serveSocket = NULL;
+    const char* connectSocket = NULL;
+    const char* input = "";
+    RunOptions options = {false, NULL, NULL, NULL, 0};
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--buffer-size=", 14) == 0) {
+            char* end;
+            long size = strtol(argv[i] + 14, &end, 10);
+            if (*end != '\0' || size < 0) usage();
+            setOutputCapacity(&vm->output, (size_t)size);
+        } else if (strcmp(argv[i], "--unbuffered") == 0) {
+            setOutputCapacity(&vm->output, 0);
+        } else if (strcmp(argv[i], "--stream") == 0) {
+            options.stream = true;
+        } else if (strcmp(argv[i], "-O") == 0) {
+            compilerOptions.pipeline = true;
+        } else if (strncmp(argv[i], "--passes=", 9) == 0) {
+            if (!selectPasses(argv[i] + 9)) usage();
+            compilerOptions.pipeline = true;
+        } else if (strcmp(argv[i], "--no-peephole") == 0) {
+            compilerOptions.peephole = false;
+        } else if (strncmp(argv[i], "--cache-dir=", 12) == 0) {
+            options.cacheDirectory = argv[i] + 12;
+            if (options.cacheDirectory[0] == '\0') usage();
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            options.cacheDirectory = "";
+        } else if (strncmp(argv[i], "--snapshot=", 11) == 0) {
+            options.snapshot = argv[i] + 11;
+        } else if (strncmp(argv[i], "--image=", 8) == 0) {
+            image = argv[i] + 8;
+        } else if (strncmp(argv[i], "--entry=", 8) == 0) {
+            entry = argv[i] + 8;
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            options.batch = argv[i] + 8;
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            char* end;
+            long workers = strtol(argv[i] + 7, &end, 10);
+            if (*end != '\0' || workers < 1 || workers > 1024) usage();
+            options.workers = (int)workers;
+        } else if (strncmp(argv[i], "--serve=", 8) == 0) {
+            serveSocket = argv[i] + 8;
+        } else if (strncmp(argv[i], "--connect=", 10) == 0) {
+            connectSocket = argv[i] + 10;
+        } else if (strncmp(argv[i], "--input=", 8) == 0) {
+            input = argv[i] + 8;
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            compilerOptions.lazy = true;
+        } else if (strcmp(argv[i], "--pass-stats") == 0) {
+            compilerOptions.passStats = true;
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            usage();
+        } else {
+            paths[pathCount++] = argv[i];
+        }
+    }
+
+    if (connectSocket != NULL) {
+        if (pathCount != 1 || serveSocket != NULL || image != NULL) usage();
+        request(connectSocket, paths[0], input);
+    }
+    if (serveSocket != NULL) {
+        if (pathCount == 0 || image != NULL || options.batch != NULL || options.snapshot != NULL) {
+            usage();
+        }
+        // Workers share the compiled scripts, which nothing may change
+        // once they are forked, so all of them are compiled up front.
+        compilerOptions.lazy = false;
+        serve(serveSocket, paths, pathCount, &options);
+    }
+    if (pathCount > 1) usage();
+    const char* path = pathCount == 1 ? paths[0] : NULL;
+
+    if (options.batch != NULL) {
+        if (path == NULL || options.snapshot != NULL) usage();
+        // The jobs share the compiled script, which nothing may change
+        // while they run, so all of it is compiled up front.
+        compilerOptions.lazy = false;
+    }
+
+    if (image != NULL) {
+        if (path != NULL || options.snapshot != NULL || options.batch != NULL) usage();
+        runImage(image, entry);
+    } else if (path == NULL) {
+        setOutputCapacity(&vm->output, 0);
+        // Each line reuses the buffer, so nothing can be compiled later.
+        compilerOptions.pipeline = false;
+        compilerOptions.lazy = false;
         repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(path, &options);
     }
 
+    FREE_ARRAY(const char*, paths, argc);
     freeVM();
     return 0;
 }
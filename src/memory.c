@@ -31,12 +31,22 @@ static void freeObject(Obj* object) {
             FREE(ObjString, object);
             break;
         }
+        case OBJ_STRING_VIEW:
+            FREE(ObjStringView, object);
+            break;
+        case OBJ_SWITCH: {
+            ObjSwitch* table = (ObjSwitch*)object;
+            FREE_ARRAY(int, table->dense, table->span);
+            freeTable(&table->sparse);
+            FREE(ObjSwitch, object);
+            break;
+        }
         default: runtimeError("InternalError: ", "Unknown object type ID: %d", object->type); break;
     }
 }
 
 void freeObjects(void) {
-    Obj* object = vm.objects;
+    Obj* object = vm->objects;
     while (object != NULL) {
         Obj* next = object->next;
         freeObject(object);
@@ -14,7 +14,8 @@
 static Obj* allocateObject(size_t size, ObjType type) {
     Obj* object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
-    object->next = vm.objects;
+    object->next = vm->objects;
+    vm->objects = object;
     return object;
 }
 
@@ -23,6 +24,8 @@ ObjFunction* newFunction(void) {
     function->arity = 0;
     function->defArity = 0;
     function->name = NULL;
+    function->source = NULL;
+    function->line = 0;
     initChunk(&function->chunk);
     return function;
 }
@@ -38,11 +41,11 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash) {
     string->length = length;
     string->chars = chars;
     string->hash = hash;
-    tableSet(&vm.strings, OBJ_VAL(string), NONE_VAL);
+    tableSet(&vm->strings, OBJ_VAL(string), NONE_VAL);
     return string;
 }
 
-static uint32_t hashString(const char* key, int length) {
+uint32_t hashString(const char* key, int length) {
     uint32_t hash = 2166136261u;
     for (int i = 0; i < length; i++) {
         hash ^= key[i];
@@ -52,9 +55,19 @@ static uint32_t hashString(const char* key, int length) {
     return hash;
 }
 
+// A VM shares the strings of its parent, and only interns those its
+// parent doesn't have.
+static ObjString* findInterned(const char* chars, int length, uint32_t hash) {
+    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
+    if (interned == NULL && vm->parent != NULL) {
+        interned = tableFindString(&vm->parent->strings, chars, length, hash);
+    }
+    return interned;
+}
+
 ObjString* takeString(char* chars, int length) {
     uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findInterned(chars, length, hash);
     if(interned != NULL) {
         FREE_ARRAY(char, chars, length + 1);
         return interned;
@@ -64,8 +77,13 @@ ObjString* takeString(char* chars, int length) {
 }
 
 ObjString* copyString(const char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    return copyStringHashed(chars, length, hashString(chars, length));
+}
+
+// For callers that already know the FNV-1a hash of chars, like the
+// compiler with identifiers the scanner has hashed.
+ObjString* copyStringHashed(const char* chars, int length, uint32_t hash) {
+    ObjString* interned = findInterned(chars, length, hash);
     if(interned != NULL) return interned;
 
     char* heapChars = ALLOCATE(char, length + 1);
@@ -74,24 +92,133 @@ ObjString* copyString(const char* chars, int length) {
     return allocateString(heapChars, length, hash);
 }
 
-ObjString* newString(const char* chars, int length) {
-    uint32_t hash = hashString(chars, length);
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
-    if(interned != NULL) return interned;
+ObjStringView* newStringView(ObjString* parent, int start, int length) {
+    ObjStringView* view = ALLOCATE_OBJ(ObjStringView, OBJ_STRING_VIEW);
+    view->parent = parent;
+    view->start = start;
+    view->length = length;
+    view->hashed = false;
+    view->hash = 0;
+    return view;
+}
 
-    char* heapChars = ALLOCATE(char, length);
-    memcpy(heapChars, chars, length);
-    return allocateString(heapChars, length, hash);
+ObjString* materializeView(ObjStringView* view) {
+    return copyString(view->parent->chars + view->start, view->length);
+}
+
+uint32_t hashStringView(ObjStringView* view) {
+    if (!view->hashed) {
+        view->hash = hashString(view->parent->chars + view->start, view->length);
+        view->hashed = true;
+    }
+    return view->hash;
+}
+
+bool isSwitchLabel(Value value) {
+    return (IS_INTEGER(value) && AS_INTEGER(value) < SWITCH_LABEL_LIMIT) || IS_STRINGLIKE(value);
+}
+
+// A label repeated later in the switch keeps the index of its first case,
+// which is the one the comparisons would have picked.
+ObjSwitch* newSwitch(const Value* labels, int count) {
+    ObjSwitch* table = ALLOCATE_OBJ(ObjSwitch, OBJ_SWITCH);
+    table->caseCount = count;
+    table->dense = NULL;
+    table->low = 0;
+    table->span = 0;
+    initTable(&table->sparse);
+
+    // Integers filling at least half of their range get an array.
+    bool integers = count > 0;
+    ulong low = 0;
+    ulong high = 0;
+    for (int i = 0; i < count; i++) {
+        if (!IS_INTEGER(labels[i])) {
+            integers = false;
+            break;
+        }
+
+        ulong label = AS_INTEGER(labels[i]);
+        if (i == 0 || label < low) low = label;
+        if (i == 0 || label > high) high = label;
+    }
+
+    if (integers && high - low < SWITCH_DENSE_MAX && high - low < (ulong)count * 2) {
+        table->low = low;
+        table->span = (int)(high - low + 1);
+        table->dense = ALLOCATE(int, table->span);
+        for (int i = 0; i < table->span; i++) table->dense[i] = count;
+        for (int i = count - 1; i >= 0; i--) table->dense[AS_INTEGER(labels[i]) - low] = i;
+        return table;
+    }
+
+    for (int i = 0; i < count; i++) {
+        Value index;
+        if (!tableGet(&table->sparse, labels[i], &index)) {
+            tableSet(&table->sparse, labels[i], INTEGER_VAL(i));
+        }
+    }
+    return table;
+}
+
+// The labels of a switch, in case order, rebuilt from its table. A label
+// repeated by a later case only maps to the first, so the later one gets
+// the first case's label instead, which keeps it just as unreachable.
+void switchLabels(const ObjSwitch* table, Value* labels) {
+    for (int i = 0; i < table->caseCount; i++) labels[i] = EMPTY_VAL;
+
+    if (table->dense != NULL) {
+        for (int i = 0; i < table->span; i++) {
+            int index = table->dense[i];
+            if (index < table->caseCount) labels[index] = INTEGER_VAL(table->low + (ulong)i);
+        }
+    } else {
+        for (int i = 0; i < table->sparse.capacity; i++) {
+            const Entry* entry = &table->sparse.entries[i];
+            if (!IS_EMPTY(entry->key)) labels[AS_INTEGER(entry->value)] = entry->key;
+        }
+    }
+
+    for (int i = 1; i < table->caseCount; i++) {
+        if (IS_EMPTY(labels[i])) labels[i] = labels[0];
+    }
+}
+
+int switchCase(ObjSwitch* table, Value subject) {
+    if (IS_DOUBLE(subject)) {
+        double number = AS_NUMBER(subject);
+        if (!(number >= 0 && number < (double)SWITCH_LABEL_LIMIT) ||
+            number != (double)(ulong)number) {
+            return table->caseCount;
+        }
+        subject = INTEGER_VAL((ulong)number);
+    }
+
+    if (table->dense != NULL) {
+        if (!IS_INTEGER(subject)) return table->caseCount;
+        ulong offset = AS_INTEGER(subject) - table->low;
+        return offset < (ulong)table->span ? table->dense[offset] : table->caseCount;
+    }
+
+    Value index;
+    if ((!IS_INTEGER(subject) && !IS_STRINGLIKE(subject)) ||
+        !tableGet(&table->sparse, subject, &index)) {
+        return table->caseCount;
+    }
+    return (int)AS_INTEGER(index);
 }
 
 static void printFunction(ObjFunction* function) {
     if (function->name == NULL) {
-        printf("<script>");
+        writeOutput(&vm->output, "<script>", 8);
         return;
     }
- //   printf("<fn %s>", function->name->chars);
-    printf("<func %s at 0x%.10" PRIXPTR ">", function->name->chars, (uintptr_t)function);
-  //  pop();
+
+    char chars[64];
+    writeOutput(&vm->output, "<func ", 6);
+    writeOutput(&vm->output, function->name->chars, function->name->length);
+    int length = snprintf(chars, sizeof(chars), " at 0x%.10" PRIXPTR ">", (uintptr_t)function);
+    writeOutput(&vm->output, chars, length);
 }
 
 void printObject(Value value) {
@@ -99,11 +226,19 @@ void printObject(Value value) {
         case OBJ_FUNCTION:
             printFunction(AS_FUNCTION(value));
             break;
-        case OBJ_NATIVE:
-            printf("<native func at 0x%.10" PRIXPTR ">", (uintptr_t)AS_FUNCTION(value));
+        case OBJ_NATIVE: {
+            char chars[64];
+            int length = snprintf(chars, sizeof(chars), "<native func at 0x%.10" PRIXPTR ">",
+                                  (uintptr_t)AS_FUNCTION(value));
+            writeOutput(&vm->output, chars, length);
             break;
+        }
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+        case OBJ_STRING_VIEW:
+            writeOutput(&vm->output, stringChars(value), stringLength(value));
+            break;
+        case OBJ_SWITCH:
+            writeOutput(&vm->output, "<switch table>", 14);
             break;
 
         default: runtimeError("InternalError: ", "Unknown object type ID: %d", OBJ_TYPE(value)); break;
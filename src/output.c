@@ -0,0 +1,109 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "memory.h"
+#include "output.h"
+
+void initOutput(OutputBuffer* output, int fd, size_t capacity) {
+    output->fd = fd;
+    output->buffer = NULL;
+    output->count = 0;
+    output->capacity = 0;
+    setOutputCapacity(output, capacity);
+}
+
+void freeOutput(OutputBuffer* output) {
+    flushOutput(output);
+    FREE_ARRAY(char, output->buffer, output->capacity);
+    output->buffer = NULL;
+    output->count = 0;
+    output->capacity = 0;
+}
+
+void setOutputCapacity(OutputBuffer* output, size_t capacity) {
+    flushOutput(output);
+    output->buffer = GROW_ARRAY(char, output->buffer, output->capacity, capacity);
+    output->capacity = capacity;
+}
+
+// Anything still held for the old fd is written first, unless it was
+// being kept in memory, which the new fd then gets.
+void redirectOutput(OutputBuffer* output, int fd) {
+    if (output->fd != OUTPUT_MEMORY) flushOutput(output);
+    output->fd = fd;
+}
+
+static void writeAll(int fd, const char* chars, size_t length) {
+    while (length > 0) {
+        long written = (long)write(fd, chars, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        chars += written;
+        length -= (size_t)written;
+    }
+}
+
+void writeOutput(OutputBuffer* output, const char* chars, size_t length) {
+    // The buffer may not have been allocated yet.
+    if (length == 0) return;
+    if (output->count + length > output->capacity && output->fd == OUTPUT_MEMORY) {
+        size_t capacity = output->capacity;
+        while (output->count + length > capacity) capacity = GROW_CAPACITY(capacity);
+        output->buffer = GROW_ARRAY(char, output->buffer, output->capacity, capacity);
+        output->capacity = capacity;
+    } else if (output->count + length > output->capacity) {
+        flushOutput(output);
+        if (length >= output->capacity) {
+            writeAll(output->fd, chars, length);
+            return;
+        }
+    }
+
+    memcpy(output->buffer + output->count, chars, length);
+    output->count += length;
+}
+
+void vprintOutput(OutputBuffer* output, const char* format, va_list args) {
+    char chars[256];
+    va_list copy;
+    va_copy(copy, args);
+    int length = vsnprintf(chars, sizeof(chars), format, copy);
+    va_end(copy);
+    if (length < 0) return;
+
+    if ((size_t)length < sizeof(chars)) {
+        writeOutput(output, chars, (size_t)length);
+        return;
+    }
+    char* heapChars = ALLOCATE(char, length + 1);
+    vsnprintf(heapChars, (size_t)length + 1, format, args);
+    writeOutput(output, heapChars, (size_t)length);
+    FREE_ARRAY(char, heapChars, length + 1);
+}
+
+void printOutput(OutputBuffer* output, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    vprintOutput(output, format, args);
+    va_end(args);
+}
+
+void flushOutput(OutputBuffer* output) {
+#if defined(DEBUG_PRINT_CODE) || defined(DEBUG_TRACE_EXECUTION)
+    // The disassembly and the debug trace go through stdio, so let
+    // anything it is holding go first to keep the two in order.
+    fflush(stdout);
+#endif
+    if (output->count == 0 || output->fd == OUTPUT_MEMORY) return;
+
+    writeAll(output->fd, output->buffer, output->count);
+    output->count = 0;
+}
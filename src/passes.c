@@ -0,0 +1,1704 @@
+#include <string.h>
+#include <time.h>
+
+#include "memory.h"
+#include "passes.h"
+
+// Constant folding on the tree. Unlike the direct compiler's folding,
+// which only sees the operand it has just emitted, this also knows the
+// type of every subexpression up front.
+
+static int fold(Node* node);
+
+static int foldList(NodeList* list) {
+    int changes = 0;
+    for (int i = 0; i < list->count; i++) changes += fold(list->items[i]);
+    return changes;
+}
+
+static int fold(Node* node) {
+    if (node == NULL) return 0;
+
+    int changes = 0;
+    switch (node->type) {
+        case NODE_LITERAL:
+        case NODE_VARIABLE:
+        case NODE_CONTINUE:
+            break;
+
+        case NODE_ASSIGN:
+            changes += fold(node->as.unary.operand);
+            node->kind = node->as.unary.operand->kind;
+            break;
+
+        case NODE_UNARY: {
+            Node* operand = node->as.unary.operand;
+            changes += fold(operand);
+
+            Value value;
+            if (operand->type == NODE_LITERAL &&
+                foldUnaryOperator(node->token.type, operand->as.literal, &value)) {
+                node->type = NODE_LITERAL;
+                node->as.literal = value;
+                node->kind = operandKind(value);
+                changes++;
+            } else {
+                node->kind = node->token.type == TOKEN_MINUS ? KIND_DOUBLE : KIND_UNKNOWN;
+            }
+            break;
+        }
+
+        case NODE_BINARY: {
+            Node* left = node->as.binary.left;
+            Node* right = node->as.binary.right;
+            changes += fold(left);
+            changes += fold(right);
+
+            Value value;
+            if (left->type == NODE_LITERAL && right->type == NODE_LITERAL &&
+                foldBinaryOperator(node->token.type, left->as.literal, right->as.literal, &value)) {
+                node->type = NODE_LITERAL;
+                node->as.literal = value;
+                node->kind = operandKind(value);
+                changes++;
+            } else if (right->type == NODE_LITERAL &&
+                       isIdentity(node->token.type, left->kind, right->as.literal)) {
+                *node = *left;
+                changes++;
+            } else {
+                node->kind = resultKind(node->token.type, left->kind, right->kind);
+            }
+            break;
+        }
+
+        case NODE_AND:
+        case NODE_OR:
+            changes += fold(node->as.binary.left);
+            changes += fold(node->as.binary.right);
+            break;
+
+        case NODE_CALL:
+            changes += fold(node->as.call.callee);
+            changes += foldList(&node->as.call.arguments);
+            break;
+
+        case NODE_EXPRESSION:
+        case NODE_PRINT:
+        case NODE_VAR:
+        case NODE_RETURN:
+            changes += fold(node->as.unary.operand);
+            break;
+
+        case NODE_FUNCTION:
+            changes += foldList(&node->as.function.parameters);
+            changes += foldList(&node->as.function.body);
+            break;
+
+        case NODE_BLOCK:
+            changes += foldList(&node->as.list);
+            break;
+
+        case NODE_IF:
+            changes += fold(node->as.branch.condition);
+            changes += fold(node->as.branch.thenBranch);
+            changes += fold(node->as.branch.elseBranch);
+            break;
+
+        case NODE_WHILE:
+        case NODE_FOR:
+            changes += fold(node->as.loop.initializer);
+            changes += fold(node->as.loop.condition);
+            changes += fold(node->as.loop.increment);
+            changes += fold(node->as.loop.body);
+            break;
+
+        case NODE_RANGE:
+            changes += fold(node->as.range.start);
+            changes += fold(node->as.range.stop);
+            changes += fold(node->as.range.step);
+            changes += fold(node->as.range.body);
+            break;
+
+        case NODE_SWITCH:
+            changes += fold(node->as.switchStmt.subject);
+            changes += foldList(&node->as.switchStmt.cases);
+            break;
+
+        case NODE_CASE:
+            changes += fold(node->as.caseArm.value);
+            changes += foldList(&node->as.caseArm.body);
+            break;
+    }
+    return changes;
+}
+
+static int foldPass(Node* program) {
+    return fold(program);
+}
+
+// Dead code: statements that can't be reached, branches on a literal
+// condition and switch arms that can never match. Mirrors what the direct
+// compiler drops as it goes.
+
+static int prune(Node* node, bool global);
+
+static bool isLiteralCondition(const Node* node, bool* isTrue) {
+    if (node == NULL || node->type != NODE_LITERAL) return false;
+    *isTrue = !isFalsey(node->as.literal);
+    return true;
+}
+
+// Whether control can never run off the end of a statement. There is no
+// break, so that includes loops without a condition.
+static bool terminates(const Node* node) {
+    if (node == NULL) return false;
+
+    switch (node->type) {
+        case NODE_RETURN:
+        case NODE_CONTINUE:
+            return true;
+        case NODE_BLOCK:
+            for (int i = 0; i < node->as.list.count; i++) {
+                if (terminates(node->as.list.items[i])) return true;
+            }
+            return false;
+        case NODE_IF:
+            return terminates(node->as.branch.thenBranch) &&
+                   terminates(node->as.branch.elseBranch);
+        case NODE_WHILE:
+        case NODE_FOR:
+            return node->as.loop.condition == NULL;
+        default:
+            return false;
+    }
+}
+
+static void emptyBlock(Node* node) {
+    node->type = NODE_BLOCK;
+    node->as.list = (NodeList){NULL, 0, 0};
+}
+
+// Locals declared in dead code keep their slots, so those declarations
+// stay (globals don't have that problem).
+static int pruneList(NodeList* list, bool global) {
+    int changes = 0;
+    int count = 0;
+    bool dead = false;
+
+    for (int i = 0; i < list->count; i++) {
+        Node* item = list->items[i];
+        bool declaresLocal = !global && (item->type == NODE_VAR || item->type == NODE_FUNCTION);
+        if (dead && !declaresLocal) {
+            changes++;
+            continue;
+        }
+
+        changes += prune(item, global);
+        list->items[count++] = item;
+        if (terminates(item)) dead = true;
+    }
+
+    list->count = count;
+    return changes;
+}
+
+static int pruneSwitch(Node* node, bool global) {
+    int changes = prune(node->as.switchStmt.subject, global);
+    NodeList* cases = &node->as.switchStmt.cases;
+
+    const Node* subject = node->as.switchStmt.subject;
+    if (subject->type != NODE_LITERAL) {
+        for (int i = 0; i < cases->count; i++) changes += prune(cases->items[i], global);
+        return changes;
+    }
+
+    // Arms after one that always matches are dead, and so is any arm with
+    // a literal value that isn't equal to the subject's.
+    int count = 0;
+    bool matched = false;
+    for (int i = 0; i < cases->count; i++) {
+        Node* arm = cases->items[i];
+        Node* value = arm->as.caseArm.value;
+
+        if (matched) {
+            changes++;
+            continue;
+        }
+        if (value != NULL && value->type == NODE_LITERAL) {
+            if (!valuesEqual(subject->as.literal, value->as.literal)) {
+                changes++;
+                continue;
+            }
+            // Nothing after it is kept, so it may as well be the default.
+            arm->as.caseArm.value = NULL;
+            changes++;
+        }
+        if (arm->as.caseArm.value == NULL) matched = true;
+
+        changes += prune(arm, global);
+        cases->items[count++] = arm;
+    }
+
+    cases->count = count;
+    return changes;
+}
+
+static int prune(Node* node, bool global) {
+    if (node == NULL) return 0;
+
+    int changes = 0;
+    bool isTrue;
+    switch (node->type) {
+        case NODE_FUNCTION:
+            changes += pruneList(&node->as.function.body, false);
+            break;
+
+        case NODE_BLOCK:
+            changes += pruneList(&node->as.list, false);
+            break;
+
+        case NODE_IF:
+            changes += prune(node->as.branch.thenBranch, global);
+            changes += prune(node->as.branch.elseBranch, global);
+            if (isLiteralCondition(node->as.branch.condition, &isTrue)) {
+                Node* taken = isTrue ? node->as.branch.thenBranch : node->as.branch.elseBranch;
+                if (taken != NULL) {
+                    *node = *taken;
+                } else {
+                    emptyBlock(node);
+                }
+                changes++;
+            }
+            break;
+
+        case NODE_WHILE:
+        case NODE_FOR:
+            changes += prune(node->as.loop.body, false);
+            if (isLiteralCondition(node->as.loop.condition, &isTrue)) {
+                if (isTrue) {
+                    node->as.loop.condition = NULL;
+                } else {
+                    // Only a for loop's initializer ever runs, in the
+                    // loop's own scope.
+                    Node* initializer = node->as.loop.initializer;
+                    emptyBlock(node);
+                    if (initializer != NULL) appendNode(&node->as.list, initializer);
+                }
+                changes++;
+            }
+            break;
+
+        case NODE_RANGE:
+            changes += prune(node->as.range.body, false);
+            break;
+
+        case NODE_SWITCH:
+            changes += pruneSwitch(node, global);
+            break;
+
+        case NODE_CASE:
+            changes += pruneList(&node->as.caseArm.body, global);
+            break;
+
+        default:
+            break;
+    }
+    return changes;
+}
+
+static int prunePass(Node* program) {
+    return pruneList(&program->as.list, true);
+}
+
+// Inlining of calls to small top-level functions whose body is a single
+// `return expression;`. The call is replaced by a copy of that expression
+// with the arguments substituted for the parameters, then folded again.
+//
+// The callee is only resolved statically when the whole script can't
+// rebind it: the function is declared once at the top level, its name is
+// never assigned anywhere, and the call comes from a top-level statement
+// after the declaration (or a function declared after it), so it has
+// been defined by the time the call runs. No guard is needed at run
+// time. The copy keeps the tokens of the callee's body and notes the call
+// it came from, so a runtime error in it reports the callee's frame, on
+// the line the error is on, after the caller's, on the line of the call.
+
+#define INLINE_MAX_NODES 16     // size of the returned expression
+#define INLINE_MAX_DEPTH 4      // inlining into code that was itself inlined
+
+typedef struct {
+    bool assigned;          // anywhere in the script
+    int declarations;       // by top-level statements
+    int firstDeclaration;   // index of the first of those statements
+} NameInfo;
+
+// Where a walk over the whole script has got to. Loop hoisting below
+// walks the same way.
+typedef struct {
+    Node* program;
+    int statement;      // top-level statement being walked
+
+    // Local names in scope, innermost last. Only those from base up are
+    // visible, as functions can't see their enclosing function's locals.
+    int* locals;
+    int localCount;
+    int localCapacity;
+    int base;
+    int depth;          // scope depth, 0 for globals
+
+    NameInfo* names;    // indexed by symbol
+    int nameCapacity;
+} Scope;
+
+typedef enum {
+    ARG_FREE,       // literal or local, can be copied any number of times
+    ARG_READ,       // global, read again at each use
+    ARG_COMPLEX,    // anything else, must be used exactly once
+} ArgumentKind;
+
+static void pushSymbol(int** symbols, int* count, int* capacity, int symbol) {
+    if (*capacity < *count + 1) {
+        int oldCapacity = *capacity;
+        *capacity = GROW_CAPACITY(oldCapacity);
+        *symbols = GROW_ARRAY(int, *symbols, oldCapacity, *capacity);
+    }
+    (*symbols)[(*count)++] = symbol;
+}
+
+static bool isLocalName(const Scope* scope, int symbol) {
+    for (int i = scope->localCount - 1; i >= scope->base; i--) {
+        if (scope->locals[i] == symbol) return true;
+    }
+    return false;
+}
+
+static NameInfo* nameInfo(Scope* scope, int symbol) {
+    if (symbol >= scope->nameCapacity) {
+        int oldCapacity = scope->nameCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        while (capacity <= symbol) capacity = GROW_CAPACITY(capacity);
+        scope->names = GROW_ARRAY(NameInfo, scope->names, oldCapacity, capacity);
+        memset(scope->names + oldCapacity, 0, sizeof(NameInfo) * (capacity - oldCapacity));
+        scope->nameCapacity = capacity;
+    }
+    return &scope->names[symbol];
+}
+
+static bool isAssigned(const Scope* scope, int symbol) {
+    return symbol < scope->nameCapacity && scope->names[symbol].assigned;
+}
+
+// How many top-level statements declare a name, and the first that does.
+static int topLevelDeclarations(const Scope* scope, int symbol, int* first) {
+    if (symbol >= scope->nameCapacity) return 0;
+    *first = scope->names[symbol].firstDeclaration;
+    return scope->names[symbol].declarations;
+}
+
+static void collectAssigned(Scope* scope, const Node* node);
+
+static void collectAssignedList(Scope* scope, const NodeList* list) {
+    for (int i = 0; i < list->count; i++) collectAssigned(scope, list->items[i]);
+}
+
+static void collectAssigned(Scope* scope, const Node* node) {
+    if (node == NULL) return;
+
+    switch (node->type) {
+        case NODE_ASSIGN:
+            nameInfo(scope, node->token.symbol)->assigned = true;
+            collectAssigned(scope, node->as.unary.operand);
+            break;
+        case NODE_UNARY:
+        case NODE_EXPRESSION:
+        case NODE_PRINT:
+        case NODE_VAR:
+        case NODE_RETURN:
+            collectAssigned(scope, node->as.unary.operand);
+            break;
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR:
+            collectAssigned(scope, node->as.binary.left);
+            collectAssigned(scope, node->as.binary.right);
+            break;
+        case NODE_CALL:
+            collectAssigned(scope, node->as.call.callee);
+            collectAssignedList(scope, &node->as.call.arguments);
+            break;
+        case NODE_FUNCTION:
+            collectAssignedList(scope, &node->as.function.parameters);
+            collectAssignedList(scope, &node->as.function.body);
+            break;
+        case NODE_BLOCK:
+            collectAssignedList(scope, &node->as.list);
+            break;
+        case NODE_IF:
+            collectAssigned(scope, node->as.branch.condition);
+            collectAssigned(scope, node->as.branch.thenBranch);
+            collectAssigned(scope, node->as.branch.elseBranch);
+            break;
+        case NODE_WHILE:
+        case NODE_FOR:
+            collectAssigned(scope, node->as.loop.initializer);
+            collectAssigned(scope, node->as.loop.condition);
+            collectAssigned(scope, node->as.loop.increment);
+            collectAssigned(scope, node->as.loop.body);
+            break;
+        case NODE_RANGE:
+            collectAssigned(scope, node->as.range.start);
+            collectAssigned(scope, node->as.range.stop);
+            collectAssigned(scope, node->as.range.step);
+            collectAssigned(scope, node->as.range.body);
+            break;
+        case NODE_SWITCH:
+            collectAssigned(scope, node->as.switchStmt.subject);
+            collectAssignedList(scope, &node->as.switchStmt.cases);
+            break;
+        case NODE_CASE:
+            collectAssigned(scope, node->as.caseArm.value);
+            collectAssignedList(scope, &node->as.caseArm.body);
+            break;
+        default:
+            break;
+    }
+}
+
+static void collectNames(Scope* scope) {
+    const NodeList* program = &scope->program->as.list;
+    for (int i = 0; i < program->count; i++) {
+        const Node* item = program->items[i];
+        if (item->type != NODE_VAR && item->type != NODE_FUNCTION) continue;
+
+        NameInfo* name = nameInfo(scope, item->token.symbol);
+        if (name->declarations++ == 0) name->firstDeclaration = i;
+    }
+    collectAssigned(scope, scope->program);
+}
+
+static void freeScope(Scope* scope) {
+    FREE_ARRAY(int, scope->locals, scope->localCapacity);
+    FREE_ARRAY(NameInfo, scope->names, scope->nameCapacity);
+}
+
+static int parameterIndex(const Node* function, int symbol) {
+    const NodeList* parameters = &function->as.function.parameters;
+    for (int i = parameters->count - 1; i >= 0; i--) {
+        if (parameters->items[i]->token.symbol == symbol) return i;
+    }
+    return -1;
+}
+
+// Size of an expression the inliner can copy, or -1 if it contains
+// something it can't (an assignment).
+static int expressionSize(const Node* node) {
+    int size;
+    switch (node->type) {
+        case NODE_LITERAL:
+        case NODE_VARIABLE:
+            return 1;
+        case NODE_UNARY:
+            size = expressionSize(node->as.unary.operand);
+            return size < 0 ? -1 : size + 1;
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR: {
+            int left = expressionSize(node->as.binary.left);
+            int right = expressionSize(node->as.binary.right);
+            return left < 0 || right < 0 ? -1 : left + right + 1;
+        }
+        case NODE_CALL: {
+            size = expressionSize(node->as.call.callee);
+            const NodeList* arguments = &node->as.call.arguments;
+            for (int i = 0; i < arguments->count && size >= 0; i++) {
+                int argument = expressionSize(arguments->items[i]);
+                size = argument < 0 ? -1 : size + argument;
+            }
+            return size < 0 ? -1 : size + 1;
+        }
+        default:
+            return -1;
+    }
+}
+
+static bool containsCall(const Node* node) {
+    switch (node->type) {
+        case NODE_CALL:
+            return true;
+        case NODE_UNARY:
+            return containsCall(node->as.unary.operand);
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR:
+            return containsCall(node->as.binary.left) || containsCall(node->as.binary.right);
+        default:
+            return false;
+    }
+}
+
+// The function a call can be inlined from, if any.
+static const Node* inlineTarget(const Scope* inliner, const Node* call) {
+    const Node* callee = call->as.call.callee;
+    if (callee->type != NODE_VARIABLE) return NULL;
+
+    int symbol = callee->token.symbol;
+    if (isLocalName(inliner, symbol) || isAssigned(inliner, symbol)) return NULL;
+
+    const Node* function = NULL;
+    const NodeList* program = &inliner->program->as.list;
+    for (int i = 0; i < program->count; i++) {
+        const Node* item = program->items[i];
+        if ((item->type == NODE_FUNCTION || item->type == NODE_VAR) &&
+            item->token.symbol == symbol) {
+            if (function != NULL || item->type != NODE_FUNCTION || i >= inliner->statement) {
+                return NULL;
+            }
+            function = item;
+        }
+    }
+    if (function == NULL) return NULL;
+
+    const NodeList* body = &function->as.function.body;
+    if (body->count != 1 || body->items[0]->type != NODE_RETURN) return NULL;
+    if (function->as.function.parameters.count != call->as.call.arguments.count) return NULL;
+
+    const Node* expression = body->items[0]->as.unary.operand;
+    if (expression == NULL) return NULL;
+    int size = expressionSize(expression);
+    if (size < 0 || size > INLINE_MAX_NODES) return NULL;
+    return function;
+}
+
+typedef struct {
+    const Node* function;
+    ArgumentKind kinds[UINT8_MAX + 1];
+    int uses[UINT8_MAX + 1];
+    int nextOrdered;    // first parameter whose argument may still be due
+    int count;
+    bool ok;
+} Substitution;
+
+// Arguments with effects (reads of globals included, as they can fail)
+// have to be evaluated in the order they were written and before anything
+// else with an effect, as they would be before a call.
+static bool orderedPending(const Substitution* substitution) {
+    for (int i = substitution->nextOrdered; i < substitution->count; i++) {
+        if (substitution->kinds[i] != ARG_FREE) return true;
+    }
+    return false;
+}
+
+static void effect(Substitution* substitution) {
+    if (orderedPending(substitution)) substitution->ok = false;
+}
+
+static void orderedUse(Substitution* substitution, int parameter) {
+    for (int i = substitution->nextOrdered; i < parameter; i++) {
+        if (substitution->kinds[i] != ARG_FREE) substitution->ok = false;
+    }
+    substitution->nextOrdered = parameter + 1;
+}
+
+static void checkOrder(Substitution* substitution, const Node* node) {
+    switch (node->type) {
+        case NODE_LITERAL:
+            break;
+
+        case NODE_VARIABLE: {
+            int parameter = parameterIndex(substitution->function, node->token.symbol);
+            if (parameter < 0) {
+                effect(substitution);
+                break;
+            }
+
+            int uses = ++substitution->uses[parameter];
+            switch (substitution->kinds[parameter]) {
+                case ARG_FREE:
+                    break;
+                case ARG_READ:
+                    if (uses == 1) orderedUse(substitution, parameter);
+                    break;
+                case ARG_COMPLEX:
+                    if (uses > 1) substitution->ok = false;
+                    orderedUse(substitution, parameter);
+                    break;
+            }
+            break;
+        }
+
+        case NODE_UNARY:
+            checkOrder(substitution, node->as.unary.operand);
+            effect(substitution);
+            break;
+
+        case NODE_BINARY:
+            checkOrder(substitution, node->as.binary.left);
+            checkOrder(substitution, node->as.binary.right);
+            effect(substitution);
+            break;
+
+        case NODE_AND:
+        case NODE_OR:
+            checkOrder(substitution, node->as.binary.left);
+            effect(substitution);
+            checkOrder(substitution, node->as.binary.right);
+            break;
+
+        case NODE_CALL: {
+            checkOrder(substitution, node->as.call.callee);
+            const NodeList* arguments = &node->as.call.arguments;
+            for (int i = 0; i < arguments->count; i++) checkOrder(substitution, arguments->items[i]);
+            effect(substitution);
+            break;
+        }
+
+        default:
+            substitution->ok = false;
+            break;
+    }
+}
+
+// Globals the body reads must still be globals where it is copied to.
+static bool freeNamesVisible(const Scope* inliner, const Node* function, const Node* node) {
+    switch (node->type) {
+        case NODE_VARIABLE:
+            return parameterIndex(function, node->token.symbol) >= 0 ||
+                   !isLocalName(inliner, node->token.symbol);
+        case NODE_UNARY:
+            return freeNamesVisible(inliner, function, node->as.unary.operand);
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR:
+            return freeNamesVisible(inliner, function, node->as.binary.left) &&
+                   freeNamesVisible(inliner, function, node->as.binary.right);
+        case NODE_CALL: {
+            if (!freeNamesVisible(inliner, function, node->as.call.callee)) return false;
+            const NodeList* arguments = &node->as.call.arguments;
+            for (int i = 0; i < arguments->count; i++) {
+                if (!freeNamesVisible(inliner, function, arguments->items[i])) return false;
+            }
+            return true;
+        }
+        default:
+            return true;
+    }
+}
+
+// The site of code in a callee's body once it is inlined at site: code
+// the callee had inlined itself is now inlined through the new call too.
+static const InlineSite* inlinedAt(const InlineSite* from, const InlineSite* site) {
+    if (from == NULL) return site;
+    return newInlineSite(inlinedAt(from->caller, site), &from->call, &from->function);
+}
+
+typedef struct {
+    const Node* function;
+    const NodeList* arguments;
+    const InlineSite* site;
+} Inlining;
+
+static Node* copyExpression(const Node* node, const Inlining* inlining);
+
+static Node* copyOperand(const Node* node, const Inlining* inlining) {
+    return node == NULL ? NULL : copyExpression(node, inlining);
+}
+
+// Deep copy of an expression. Copied out of a callee's body (when inlining
+// is not NULL), the parameters are replaced by copies of the arguments,
+// which stay the caller's code.
+static Node* copyExpression(const Node* node, const Inlining* inlining) {
+    if (node->type == NODE_VARIABLE && inlining != NULL) {
+        int parameter = parameterIndex(inlining->function, node->token.symbol);
+        if (parameter >= 0) return copyExpression(inlining->arguments->items[parameter], NULL);
+    }
+
+    Node* copy = newNode(node->type, &node->token);
+    *copy = *node;
+    if (inlining != NULL) copy->site = inlinedAt(node->site, inlining->site);
+    switch (node->type) {
+        case NODE_UNARY:
+            copy->as.unary.operand = copyOperand(node->as.unary.operand, inlining);
+            break;
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR:
+            copy->as.binary.left = copyOperand(node->as.binary.left, inlining);
+            copy->as.binary.right = copyOperand(node->as.binary.right, inlining);
+            break;
+        case NODE_CALL:
+            copy->as.call.callee = copyOperand(node->as.call.callee, inlining);
+            copy->as.call.arguments = (NodeList){NULL, 0, 0};
+            for (int i = 0; i < node->as.call.arguments.count; i++) {
+                appendNode(&copy->as.call.arguments,
+                           copyExpression(node->as.call.arguments.items[i], inlining));
+            }
+            break;
+        default:
+            break;
+    }
+    return copy;
+}
+
+static int inlineExpression(Scope* inliner, Node* node, int depth);
+
+static int tryInline(Scope* inliner, Node* call, int depth) {
+    const Node* function = inlineTarget(inliner, call);
+    if (function == NULL) return 0;
+
+    const Node* body = function->as.function.body.items[0]->as.unary.operand;
+    if (!freeNamesVisible(inliner, function, body)) return 0;
+
+    NodeList* arguments = &call->as.call.arguments;
+    Substitution substitution;
+    substitution.function = function;
+    substitution.nextOrdered = 0;
+    substitution.count = arguments->count;
+    substitution.ok = true;
+
+    bool anyComplex = false;
+    for (int i = 0; i < arguments->count; i++) {
+        const Node* argument = arguments->items[i];
+        if (expressionSize(argument) < 0) return 0;
+
+        substitution.uses[i] = 0;
+        if (argument->type == NODE_LITERAL ||
+            (argument->type == NODE_VARIABLE && isLocalName(inliner, argument->token.symbol))) {
+            substitution.kinds[i] = ARG_FREE;
+        } else if (argument->type == NODE_VARIABLE) {
+            substitution.kinds[i] = ARG_READ;
+        } else {
+            substitution.kinds[i] = ARG_COMPLEX;
+            anyComplex = true;
+        }
+    }
+
+    // A global passed in can be read again at each use only if nothing
+    // evaluated in between could assign to it.
+    if (anyComplex || containsCall(body)) {
+        for (int i = 0; i < arguments->count; i++) {
+            if (substitution.kinds[i] == ARG_READ) substitution.kinds[i] = ARG_COMPLEX;
+        }
+    }
+
+    checkOrder(&substitution, body);
+    if (!substitution.ok || orderedPending(&substitution)) return 0;
+
+    Inlining inlining = {function, arguments,
+                         newInlineSite(call->site, &call->end, &function->token)};
+    *call = *copyExpression(body, &inlining);
+    int changes = 1 + fold(call);
+    if (depth < INLINE_MAX_DEPTH) changes += inlineExpression(inliner, call, depth + 1);
+    return changes;
+}
+
+static int inlineExpression(Scope* inliner, Node* node, int depth) {
+    if (node == NULL) return 0;
+
+    int changes = 0;
+    switch (node->type) {
+        case NODE_ASSIGN:
+        case NODE_UNARY:
+            changes += inlineExpression(inliner, node->as.unary.operand, depth);
+            break;
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR:
+            changes += inlineExpression(inliner, node->as.binary.left, depth);
+            changes += inlineExpression(inliner, node->as.binary.right, depth);
+            break;
+        case NODE_CALL:
+            changes += inlineExpression(inliner, node->as.call.callee, depth);
+            for (int i = 0; i < node->as.call.arguments.count; i++) {
+                changes += inlineExpression(inliner, node->as.call.arguments.items[i], depth);
+            }
+            changes += tryInline(inliner, node, depth);
+            break;
+        default:
+            break;
+    }
+    if (changes > 0) fold(node);
+    return changes;
+}
+
+static int inlineStatement(Scope* inliner, Node* node);
+
+static int inlineList(Scope* inliner, NodeList* list) {
+    int changes = 0;
+    for (int i = 0; i < list->count; i++) changes += inlineStatement(inliner, list->items[i]);
+    return changes;
+}
+
+static void declareLocal(Scope* scope, int symbol) {
+    if (scope->depth > 0) {
+        pushSymbol(&scope->locals, &scope->localCount, &scope->localCapacity, symbol);
+    }
+}
+
+static int inlineStatement(Scope* inliner, Node* node) {
+    if (node == NULL) return 0;
+
+    int changes = 0;
+    switch (node->type) {
+        case NODE_EXPRESSION:
+        case NODE_PRINT:
+        case NODE_RETURN:
+            changes += inlineExpression(inliner, node->as.unary.operand, 0);
+            break;
+
+        case NODE_VAR:
+            changes += inlineExpression(inliner, node->as.unary.operand, 0);
+            declareLocal(inliner, node->token.symbol);
+            break;
+
+        case NODE_FUNCTION: {
+            declareLocal(inliner, node->token.symbol);
+
+            int localCount = inliner->localCount;
+            int base = inliner->base;
+            int depth = inliner->depth;
+            inliner->base = localCount;
+            inliner->depth = 1;
+
+            NodeList* parameters = &node->as.function.parameters;
+            for (int i = 0; i < parameters->count; i++) {
+                changes += inlineExpression(inliner, parameters->items[i]->as.unary.operand, 0);
+                declareLocal(inliner, parameters->items[i]->token.symbol);
+            }
+            changes += inlineList(inliner, &node->as.function.body);
+
+            inliner->localCount = localCount;
+            inliner->base = base;
+            inliner->depth = depth;
+            break;
+        }
+
+        case NODE_BLOCK: {
+            int localCount = inliner->localCount;
+            inliner->depth++;
+            changes += inlineList(inliner, &node->as.list);
+            inliner->depth--;
+            inliner->localCount = localCount;
+            break;
+        }
+
+        case NODE_IF:
+            changes += inlineExpression(inliner, node->as.branch.condition, 0);
+            changes += inlineStatement(inliner, node->as.branch.thenBranch);
+            changes += inlineStatement(inliner, node->as.branch.elseBranch);
+            break;
+
+        case NODE_WHILE:
+            changes += inlineExpression(inliner, node->as.loop.condition, 0);
+            changes += inlineStatement(inliner, node->as.loop.body);
+            break;
+
+        case NODE_FOR: {
+            int localCount = inliner->localCount;
+            inliner->depth++;
+            changes += inlineStatement(inliner, node->as.loop.initializer);
+            changes += inlineExpression(inliner, node->as.loop.condition, 0);
+            changes += inlineExpression(inliner, node->as.loop.increment, 0);
+            changes += inlineStatement(inliner, node->as.loop.body);
+            inliner->depth--;
+            inliner->localCount = localCount;
+            break;
+        }
+
+        case NODE_RANGE: {
+            changes += inlineExpression(inliner, node->as.range.start, 0);
+            changes += inlineExpression(inliner, node->as.range.stop, 0);
+            changes += inlineExpression(inliner, node->as.range.step, 0);
+
+            int localCount = inliner->localCount;
+            inliner->depth++;
+            declareLocal(inliner, node->token.symbol);
+            changes += inlineStatement(inliner, node->as.range.body);
+            inliner->depth--;
+            inliner->localCount = localCount;
+            break;
+        }
+
+        case NODE_SWITCH:
+            changes += inlineExpression(inliner, node->as.switchStmt.subject, 0);
+            for (int i = 0; i < node->as.switchStmt.cases.count; i++) {
+                Node* arm = node->as.switchStmt.cases.items[i];
+                changes += inlineExpression(inliner, arm->as.caseArm.value, 0);
+                changes += inlineList(inliner, &arm->as.caseArm.body);
+            }
+            break;
+
+        default:
+            break;
+    }
+    return changes;
+}
+
+static int inlinePass(Node* program) {
+    Scope inliner = {program, 0, NULL, 0, 0, 0, 0, NULL, 0};
+    collectNames(&inliner);
+
+    int changes = 0;
+    for (int i = 0; i < program->as.list.count; i++) {
+        inliner.statement = i;
+        changes += inlineStatement(&inliner, program->as.list.items[i]);
+    }
+
+    freeScope(&inliner);
+    return changes;
+}
+
+// Loop-invariant code motion. Global reads that can't change while a
+// while or for loop runs, and operators on them that can't fail, are
+// evaluated once into hidden locals declared just before the loop, so
+//
+//     while (i < LIMIT * 2) i = i + STEP;
+//
+// runs as if it were
+//
+//     { var a = LIMIT * 2; var b = STEP; while (i < a) i = i + b; }
+//
+// A global is invariant if the loop doesn't assign it and calls nothing
+// that might. Calls to a top-level function are checked against the
+// globals it, and whatever it calls, assigns; a call to anything else may
+// assign any global. Hoisting must not raise an error the loop wouldn't
+// have, even when the loop never runs, so only globals declared by an
+// earlier top-level statement are read early, and an operator is only
+// hoisted where the kinds of its operands rule out an error. A global has
+// a kind only if it is declared once with a literal and never assigned.
+
+#define LICM_MAX_HOISTS 8       // hidden locals per loop
+#define RANGE_HIDDEN_LOCALS 3   // counter, stop and step of a range loop
+
+typedef struct {
+    int* symbols;
+    int count;
+    int capacity;
+} SymbolSet;
+
+// What running some code can do to variables.
+typedef struct {
+    SymbolSet globals;      // globals it assigns
+    SymbolSet locals;       // locals it assigns or declares
+    SymbolSet callees;      // top-level functions it calls, as indices into Hoister.functions
+    bool unknown;           // calls something that might assign any global
+    int hidden;             // locals the compiler adds, for switch subjects and range bounds
+} Effects;
+
+typedef struct {
+    const Node* function;
+    Effects effects;        // of its body and everything it calls
+} FunctionEffects;
+
+typedef struct {
+    Scope scope;
+    FunctionEffects* functions;
+    int functionCount;
+    int functionCapacity;
+    int hidden;             // the same, around the current statement, in the current function
+} Hoister;
+
+typedef struct {
+    const Effects* effects;
+    Node* declarations[LICM_MAX_HOISTS];
+    int count;
+} Loop;
+
+static bool hasSymbol(const SymbolSet* set, int symbol) {
+    for (int i = 0; i < set->count; i++) {
+        if (set->symbols[i] == symbol) return true;
+    }
+    return false;
+}
+
+static bool addSymbol(SymbolSet* set, int symbol) {
+    if (hasSymbol(set, symbol)) return false;
+    pushSymbol(&set->symbols, &set->count, &set->capacity, symbol);
+    return true;
+}
+
+static void freeEffects(Effects* effects) {
+    FREE_ARRAY(int, effects->globals.symbols, effects->globals.capacity);
+    FREE_ARRAY(int, effects->locals.symbols, effects->locals.capacity);
+    FREE_ARRAY(int, effects->callees.symbols, effects->callees.capacity);
+}
+
+static bool isNumeric(OperandKind kind) {
+    return kind == KIND_INTEGER || kind == KIND_DOUBLE || kind == KIND_NUMBER;
+}
+
+static int functionIndex(const Hoister* hoister, int symbol) {
+    for (int i = 0; i < hoister->functionCount; i++) {
+        if (hoister->functions[i].function->token.symbol == symbol) return i;
+    }
+    return -1;
+}
+
+static void summarizeCall(Hoister* hoister, Effects* effects, const Node* callee) {
+    const Scope* scope = &hoister->scope;
+    if (callee->type != NODE_VARIABLE || isLocalName(scope, callee->token.symbol)) {
+        effects->unknown = true;
+        return;
+    }
+
+    int symbol = callee->token.symbol;
+    int function = functionIndex(hoister, symbol);
+    if (function >= 0) {
+        addSymbol(&effects->callees, function);
+        return;
+    }
+
+    // A name the script never defines is a native or nothing at all, and
+    // neither assigns globals.
+    int first;
+    if (topLevelDeclarations(scope, symbol, &first) > 0 || isAssigned(scope, symbol)) {
+        effects->unknown = true;
+    }
+}
+
+static void summarize(Hoister* hoister, Effects* effects, const Node* node);
+
+static void summarizeList(Hoister* hoister, Effects* effects, const NodeList* list) {
+    for (int i = 0; i < list->count; i++) summarize(hoister, effects, list->items[i]);
+}
+
+static void summarize(Hoister* hoister, Effects* effects, const Node* node) {
+    if (node == NULL) return;
+
+    Scope* scope = &hoister->scope;
+    switch (node->type) {
+        case NODE_ASSIGN:
+            if (isLocalName(scope, node->token.symbol)) {
+                addSymbol(&effects->locals, node->token.symbol);
+            } else {
+                addSymbol(&effects->globals, node->token.symbol);
+            }
+            summarize(hoister, effects, node->as.unary.operand);
+            break;
+        case NODE_UNARY:
+        case NODE_EXPRESSION:
+        case NODE_PRINT:
+        case NODE_RETURN:
+            summarize(hoister, effects, node->as.unary.operand);
+            break;
+        case NODE_VAR:
+            summarize(hoister, effects, node->as.unary.operand);
+            addSymbol(&effects->locals, node->token.symbol);
+            declareLocal(scope, node->token.symbol);
+            break;
+        case NODE_FUNCTION:
+            // The body runs when the function is called, not here.
+            addSymbol(&effects->locals, node->token.symbol);
+            declareLocal(scope, node->token.symbol);
+            break;
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR:
+            summarize(hoister, effects, node->as.binary.left);
+            summarize(hoister, effects, node->as.binary.right);
+            break;
+        case NODE_CALL:
+            summarize(hoister, effects, node->as.call.callee);
+            summarizeList(hoister, effects, &node->as.call.arguments);
+            summarizeCall(hoister, effects, node->as.call.callee);
+            break;
+        case NODE_BLOCK: {
+            int localCount = scope->localCount;
+            scope->depth++;
+            summarizeList(hoister, effects, &node->as.list);
+            scope->depth--;
+            scope->localCount = localCount;
+            break;
+        }
+        case NODE_IF:
+            summarize(hoister, effects, node->as.branch.condition);
+            summarize(hoister, effects, node->as.branch.thenBranch);
+            summarize(hoister, effects, node->as.branch.elseBranch);
+            break;
+        case NODE_WHILE:
+        case NODE_FOR: {
+            int localCount = scope->localCount;
+            scope->depth++;
+            summarize(hoister, effects, node->as.loop.initializer);
+            summarize(hoister, effects, node->as.loop.condition);
+            summarize(hoister, effects, node->as.loop.increment);
+            summarize(hoister, effects, node->as.loop.body);
+            scope->depth--;
+            scope->localCount = localCount;
+            break;
+        }
+        case NODE_RANGE: {
+            effects->hidden += RANGE_HIDDEN_LOCALS;
+            summarize(hoister, effects, node->as.range.start);
+            summarize(hoister, effects, node->as.range.stop);
+            summarize(hoister, effects, node->as.range.step);
+
+            int localCount = scope->localCount;
+            scope->depth++;
+            addSymbol(&effects->locals, node->token.symbol);
+            declareLocal(scope, node->token.symbol);
+            summarize(hoister, effects, node->as.range.body);
+            scope->depth--;
+            scope->localCount = localCount;
+            break;
+        }
+        case NODE_SWITCH:
+            effects->hidden++;
+            summarize(hoister, effects, node->as.switchStmt.subject);
+            summarizeList(hoister, effects, &node->as.switchStmt.cases);
+            break;
+        case NODE_CASE:
+            summarize(hoister, effects, node->as.caseArm.value);
+            summarizeList(hoister, effects, &node->as.caseArm.body);
+            break;
+        default:
+            break;
+    }
+}
+
+// Adds in what the functions called can do. Returns whether anything new
+// was added.
+static bool includeCallees(const Hoister* hoister, Effects* effects) {
+    bool changed = false;
+    for (int i = 0; i < effects->callees.count; i++) {
+        const Effects* callee = &hoister->functions[effects->callees.symbols[i]].effects;
+        if (callee->unknown && !effects->unknown) {
+            effects->unknown = true;
+            changed = true;
+        }
+        for (int j = 0; j < callee->globals.count; j++) {
+            if (addSymbol(&effects->globals, callee->globals.symbols[j])) changed = true;
+        }
+    }
+    return changed;
+}
+
+// Effects of every top-level function a call can be resolved to, which
+// are those declared once and never assigned.
+static void summarizeFunctions(Hoister* hoister) {
+    Scope* scope = &hoister->scope;
+    const NodeList* program = &scope->program->as.list;
+    for (int i = 0; i < program->count; i++) {
+        const Node* item = program->items[i];
+        int first;
+        if (item->type != NODE_FUNCTION || isAssigned(scope, item->token.symbol) ||
+            topLevelDeclarations(scope, item->token.symbol, &first) != 1) {
+            continue;
+        }
+
+        if (hoister->functionCapacity < hoister->functionCount + 1) {
+            int oldCapacity = hoister->functionCapacity;
+            hoister->functionCapacity = GROW_CAPACITY(oldCapacity);
+            hoister->functions = GROW_ARRAY(FunctionEffects, hoister->functions,
+                                            oldCapacity, hoister->functionCapacity);
+        }
+        FunctionEffects* function = &hoister->functions[hoister->functionCount++];
+        function->function = item;
+        memset(&function->effects, 0, sizeof(Effects));
+    }
+
+    for (int i = 0; i < hoister->functionCount; i++) {
+        const Node* function = hoister->functions[i].function;
+        Effects* effects = &hoister->functions[i].effects;
+        scope->base = scope->localCount;
+        scope->depth = 1;
+
+        const NodeList* parameters = &function->as.function.parameters;
+        for (int j = 0; j < parameters->count; j++) {
+            summarize(hoister, effects, parameters->items[j]->as.unary.operand);
+            declareLocal(scope, parameters->items[j]->token.symbol);
+        }
+        summarizeList(hoister, effects, &function->as.function.body);
+
+        scope->localCount = 0;
+        scope->base = 0;
+        scope->depth = 0;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < hoister->functionCount; i++) {
+            if (includeCallees(hoister, &hoister->functions[i].effects)) changed = true;
+        }
+    }
+}
+
+// Whether a global can be read before the loop: an earlier top-level
+// statement declared it, so it is defined by the time the loop runs.
+static bool definedGlobal(const Scope* scope, int symbol, OperandKind* kind) {
+    int first;
+    int count = topLevelDeclarations(scope, symbol, &first);
+    if (count == 0 || first > scope->statement) return false;
+
+    const Node* declaration = scope->program->as.list.items[first];
+    const Node* value = declaration->as.unary.operand;
+    if (count == 1 && declaration->type == NODE_VAR && !isAssigned(scope, symbol) &&
+        value != NULL && value->type == NODE_LITERAL) {
+        *kind = operandKind(value->as.literal);
+    }
+    return true;
+}
+
+static bool isNonZero(const Node* node) {
+    if (node->type != NODE_LITERAL) return false;
+    Value value = node->as.literal;
+    if (IS_INTEGER(value)) return AS_INTEGER(value) != 0;
+    return IS_DOUBLE(value) && AS_NUMBER(value) != 0;
+}
+
+static bool cannotFail(const Node* node, OperandKind left, OperandKind right) {
+    switch (node->token.type) {
+        case TOKEN_EQ_EQ:
+        case TOKEN_EXCLAM_EQ:
+            return true;
+        case TOKEN_PLUS:
+        case TOKEN_MINUS:
+        case TOKEN_STAR:
+        case TOKEN_LESS:
+        case TOKEN_LESS_EQ:
+        case TOKEN_GREATER:
+        case TOKEN_GREATER_EQ:
+            return isNumeric(left) && isNumeric(right);
+        case TOKEN_SLASH:
+            return isNumeric(left) && isNonZero(node->as.binary.right);
+        case TOKEN_PERCENT:
+            return left == KIND_INTEGER && right == KIND_INTEGER && isNonZero(node->as.binary.right);
+        case TOKEN_LSHIFT:
+        case TOKEN_RSHIFT:
+            return left == KIND_INTEGER && right == KIND_INTEGER;
+        default:
+            return false;
+    }
+}
+
+// Whether an expression has the same value on every iteration and can be
+// evaluated before the loop without raising an error.
+static bool invariant(const Hoister* hoister, const Effects* effects, const Node* node,
+                      OperandKind* kind) {
+    *kind = KIND_UNKNOWN;
+    switch (node->type) {
+        case NODE_LITERAL:
+            *kind = operandKind(node->as.literal);
+            return true;
+
+        case NODE_VARIABLE: {
+            int symbol = node->token.symbol;
+            if (hasSymbol(&effects->locals, symbol)) return false;
+            if (isLocalName(&hoister->scope, symbol)) return true;
+            if (effects->unknown || hasSymbol(&effects->globals, symbol)) return false;
+            return definedGlobal(&hoister->scope, symbol, kind);
+        }
+
+        case NODE_UNARY: {
+            OperandKind operand;
+            if (!invariant(hoister, effects, node->as.unary.operand, &operand) ||
+                !isNumeric(operand)) {
+                return false;
+            }
+            if (node->token.type == TOKEN_MINUS) *kind = KIND_DOUBLE;
+            return true;
+        }
+
+        case NODE_BINARY: {
+            OperandKind left, right;
+            if (!invariant(hoister, effects, node->as.binary.left, &left) ||
+                !invariant(hoister, effects, node->as.binary.right, &right) ||
+                !cannotFail(node, left, right)) {
+                return false;
+            }
+            *kind = resultKind(node->token.type, left, right);
+            return true;
+        }
+
+        default:
+            return false;
+    }
+}
+
+static bool sameExpression(const Node* a, const Node* b) {
+    if (a->type != b->type) return false;
+
+    switch (a->type) {
+        case NODE_LITERAL:
+            return a->as.literal.type == b->as.literal.type &&
+                   valuesEqual(a->as.literal, b->as.literal);
+        case NODE_VARIABLE:
+            return a->token.symbol == b->token.symbol;
+        case NODE_UNARY:
+            return a->token.type == b->token.type &&
+                   sameExpression(a->as.unary.operand, b->as.unary.operand);
+        case NODE_BINARY:
+            return a->token.type == b->token.type &&
+                   sameExpression(a->as.binary.left, b->as.binary.left) &&
+                   sameExpression(a->as.binary.right, b->as.binary.right);
+        default:
+            return false;
+    }
+}
+
+// Moves an invariant expression into a hidden local, or reuses the one an
+// identical expression went into.
+static int hoistOut(Loop* loop, Node* node, OperandKind kind) {
+    Node* declaration = NULL;
+    for (int i = 0; i < loop->count; i++) {
+        if (sameExpression(loop->declarations[i]->as.unary.operand, node)) {
+            declaration = loop->declarations[i];
+            break;
+        }
+    }
+
+    if (declaration == NULL) {
+        if (loop->count == LICM_MAX_HOISTS) return 0;
+
+        Token name = node->token;
+        name.type = TOKEN_IDENTIFIER;
+        name.decoded = false;
+        name.symbol = hiddenSymbol();
+        declaration = newNode(NODE_VAR, &name);
+
+        Node* value = newNode(node->type, &node->token);
+        *value = *node;
+        declaration->as.unary.operand = value;
+        loop->declarations[loop->count++] = declaration;
+    }
+
+    node->type = NODE_VARIABLE;
+    node->token = declaration->token;
+    node->kind = kind;
+    return 1;
+}
+
+static int hoistExpression(const Hoister* hoister, Loop* loop, Node* node) {
+    if (node == NULL) return 0;
+
+    // Literals and locals are as cheap to use as a hidden local would be.
+    OperandKind kind;
+    if (node->type != NODE_LITERAL &&
+        !(node->type == NODE_VARIABLE && isLocalName(&hoister->scope, node->token.symbol)) &&
+        invariant(hoister, loop->effects, node, &kind)) {
+        return hoistOut(loop, node, kind);
+    }
+
+    int changes = 0;
+    switch (node->type) {
+        case NODE_ASSIGN:
+        case NODE_UNARY:
+            changes += hoistExpression(hoister, loop, node->as.unary.operand);
+            break;
+        case NODE_BINARY:
+        case NODE_AND:
+        case NODE_OR:
+            changes += hoistExpression(hoister, loop, node->as.binary.left);
+            changes += hoistExpression(hoister, loop, node->as.binary.right);
+            break;
+        case NODE_CALL:
+            changes += hoistExpression(hoister, loop, node->as.call.callee);
+            for (int i = 0; i < node->as.call.arguments.count; i++) {
+                changes += hoistExpression(hoister, loop, node->as.call.arguments.items[i]);
+            }
+            break;
+        default:
+            break;
+    }
+    return changes;
+}
+
+static int hoistStatement(const Hoister* hoister, Loop* loop, Node* node);
+
+static int hoistList(const Hoister* hoister, Loop* loop, NodeList* list) {
+    int changes = 0;
+    for (int i = 0; i < list->count; i++) changes += hoistStatement(hoister, loop, list->items[i]);
+    return changes;
+}
+
+static int hoistStatement(const Hoister* hoister, Loop* loop, Node* node) {
+    if (node == NULL) return 0;
+
+    int changes = 0;
+    switch (node->type) {
+        case NODE_EXPRESSION:
+        case NODE_PRINT:
+        case NODE_VAR:
+        case NODE_RETURN:
+            changes += hoistExpression(hoister, loop, node->as.unary.operand);
+            break;
+        case NODE_BLOCK:
+            changes += hoistList(hoister, loop, &node->as.list);
+            break;
+        case NODE_IF:
+            changes += hoistExpression(hoister, loop, node->as.branch.condition);
+            changes += hoistStatement(hoister, loop, node->as.branch.thenBranch);
+            changes += hoistStatement(hoister, loop, node->as.branch.elseBranch);
+            break;
+        case NODE_WHILE:
+        case NODE_FOR:
+            changes += hoistStatement(hoister, loop, node->as.loop.initializer);
+            changes += hoistExpression(hoister, loop, node->as.loop.condition);
+            changes += hoistExpression(hoister, loop, node->as.loop.increment);
+            changes += hoistStatement(hoister, loop, node->as.loop.body);
+            break;
+        case NODE_RANGE:
+            changes += hoistExpression(hoister, loop, node->as.range.start);
+            changes += hoistExpression(hoister, loop, node->as.range.stop);
+            changes += hoistExpression(hoister, loop, node->as.range.step);
+            changes += hoistStatement(hoister, loop, node->as.range.body);
+            break;
+        case NODE_SWITCH:
+            changes += hoistExpression(hoister, loop, node->as.switchStmt.subject);
+            for (int i = 0; i < node->as.switchStmt.cases.count; i++) {
+                Node* arm = node->as.switchStmt.cases.items[i];
+                changes += hoistExpression(hoister, loop, arm->as.caseArm.value);
+                changes += hoistList(hoister, loop, &arm->as.caseArm.body);
+            }
+            break;
+        default:
+            break;
+    }
+    return changes;
+}
+
+// Hoists what it can out of a loop, wrapping the loop in a block that
+// declares the hidden locals first.
+static int hoistLoop(Hoister* hoister, Node* node) {
+    Effects effects;
+    memset(&effects, 0, sizeof(Effects));
+    summarize(hoister, &effects, node);
+    includeCallees(hoister, &effects);
+
+    const Scope* scope = &hoister->scope;
+    // Slot 0, the locals in scope, the compiler's hidden locals around and
+    // in the loop, what the loop declares and the hoisted locals.
+    int slots = 1 + scope->localCount - scope->base + hoister->hidden + effects.hidden +
+                effects.locals.count + LICM_MAX_HOISTS;
+    int changes = 0;
+    Loop loop;
+    loop.effects = &effects;
+    loop.count = 0;
+    if (slots <= UINT8_MAX + 1) {
+        if (node->type == NODE_RANGE) {
+            // Its bounds are only evaluated once anyway.
+            changes += hoistStatement(hoister, &loop, node->as.range.body);
+        } else {
+            changes += hoistExpression(hoister, &loop, node->as.loop.condition);
+            changes += hoistExpression(hoister, &loop, node->as.loop.increment);
+            changes += hoistStatement(hoister, &loop, node->as.loop.body);
+        }
+    }
+    freeEffects(&effects);
+    if (loop.count == 0) return changes;
+
+    Node* inner = newNode(node->type, &node->token);
+    *inner = *node;
+    node->type = NODE_BLOCK;
+    node->as.list = (NodeList){NULL, 0, 0};
+    for (int i = 0; i < loop.count; i++) appendNode(&node->as.list, loop.declarations[i]);
+    appendNode(&node->as.list, inner);
+    return changes;
+}
+
+static int licmStatement(Hoister* hoister, Node* node);
+
+static int licmList(Hoister* hoister, NodeList* list) {
+    int changes = 0;
+    for (int i = 0; i < list->count; i++) changes += licmStatement(hoister, list->items[i]);
+    return changes;
+}
+
+// Inner loops first, so an outer loop can hoist further what an inner
+// one has already hoisted.
+static int licmStatement(Hoister* hoister, Node* node) {
+    if (node == NULL) return 0;
+
+    Scope* scope = &hoister->scope;
+    int changes = 0;
+    switch (node->type) {
+        case NODE_VAR:
+            declareLocal(scope, node->token.symbol);
+            break;
+
+        case NODE_FUNCTION: {
+            declareLocal(scope, node->token.symbol);
+
+            int localCount = scope->localCount;
+            int base = scope->base;
+            int depth = scope->depth;
+            int hidden = hoister->hidden;
+            scope->base = localCount;
+            scope->depth = 1;
+            hoister->hidden = 0;
+
+            NodeList* parameters = &node->as.function.parameters;
+            for (int i = 0; i < parameters->count; i++) {
+                declareLocal(scope, parameters->items[i]->token.symbol);
+            }
+            changes += licmList(hoister, &node->as.function.body);
+
+            scope->localCount = localCount;
+            scope->base = base;
+            scope->depth = depth;
+            hoister->hidden = hidden;
+            break;
+        }
+
+        case NODE_BLOCK: {
+            int localCount = scope->localCount;
+            scope->depth++;
+            changes += licmList(hoister, &node->as.list);
+            scope->depth--;
+            scope->localCount = localCount;
+            break;
+        }
+
+        case NODE_IF:
+            changes += licmStatement(hoister, node->as.branch.thenBranch);
+            changes += licmStatement(hoister, node->as.branch.elseBranch);
+            break;
+
+        case NODE_WHILE:
+        case NODE_FOR: {
+            int localCount = scope->localCount;
+            scope->depth++;
+            changes += licmStatement(hoister, node->as.loop.initializer);
+            changes += licmStatement(hoister, node->as.loop.body);
+            scope->depth--;
+            scope->localCount = localCount;
+            changes += hoistLoop(hoister, node);
+            break;
+        }
+
+        case NODE_RANGE: {
+            int localCount = scope->localCount;
+            scope->depth++;
+            hoister->hidden += RANGE_HIDDEN_LOCALS;
+            declareLocal(scope, node->token.symbol);
+            changes += licmStatement(hoister, node->as.range.body);
+            hoister->hidden -= RANGE_HIDDEN_LOCALS;
+            scope->depth--;
+            scope->localCount = localCount;
+            changes += hoistLoop(hoister, node);
+            break;
+        }
+
+        case NODE_SWITCH:
+            hoister->hidden++;
+            for (int i = 0; i < node->as.switchStmt.cases.count; i++) {
+                changes += licmList(hoister, &node->as.switchStmt.cases.items[i]->as.caseArm.body);
+            }
+            hoister->hidden--;
+            break;
+
+        default:
+            break;
+    }
+    return changes;
+}
+
+static int licmPass(Node* program) {
+    Hoister hoister;
+    memset(&hoister, 0, sizeof(Hoister));
+    hoister.scope.program = program;
+    collectNames(&hoister.scope);
+    summarizeFunctions(&hoister);
+
+    int changes = 0;
+    for (int i = 0; i < program->as.list.count; i++) {
+        hoister.scope.statement = i;
+        changes += licmStatement(&hoister, program->as.list.items[i]);
+    }
+
+    for (int i = 0; i < hoister.functionCount; i++) freeEffects(&hoister.functions[i].effects);
+    FREE_ARRAY(FunctionEffects, hoister.functions, hoister.functionCapacity);
+    freeScope(&hoister.scope);
+    return changes;
+}
+
+// In the order they run.
+static Pass passes[] = {
+    {"fold", "evaluate operators with constant operands", foldPass, true},
+    {"inline", "inline calls to small top-level functions", inlinePass, true},
+    {"dead", "drop unreachable code and branches on constant conditions", prunePass, true},
+    {"licm", "hoist loop-invariant globals and arithmetic out of loops", licmPass, true},
+};
+
+#define PASS_COUNT ((int)(sizeof(passes) / sizeof(passes[0])))
+
+// Totals over every compile on this thread, for --pass-stats.
+typedef struct {
+    int changes;
+    double seconds;
+} PassStats;
+
+static _Thread_local PassStats passStats[PASS_COUNT];
+
+void runPasses(Node* program) {
+    for (int i = 0; i < PASS_COUNT; i++) {
+        Pass* pass = &passes[i];
+        if (!pass->enabled) continue;
+
+        clock_t start = clock();
+        passStats[i].changes += pass->run(program);
+        passStats[i].seconds += (double)(clock() - start) / CLOCKS_PER_SEC;
+    }
+}
+
+static Pass* findPass(const char* name, size_t length) {
+    for (int i = 0; i < PASS_COUNT; i++) {
+        if (strlen(passes[i].name) == length &&
+            memcmp(passes[i].name, name, length) == 0) {
+            return &passes[i];
+        }
+    }
+    return NULL;
+}
+
+bool selectPasses(const char* list) {
+    if (strcmp(list, "none") == 0) {
+        for (int i = 0; i < PASS_COUNT; i++) passes[i].enabled = false;
+        return true;
+    }
+
+    bool selected[PASS_COUNT];
+    memset(selected, 0, sizeof(selected));
+
+    const char* name = list;
+    for (;;) {
+        const char* end = strchr(name, ',');
+        size_t length = end != NULL ? (size_t)(end - name) : strlen(name);
+        Pass* pass = findPass(name, length);
+        if (pass == NULL) return false;
+        selected[pass - passes] = true;
+
+        if (end == NULL) break;
+        name = end + 1;
+    }
+
+    for (int i = 0; i < PASS_COUNT; i++) passes[i].enabled = selected[i];
+    return true;
+}
+
+uint32_t enabledPasses(void) {
+    uint32_t mask = 0;
+    for (int i = 0; i < PASS_COUNT; i++) {
+        if (passes[i].enabled) mask |= 1u << i;
+    }
+    return mask;
+}
+
+void listPasses(FILE* out) {
+    for (int i = 0; i < PASS_COUNT; i++) {
+        fprintf(out, "    %-14s %s\n", passes[i].name, passes[i].description);
+    }
+}
+
+void printPassStats(FILE* out) {
+    fprintf(out, "%-14s %8s %10s\n", "pass", "changes", "ms");
+    for (int i = 0; i < PASS_COUNT; i++) {
+        const Pass* pass = &passes[i];
+        if (!pass->enabled) {
+            fprintf(out, "%-14s %8s %10s\n", pass->name, "-", "off");
+        } else {
+            fprintf(out, "%-14s %8d %10.3f\n", pass->name, passStats[i].changes,
+                    passStats[i].seconds * 1000);
+        }
+    }
+}
@@ -0,0 +1,480 @@
+#include <stdio.h>
+
+#include "memory.h"
+#include "object.h"
+#include "peephole.h"
+
+// The chunk is decoded into one entry per instruction, with jump targets
+// held as instruction indices instead of byte offsets, so instructions
+// can be dropped without patching every jump around them. Dropped
+// instructions stay in the array, marked dead, until the chunk is encoded
+// again; a jump to a dead instruction lands on the next live one.
+//
+// All jumps are kept as OP_JUMP_LONG, OP_JUMP_FALSE_LONG or
+// OP_POP_JUMP_FALSE_LONG while decoded. Encoding picks the real opcode:
+// the short form wherever the distance fits in 16 bits, and OP_LOOP(_LONG)
+// for an unconditional jump backwards.
+//
+// The jumps making up an OP_SWITCH table are pinned: the VM indexes into
+// them, so they stay live, in place and 5 bytes long. OP_FOR_RANGE keeps
+// its slot as the operand and its loop back as the target, and always
+// has a 32-bit offset.
+
+_Thread_local PeepholeStats peepholeStats;
+
+typedef struct {
+    uint8_t op;
+    uint32_t operand;   // constant index, slot or argument count
+    int target;         // jumps and OP_FOR_RANGE only
+    int line;
+    bool live;
+    bool wide;          // jumps only, needs a 32-bit offset
+    bool pinned;        // part of a switch table
+} Instruction;
+
+typedef struct {
+    Instruction* code;
+    int count;          // index count stands for the end of the chunk
+    int* targeted;      // live jumps landing on each live instruction
+
+    // Scratch space, indexed like code.
+    int* indices;
+    int capacity;
+} Program;
+
+// Kept from one chunk to the next, as most chunks are small and many.
+static _Thread_local Program program;
+
+static void reserve(Program* program, int count) {
+    if (program->capacity >= count) return;
+
+    int capacity = program->capacity;
+    while (capacity < count) capacity = GROW_CAPACITY(capacity);
+    program->code = GROW_ARRAY(Instruction, program->code, program->capacity, capacity);
+    program->targeted = GROW_ARRAY(int, program->targeted, program->capacity, capacity);
+    program->indices = GROW_ARRAY(int, program->indices, program->capacity, capacity);
+    program->capacity = capacity;
+}
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP_LONG || op == OP_JUMP_FALSE_LONG || op == OP_POP_JUMP_FALSE_LONG;
+}
+
+// Instructions that go somewhere other than the next one.
+static bool hasTarget(uint8_t op) {
+    return isJump(op) || op == OP_FOR_RANGE;
+}
+
+static uint32_t readOperand(const uint8_t* code, int length) {
+    switch (length) {
+        case 2: return code[1];
+        case 3: return (uint32_t)((code[1] << 8) | code[2]);
+        case 4: return (uint32_t)(code[1] | (code[2] << 8) | (code[3] << 16));
+        case 5: return ((uint32_t)code[1] << 24) | (code[2] << 16) | (code[3] << 8) | code[4];
+        default: return 0;
+    }
+}
+
+static void decode(const Chunk* chunk, Program* program) {
+    reserve(program, chunk->count + 1);
+    int* indexAt = program->indices;
+    program->count = 0;
+
+    // Line runs are walked alongside the code; neither goes backwards.
+    const LineRun* line = chunk->lines;
+    const LineRun* lastLine = chunk->lines + chunk->lineCount - 1;
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t op = chunk->code[offset];
+        int length = instructionLength(op);
+        Instruction* instruction = &program->code[program->count];
+        while (line < lastLine && line[1].offset <= offset) line++;
+
+        indexAt[offset] = program->count++;
+        instruction->op = op;
+        instruction->operand = readOperand(&chunk->code[offset], length);
+        instruction->line = line->line;
+        instruction->live = true;
+        instruction->target = -1;
+        instruction->wide = false;
+        instruction->pinned = false;
+        offset += length;
+    }
+    indexAt[chunk->count] = program->count;
+
+    for (int offset = 0, i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->code[i];
+        int next = offset + instructionLength(instruction->op);
+
+        switch (instruction->op) {
+            case OP_JUMP:
+            case OP_JUMP_LONG:
+                instruction->target = indexAt[next + instruction->operand];
+                instruction->op = OP_JUMP_LONG;
+                break;
+            case OP_LOOP:
+            case OP_LOOP_LONG:
+                instruction->target = indexAt[next - instruction->operand];
+                instruction->op = OP_JUMP_LONG;
+                break;
+            case OP_JUMP_FALSE:
+            case OP_JUMP_FALSE_LONG:
+                instruction->target = indexAt[next + instruction->operand];
+                instruction->op = OP_JUMP_FALSE_LONG;
+                break;
+            case OP_POP_JUMP_FALSE:
+            case OP_POP_JUMP_FALSE_LONG:
+                instruction->target = indexAt[next + instruction->operand];
+                instruction->op = OP_POP_JUMP_FALSE_LONG;
+                break;
+            case OP_FOR_RANGE:
+                instruction->operand = chunk->code[offset + 1];
+                // Skipping the slot leaves the offset where a long jump has it.
+                instruction->target = indexAt[next - readOperand(&chunk->code[offset + 1], 5)];
+                break;
+            default:
+                break;
+        }
+        offset = next;
+    }
+
+    for (int i = 0; i < program->count; i++) {
+        if (program->code[i].op != OP_SWITCH) continue;
+
+        const ObjSwitch* table = AS_SWITCH(chunk->constants.values[program->code[i].operand]);
+        for (int j = i + 1; j <= i + 1 + table->caseCount; j++) {
+            program->code[j].pinned = true;
+            program->code[j].wide = true;
+        }
+    }
+}
+
+static int nextLive(const Program* program, int index) {
+    do {
+        index++;
+    } while (index < program->count && !program->code[index].live);
+    return index;
+}
+
+// Where a jump to index really lands.
+static int resolve(const Program* program, int index) {
+    if (index >= program->count || program->code[index].live) return index;
+    return nextLive(program, index);
+}
+
+static void countTargets(Program* program) {
+    for (int i = 0; i <= program->count; i++) program->targeted[i] = 0;
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->code[i];
+        if (instruction->live && hasTarget(instruction->op)) {
+            instruction->target = resolve(program, instruction->target);
+            program->targeted[instruction->target]++;
+        }
+        // Reached through the switch, so never dead.
+        if (instruction->pinned) program->targeted[i]++;
+    }
+}
+
+// Instructions are dropped without touching the jumps to them, so a
+// jump's target is brought up to date whenever it is looked at.
+static int targetOf(Program* program, int index) {
+    Instruction* instruction = &program->code[index];
+    instruction->target = resolve(program, instruction->target);
+    return instruction->target;
+}
+
+static void retarget(Program* program, int index, int target) {
+    Instruction* instruction = &program->code[index];
+    program->targeted[targetOf(program, index)]--;
+    instruction->target = target;
+    program->targeted[target]++;
+}
+
+// Jumps to a dropped instruction move on to the one after it.
+static void kill(Program* program, int index) {
+    Instruction* instruction = &program->code[index];
+    if (hasTarget(instruction->op)) program->targeted[targetOf(program, index)]--;
+    instruction->live = false;
+
+    int next = nextLive(program, index);
+    program->targeted[next] += program->targeted[index];
+    program->targeted[index] = 0;
+}
+
+// Instructions whose only effect is to push a value, so following them
+// with a pop is a no-op.
+static bool pushesOnly(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NONE:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_DUP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static uint8_t storeOp(uint8_t op) {
+    switch (op) {
+        case OP_SET_LOCAL: return OP_STORE_LOCAL;
+        case OP_SET_GLOBAL: return OP_STORE_GLOBAL;
+        case OP_SET_GLOBAL_LONG: return OP_STORE_GLOBAL_LONG;
+        default: return 0;
+    }
+}
+
+// A jump whose target is an unconditional jump can go straight to where
+// that one goes, and a jump-if-false landing on another jump-if-false
+// (the condition is still on the stack, unchanged) can skip it too.
+// Conditional jumps can only be encoded forwards.
+static bool threadJumps(Program* program) {
+    bool changed = false;
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->code[i];
+        if (!instruction->live || !isJump(instruction->op)) continue;
+
+        int original = targetOf(program, i);
+        int target = original;
+        for (int hops = 0; target < program->count && hops < program->count; hops++) {
+            const Instruction* next = &program->code[target];
+            if (next->op != OP_JUMP_LONG &&
+                !(instruction->op == OP_JUMP_FALSE_LONG && next->op == OP_JUMP_FALSE_LONG)) {
+                break;
+            }
+
+            int via = resolve(program, next->target);
+            if (via == target || (instruction->op != OP_JUMP_LONG && via <= i)) break;
+            target = via;
+        }
+
+        if (target != original) {
+            retarget(program, i, target);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static bool simplify(Program* program) {
+    bool changed = false;
+
+    for (int i = 0; i < program->count; i++) {
+        Instruction* instruction = &program->code[i];
+        if (!instruction->live) continue;
+
+        int next = nextLive(program, i);
+        if (instruction->op == OP_JUMP_LONG || instruction->op == OP_RETURN) {
+            // Nothing falls through from here, so whatever follows is dead
+            // up to the next instruction something jumps to.
+            while (next < program->count && program->targeted[next] == 0) {
+                kill(program, next);
+                next = nextLive(program, i);
+                changed = true;
+            }
+        }
+
+        bool popNext = next < program->count &&
+                       program->code[next].op == OP_POP &&
+                       program->targeted[next] == 0;
+
+        if (isJump(instruction->op) && !instruction->pinned && targetOf(program, i) == next) {
+            // Jumping to the next instruction.
+            if (instruction->op == OP_POP_JUMP_FALSE_LONG) {
+                program->targeted[next]--;
+                instruction->op = OP_POP;
+            } else {
+                kill(program, i);
+            }
+            changed = true;
+        } else if (popNext && storeOp(instruction->op) != 0) {
+            instruction->op = storeOp(instruction->op);
+            kill(program, next);
+            changed = true;
+        } else if (popNext && pushesOnly(instruction->op)) {
+            kill(program, next);
+            kill(program, i);
+            changed = true;
+        } else if (popNext && instruction->op == OP_JUMP_FALSE_LONG &&
+                   targetOf(program, i) < program->count &&
+                   program->code[instruction->target].op == OP_POP) {
+            // Both ways out of the jump pop the condition straight away.
+            instruction->op = OP_POP_JUMP_FALSE_LONG;
+            retarget(program, i, nextLive(program, instruction->target));
+            kill(program, next);
+            changed = true;
+        }
+    }
+
+    return changed;
+}
+
+static int encodedLength(const Instruction* instruction) {
+    if (!instruction->live) return 0;
+    if (isJump(instruction->op)) return instruction->wide ? 5 : 3;
+    return instructionLength(instruction->op);
+}
+
+static void layout(const Program* program, int* offsetOf) {
+    int offset = 0;
+    for (int i = 0; i < program->count; i++) {
+        offsetOf[i] = offset;
+        offset += encodedLength(&program->code[i]);
+    }
+    offsetOf[program->count] = offset;
+}
+
+// Distance a jump covers once encoded; negative for a jump backwards.
+static int jumpDistance(const Program* program, const int* offsetOf, int index) {
+    const Instruction* instruction = &program->code[index];
+    return offsetOf[instruction->target] - (offsetOf[index] + encodedLength(instruction));
+}
+
+// Branch relaxation: every jump starts out short and is widened if its
+// distance doesn't fit. Widening a jump only ever moves others further
+// apart, so this settles once a round widens nothing.
+static void relax(Program* program, int* offsetOf) {
+    bool widened;
+    do {
+        widened = false;
+        layout(program, offsetOf);
+        for (int i = 0; i < program->count; i++) {
+            Instruction* instruction = &program->code[i];
+            if (!instruction->live || !isJump(instruction->op) || instruction->wide) continue;
+
+            int distance = jumpDistance(program, offsetOf, i);
+            if (distance > UINT16_MAX || -distance > UINT16_MAX) {
+                instruction->wide = true;
+                widened = true;
+            }
+        }
+    } while (widened);
+}
+
+static uint8_t jumpOp(const Instruction* instruction, bool backwards) {
+    switch (instruction->op) {
+        case OP_JUMP_LONG:
+            if (backwards) return instruction->wide ? OP_LOOP_LONG : OP_LOOP;
+            return instruction->wide ? OP_JUMP_LONG : OP_JUMP;
+        case OP_JUMP_FALSE_LONG:
+            return instruction->wide ? OP_JUMP_FALSE_LONG : OP_JUMP_FALSE;
+        default:
+            return instruction->wide ? OP_POP_JUMP_FALSE_LONG : OP_POP_JUMP_FALSE;
+    }
+}
+
+static void encode(Program* program, Chunk* chunk) {
+    int* offsetOf = program->indices;
+    relax(program, offsetOf);
+    int size = offsetOf[program->count];
+
+    if (size > chunk->capacity) {
+        chunk->code = GROW_ARRAY(uint8_t, chunk->code, chunk->capacity, size);
+        chunk->capacity = size;
+    }
+
+    uint8_t* code = chunk->code;
+    chunk->lineCount = 0;
+    for (int i = 0; i < program->count; i++) {
+        const Instruction* instruction = &program->code[i];
+        if (!instruction->live) continue;
+
+        writeLine(chunk, (int)(code - chunk->code), instruction->line);
+        uint8_t op = instruction->op;
+        uint32_t operand = instruction->operand;
+        if (isJump(op)) {
+            int distance = jumpDistance(program, offsetOf, i);
+            op = jumpOp(instruction, distance < 0);
+            operand = (uint32_t)(distance < 0 ? -distance : distance);
+
+            if (instruction->wide) {
+                peepholeStats.longJumps++;
+            } else {
+                peepholeStats.shortJumps++;
+            }
+        } else if (op == OP_FOR_RANGE) {
+            // Always backwards, to the start of the loop body.
+            uint32_t distance = (uint32_t)-jumpDistance(program, offsetOf, i);
+            code[0] = op;
+            code[1] = (uint8_t)operand;
+            code[2] = (distance >> 24) & 0xff;
+            code[3] = (distance >> 16) & 0xff;
+            code[4] = (distance >> 8) & 0xff;
+            code[5] = distance & 0xff;
+            code += 6;
+            continue;
+        }
+
+        int length = instructionLength(op);
+        code[0] = op;
+        switch (length) {
+            case 2:
+                code[1] = (uint8_t)operand;
+                break;
+            case 3:
+                code[1] = (operand >> 8) & 0xff;
+                code[2] = operand & 0xff;
+                break;
+            case 4:
+                code[1] = operand & 0xff;
+                code[2] = (operand >> 8) & 0xff;
+                code[3] = (operand >> 16) & 0xff;
+                break;
+            case 5:
+                code[1] = (operand >> 24) & 0xff;
+                code[2] = (operand >> 16) & 0xff;
+                code[3] = (operand >> 8) & 0xff;
+                code[4] = operand & 0xff;
+                break;
+            default:
+                break;
+        }
+        code += length;
+    }
+    chunk->count = size;
+}
+
+void relaxChunk(Chunk* chunk) {
+    decode(chunk, &program);
+    encode(&program, chunk);
+}
+
+void optimizeChunk(Chunk* chunk) {
+    decode(chunk, &program);
+    countTargets(&program);
+
+    bool changed;
+    do {
+        changed = threadJumps(&program);
+        changed |= simplify(&program);
+    } while (changed);
+
+    int live = 0;
+    for (int i = 0; i < program.count; i++) live += program.code[i].live;
+    peepholeStats.chunks++;
+    peepholeStats.before += program.count;
+    peepholeStats.after += live;
+
+    encode(&program, chunk);
+}
+
+void freePeephole(void) {
+    FREE_ARRAY(Instruction, program.code, program.capacity);
+    FREE_ARRAY(int, program.targeted, program.capacity);
+    FREE_ARRAY(int, program.indices, program.capacity);
+    program = (Program){0};
+}
+
+void printPeepholeStats(FILE* out) {
+    fprintf(out, "peephole: %ld chunks, %ld -> %ld instructions",
+            peepholeStats.chunks, peepholeStats.before, peepholeStats.after);
+    if (peepholeStats.before > 0) {
+        fprintf(out, " (%.1f%% fewer)",
+                100.0 * (double)(peepholeStats.before - peepholeStats.after) / (double)peepholeStats.before);
+    }
+    fprintf(out, "\njumps: %ld short, %ld long\n", peepholeStats.shortJumps, peepholeStats.longJumps);
+}
@@ -1,21 +1,12 @@
 #include <stdio.h>
 #include <string.h>
-#include <stdlib.h>
 
 #include "common.h"
+#include "memory.h"
 #include "scanner.h"
 #include "compiler.h"
 
-Scanner scanner;
-
-void initScanner(const char* source) {
-    scanner.start = source;
-    scanner.current = source;
-    scanner.line = 1;
-    scanner.currentChar = 0;
-    scanner.currentString = NULL;
-    scanner.currentStringLength = 0;
-}
+_Thread_local Scanner scanner;
 
 static bool isAlpha(char c) {
     return (c >= 'a' && c <= 'z') ||
@@ -55,16 +46,11 @@ static bool match(char expected) {
 static Token makeToken(TokenType type) {
     Token token;
     token.type = type;
-    if (token.type == TOKEN_STR) {
-        token.length = scanner.currentStringLength+1;
-        token.start = scanner.currentString;
-        scanner.current--;
-    } else {
-        token.length = (int)(scanner.current - scanner.start);
-        token.start = scanner.start;
-    }
-
+    token.start = scanner.start;
+    token.length = (int)(scanner.current - scanner.start);
     token.line = scanner.line;
+    token.decoded = false;
+    token.symbol = -1;
     return token;
 }
 
@@ -74,9 +60,186 @@ static Token errorToken(const char* msg) {
     token.start = msg;
     token.length = (int)strlen(msg);
     token.line = scanner.line;
+    token.decoded = false;
+    token.symbol = -1;
     return token;
 }
 
+// Whitespace, comments, identifiers and numbers are skipped a block of
+// BLOCK_WIDTH bytes at a time: each block is turned into one bit per byte
+// for the character class being skipped and the loops below only look at
+// those bitmasks. Blocks are read from aligned addresses, so a read never
+// crosses into a page that holds no part of the source, and every class
+// excludes '\0' so the loops stop at the terminator.
+//
+// AVX2 is used when the compiler targets it (-mavx2 or -march=native),
+// SSE2 on any other x86, and a byte at a time loop everywhere else.
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#define BLOCK_WIDTH 32
+typedef __m256i Block;
+#define LOAD_BLOCK(p)       _mm256_load_si256((const __m256i*)(p))
+#define SPLAT(c)            _mm256_set1_epi8((char)(c))
+#define EQUALS(b, c)        _mm256_cmpeq_epi8((b), SPLAT(c))
+#define EITHER(x, y)        _mm256_or_si256((x), (y))
+#define AT_MOST(b, limit)   _mm256_cmpeq_epi8(_mm256_min_epu8((b), SPLAT(limit)), (b))
+#define OFFSET(b, c)        _mm256_sub_epi8((b), SPLAT(c))
+#define TO_BITS(b)          ((uint32_t)_mm256_movemask_epi8(b))
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+
+#define BLOCK_WIDTH 16
+typedef __m128i Block;
+#define LOAD_BLOCK(p)       _mm_load_si128((const __m128i*)(p))
+#define SPLAT(c)            _mm_set1_epi8((char)(c))
+#define EQUALS(b, c)        _mm_cmpeq_epi8((b), SPLAT(c))
+#define EITHER(x, y)        _mm_or_si128((x), (y))
+#define AT_MOST(b, limit)   _mm_cmpeq_epi8(_mm_min_epu8((b), SPLAT(limit)), (b))
+#define OFFSET(b, c)        _mm_sub_epi8((b), SPLAT(c))
+#define TO_BITS(b)          ((uint32_t)_mm_movemask_epi8(b))
+#endif
+
+#ifdef BLOCK_WIDTH
+#define BLOCK_MASK ((uint32_t)(((uint64_t)1 << BLOCK_WIDTH) - 1))
+#define IN_RANGE(b, low, high) AT_MOST(OFFSET((b), (low)), (high) - (low))
+
+#if defined(__GNUC__)
+#define countBits(bits) __builtin_popcount(bits)
+#define lowestBit(bits) __builtin_ctz(bits)
+#else
+static int countBits(uint32_t bits) {
+    int count = 0;
+    while (bits != 0) {
+        bits &= bits - 1;
+        count++;
+    }
+    return count;
+}
+
+static int lowestBit(uint32_t bits) {
+    int index = 0;
+    while ((bits & 1) == 0) {
+        bits >>= 1;
+        index++;
+    }
+    return index;
+}
+#endif
+
+static inline uint32_t whitespaceBits(Block block) {
+    return TO_BITS(EITHER(EITHER(EQUALS(block, ' '), EQUALS(block, '\t')),
+                          EITHER(EQUALS(block, '\r'), EQUALS(block, '\n'))));
+}
+
+static inline uint32_t digitBits(Block block) {
+    return TO_BITS(IN_RANGE(block, '0', '9'));
+}
+
+static inline uint32_t newlineBits(Block block) {
+    return TO_BITS(EQUALS(block, '\n'));
+}
+
+// Returns the block holding `from`, with *valid set to the bits of the
+// bytes in it at or after `from`.
+static inline const char* firstBlock(const char* from, uint32_t* valid) {
+    int misalignment = (int)((uintptr_t)from & (BLOCK_WIDTH - 1));
+    *valid = (BLOCK_MASK << misalignment) & BLOCK_MASK;
+    return from - misalignment;
+}
+
+// Skips a run of bytes whose class bits come from classBits(), counting
+// the newlines in it when `lines` is not NULL.
+#define SKIP_RUN(name, classBits)                                           \
+    static const char* name(const char* from, int* lines) {                 \
+        uint32_t valid;                                                     \
+        const char* block = firstBlock(from, &valid);                       \
+        for (;;) {                                                          \
+            Block chars = LOAD_BLOCK(block);                                \
+            uint32_t stop = ~classBits(chars) & valid;                      \
+            if (stop != 0) valid &= (1u << lowestBit(stop)) - 1;            \
+            if (lines != NULL) *lines += countBits(newlineBits(chars) & valid); \
+            if (stop != 0) return block + lowestBit(stop);                  \
+            block += BLOCK_WIDTH;                                           \
+            valid = BLOCK_MASK;                                             \
+        }                                                                   \
+    }
+
+SKIP_RUN(skipSpaces, whitespaceBits)
+SKIP_RUN(skipDigits, digitBits)
+
+#undef SKIP_RUN
+
+static const char* skipLineComment(const char* from) {
+    uint32_t valid;
+    const char* block = firstBlock(from, &valid);
+    for (;;) {
+        Block chars = LOAD_BLOCK(block);
+        uint32_t stop = TO_BITS(EITHER(EQUALS(chars, '\n'), EQUALS(chars, '\0'))) & valid;
+        if (stop != 0) return block + lowestBit(stop);
+        block += BLOCK_WIDTH;
+        valid = BLOCK_MASK;
+    }
+}
+
+// Returns the position just past the closing "|#", or the terminator if
+// the comment is never closed.
+static const char* skipBlockComment(const char* from, int* lines) {
+    uint32_t valid;
+    const char* block = firstBlock(from, &valid);
+    for (;;) {
+        Block chars = LOAD_BLOCK(block);
+        uint32_t newlines = newlineBits(chars);
+        uint32_t stop = TO_BITS(EITHER(EQUALS(chars, '|'), EQUALS(chars, '\0'))) & valid;
+        while (stop != 0) {
+            int index = lowestBit(stop);
+            if (block[index] == '\0' || block[index + 1] == '#') {
+                *lines += countBits(newlines & valid & ((1u << index) - 1));
+                return block[index] == '\0' ? block + index : block + index + 2;
+            }
+            stop &= stop - 1;
+        }
+        *lines += countBits(newlines & valid);
+        block += BLOCK_WIDTH;
+        valid = BLOCK_MASK;
+    }
+}
+
+#else
+
+static const char* skipSpaces(const char* from, int* lines) {
+    for (;; from++) {
+        switch (*from) {
+            case '\n': (*lines)++; break;
+            case ' ':
+            case '\r':
+            case '\t': break;
+            default: return from;
+        }
+    }
+}
+
+static const char* skipDigits(const char* from, int* lines) {
+    while (isDigit(*from)) from++;
+    return from;
+}
+
+static const char* skipLineComment(const char* from) {
+    while (*from != '\n' && *from != '\0') from++;
+    return from;
+}
+
+static const char* skipBlockComment(const char* from, int* lines) {
+    for (; *from != '\0'; from++) {
+        if (*from == '\n') (*lines)++;
+        if (from[0] == '|' && from[1] == '#') return from + 2;
+    }
+    return from;
+}
+
+#endif
+
 static void skipWhitespace(void) {
     for (;;) {
         char c = speek();
@@ -89,14 +252,14 @@ static void skipWhitespace(void) {
             case '\n':
                 scanner.line++;
                 advance();
+                // Runs of indentation and blank lines are worth a block skip.
+                scanner.current = skipSpaces(scanner.current, &scanner.line);
                 break;
             case '#':
                 if (peekNext() == '|') {
-                    while ((speek() != '|' || peekNext() != '#') && !isAtEnd()) advance();
-                    advance();
-                    advance();
+                    scanner.current = skipBlockComment(scanner.current + 2, &scanner.line);
                 } else {
-                    while (speek() != '\n' && !isAtEnd()) advance();
+                    scanner.current = skipLineComment(scanner.current);
                 }
                 break;
             default:
@@ -105,152 +268,263 @@ static void skipWhitespace(void) {
     }
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-    if ((scanner.current - scanner.start) == (start + length) &&
-        memcmp(scanner.start + start, rest, length) == 0) {
-    return type;
-  }
-
-  return TOKEN_IDENTIFIER;
+// Every distinct identifier in the source gets a small integer symbol ID,
+// assigned while it is scanned, so the compiler can compare and look up
+// names without touching their characters again. Keywords are entered
+// first, which makes keyword detection a range check on the ID.
+
+typedef struct {
+    const char* start;
+    int length;
+    uint32_t hash;
+} Symbol;
+
+typedef struct {
+    int count;
+    int capacity;
+    Symbol* symbols;
+    int bucketCount;
+    int* buckets;       // indices into symbols, -1 when empty
+} SymbolTable;
+
+typedef struct {
+    const char* name;
+    TokenType type;
+} Keyword;
+
+static const Keyword keywords[] = {
+    {"and", TOKEN_AND},         {"break", TOKEN_BREAK},
+    {"case", TOKEN_CASE},       {"class", TOKEN_CLASS},
+    {"continue", TOKEN_CONTINUE}, {"default", TOKEN_DEFAULT},
+    {"else", TOKEN_ELSE},       {"extends", TOKEN_EXTENDS},
+    {"false", TOKEN_FALSE},     {"for", TOKEN_FOR},
+    {"fwunction", TOKEN_DEF},   {"if", TOKEN_IF},
+    {"in", TOKEN_IN},           {"none", TOKEN_NONE},
+    {"or", TOKEN_OR},           {"print", TOKEN_PRINT},
+    {"return", TOKEN_RETURN},   {"super", TOKEN_SUPER},
+    {"switch", TOKEN_SWITCH},   {"this", TOKEN_THIS},
+    {"true", TOKEN_TRUE},       {"var", TOKEN_VAR},
+    {"while", TOKEN_WHILE},
+};
+
+#define KEYWORD_COUNT ((int)(sizeof(keywords) / sizeof(keywords[0])))
+
+static _Thread_local SymbolTable symbolTable = {0, 0, NULL, 0, NULL};
+
+static void growBuckets(void) {
+    int oldCount = symbolTable.bucketCount;
+    symbolTable.bucketCount = GROW_CAPACITY(oldCount) * 2;
+    symbolTable.buckets = GROW_ARRAY(int, symbolTable.buckets, oldCount, symbolTable.bucketCount);
+    for (int i = 0; i < symbolTable.bucketCount; i++) symbolTable.buckets[i] = -1;
+
+    for (int i = 0; i < symbolTable.count; i++) {
+        uint32_t index = symbolTable.symbols[i].hash & (symbolTable.bucketCount - 1);
+        while (symbolTable.buckets[index] != -1) {
+            index = (index + 1) & (symbolTable.bucketCount - 1);
+        }
+        symbolTable.buckets[index] = i;
+    }
 }
 
-static TokenType identifierType(void) {
-    switch (scanner.start[0]) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'b': return checkKeyword(1, 4, "reak", TOKEN_BREAK);
-        case 'c':
-            if ((scanner.current - scanner.start) > 1) {
-                switch (scanner.start[1]) {
-                    case 'l': return checkKeyword(2, 3, "ass", TOKEN_CLASS);
-                    case 'a': return checkKeyword(2, 2, "se", TOKEN_CASE);
-                    case 'o': return checkKeyword(2, 6, "ntinue", TOKEN_CONTINUE);
-                    default: break;
-                }
-            }
-            break;
-        case 'd': return checkKeyword(1, 6, "efault", TOKEN_DEFAULT);
-        case 'e':
-            if ((scanner.current - scanner.start) > 1) {
-                switch (scanner.start[1]) {
-                case 'l': return checkKeyword(2, 2, "se", TOKEN_ELSE);
-                case 'x': return checkKeyword(2, 5, "tends", TOKEN_EXTENDS);
-                default: break;
-                }
-            }
-            break;
-        case 'f':
-            if ((scanner.current - scanner.start) > 1) {
-                switch (scanner.start[1]) {
-                case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                case 'w': return checkKeyword(2, 7, "unction", TOKEN_DEF);
-                default: break;
-                }
-            }
-            break;
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 3, "one", TOKEN_NONE);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's':
-            if ((scanner.current - scanner.start) > 1) {
-                switch (scanner.start[1]) {
-                    case 'u': return checkKeyword(2, 3, "per", TOKEN_SUPER);
-                    case 'w': return checkKeyword(2, 4, "itch", TOKEN_SWITCH);
-                    default: break;
-                }
-            }
-            break;
-        case 't':
-            if ((scanner.current - scanner.start) > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                    default: break;
-                }
+static int internSymbol(const char* start, int length, uint32_t hash) {
+    if (symbolTable.bucketCount > 0) {
+        uint32_t index = hash & (symbolTable.bucketCount - 1);
+        for (;;) {
+            int symbol = symbolTable.buckets[index];
+            if (symbol == -1) break;
+            const Symbol* entry = &symbolTable.symbols[symbol];
+            if (entry->hash == hash && entry->length == length &&
+                memcmp(entry->start, start, length) == 0) {
+                return symbol;
             }
-            break;
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+            index = (index + 1) & (symbolTable.bucketCount - 1);
+        }
+    }
+
+    if (symbolTable.capacity < symbolTable.count + 1) {
+        int oldCapacity = symbolTable.capacity;
+        symbolTable.capacity = GROW_CAPACITY(oldCapacity);
+        symbolTable.symbols = GROW_ARRAY(Symbol, symbolTable.symbols,
+                                         oldCapacity, symbolTable.capacity);
+    }
+
+    int symbol = symbolTable.count++;
+    symbolTable.symbols[symbol].start = start;
+    symbolTable.symbols[symbol].length = length;
+    symbolTable.symbols[symbol].hash = hash;
+
+    if (symbolTable.count * 2 > symbolTable.bucketCount) {
+        growBuckets();
+    } else {
+        uint32_t index = hash & (symbolTable.bucketCount - 1);
+        while (symbolTable.buckets[index] != -1) {
+            index = (index + 1) & (symbolTable.bucketCount - 1);
+        }
+        symbolTable.buckets[index] = symbol;
+    }
+    return symbol;
+}
+
+// Symbols point into the source they were scanned from, so they only
+// live as long as one call to initScanner().
+static void resetSymbols(void) {
+    symbolTable.count = 0;
+    for (int i = 0; i < symbolTable.bucketCount; i++) symbolTable.buckets[i] = -1;
+
+    for (int i = 0; i < KEYWORD_COUNT; i++) {
+        int length = (int)strlen(keywords[i].name);
+        internSymbol(keywords[i].name, length, hashString(keywords[i].name, length));
+    }
+}
 
-        default: return TOKEN_IDENTIFIER;
+void freeSymbols(void) {
+    FREE_ARRAY(Symbol, symbolTable.symbols, symbolTable.capacity);
+    FREE_ARRAY(int, symbolTable.buckets, symbolTable.bucketCount);
+    symbolTable = (SymbolTable){0, 0, NULL, 0, NULL};
+}
+
+// A symbol of its own that no scanned identifier can ever share, for names
+// the passes make up. Its spelling is empty, which no identifier matches.
+int hiddenSymbol(void) {
+    if (symbolTable.capacity < symbolTable.count + 1) {
+        int oldCapacity = symbolTable.capacity;
+        symbolTable.capacity = GROW_CAPACITY(oldCapacity);
+        symbolTable.symbols = GROW_ARRAY(Symbol, symbolTable.symbols,
+                                         oldCapacity, symbolTable.capacity);
     }
 
-    return TOKEN_IDENTIFIER;
+    int symbol = symbolTable.count++;
+    symbolTable.symbols[symbol].start = "";
+    symbolTable.symbols[symbol].length = 0;
+    symbolTable.symbols[symbol].hash = hashString("", 0);
+    return symbol;
+}
+
+uint32_t symbolHash(int symbol) {
+    return symbolTable.symbols[symbol].hash;
+}
+
+static _Thread_local ScanProgressFn scanProgress = NULL;
+static _Thread_local const char* lastProgress = NULL;
+
+void initScanner(const char* source) {
+    initScannerAt(source, 1);
+}
+
+// Starts scanning partway into a script, at the given line of it.
+void initScannerAt(const char* source, int line) {
+    scanner.start = source;
+    scanner.current = source;
+    scanner.line = line;
+    lastProgress = source;
+    resetSymbols();
+}
+
+void setScanProgress(ScanProgressFn callback) {
+    scanProgress = callback;
 }
 
+// Hashes the identifier as it goes, with the FNV-1a step hashString()
+// uses, so the symbol table never reads it a second time.
 static Token identifier(void) {
-    while (isAlpha(speek()) || isDigit(speek())) advance();
-    return makeToken(identifierType());
+    uint32_t hash = 2166136261u;
+    const char* current = scanner.start;
+    while (isAlpha(*current) || isDigit(*current)) {
+        hash ^= *current++;
+        hash *= 16777619;
+    }
+    scanner.current = current;
+
+    int length = (int)(current - scanner.start);
+    int symbol = internSymbol(scanner.start, length, hash);
+    Token token = makeToken(symbol < KEYWORD_COUNT ? keywords[symbol].type : TOKEN_IDENTIFIER);
+    token.symbol = symbol;
+    return token;
 }
 
 static Token number(void) {
-    while (isDigit(speek())) advance();
+    scanner.current = skipDigits(scanner.current, NULL);
 
     if (speek() == '.' && isDigit(peekNext())) {
         advance();
-
-        while (isDigit(speek())) advance();
+        scanner.current = skipDigits(scanner.current, NULL);
     }
 
     return makeToken(TOKEN_NUM);
 }
 
-static char peekChar(void) {
-    scanner.currentChar++;
-    scanner.current++;
-    return scanner.current[-1];
-}
-
-static void addStringChar(char c) {
-    scanner.currentString = realloc(scanner.currentString, sizeof(char) * (scanner.currentStringLength + 2));
-    scanner.currentString[scanner.currentStringLength] = c;
-    scanner.currentStringLength++;
-}
-
-static char nextChar(void) {
-    char c = peekChar();
-    return c;
+static int escapeChar(char c) {
+    switch (c) {
+        case '"':  return '"';   // double quote
+        case '\'': return '\'';  // single quote
+        case 'n':  return '\n';  // newline
+        case 'r':  return '\r';  // carriage return
+        case 't':  return '\t';  // horizontal tab
+        case 'v':  return '\v';  // vertical tab
+        case 'f':  return '\f';  // form feed
+        case '\\': return '\\';  // backslash
+        case '0':  return '\0';  // null-terminating zero
+        case 'a':  return '\a';  // beep/bell (why???)
+        default:   return -1;
+    }
 }
 
+// Literals without escapes are handed to the compiler as a slice of the
+// source. Only literals with escapes are decoded, once, into a buffer of
+// exactly the right size that the compiler then takes ownership of.
 static Token string(void) {
-    scanner.currentStringLength = 0;
-    scanner.currentString = (char*)malloc(sizeof(char) * 1);
-    for (;;) {
-        char c = nextChar();
-        if (c == '"') break;
-        if (c != '"' && isAtEnd()) return errorToken("Unterminated string.");
-        if (c == '\n') scanner.line++;
-        if (c == '\\') {
-            switch (peekChar()) {
-                case '"':  addStringChar('"'); break;  // double quote
-                case '\'': addStringChar('\''); break; // single quote
-                case 'n':  addStringChar('\n'); break; // newline
-                case 'r':  addStringChar('\r'); break; // carriage return
-                case 't':  addStringChar('\t'); break; // horizontal tab
-                case 'v':  addStringChar('\v'); break; // vertical tab
-                case 'f':  addStringChar('\f'); break; // form feed
-                case '\\': addStringChar('\\'); break; // backslash
-                case '0':  addStringChar('\0'); break; // null-terminating zero
-                case 'a':  addStringChar('\a'); break; // beep/bell (why???)
-                default: return errorToken("Unknown escape sequence");
+    int escapes = 0;
+    while (speek() != '"' && !isAtEnd()) {
+        if (speek() == '\n') scanner.line++;
+        if (speek() == '\\') {
+            escapes++;
+            advance();
+            if (isAtEnd()) break;
+        }
+        advance();
+    }
+
+    if (isAtEnd()) return errorToken("Unterminated string.");
+    advance();
+
+    Token token = makeToken(TOKEN_STR);
+    token.start++;
+    token.length -= 2;
+    if (escapes == 0) return token;
+
+    int length = token.length - escapes;
+    char* chars = ALLOCATE(char, length + 1);
+    const char* source = token.start;
+    for (int i = 0; i < length; i++) {
+        if (*source == '\\') {
+            int c = escapeChar(source[1]);
+            if (c == -1) {
+                FREE_ARRAY(char, chars, length + 1);
+                return errorToken("Unknown escape sequence");
             }
+            chars[i] = (char)c;
+            source += 2;
         } else {
-            addStringChar(c);
+            chars[i] = *source++;
         }
     }
+    chars[length] = '\0';
 
-    scanner.currentString[scanner.currentStringLength] = '\0';
-    scanner.currentChar = 0;
-    scanner.current++;
-    return makeToken(TOKEN_STR);
+    token.start = chars;
+    token.length = length;
+    token.decoded = true;
+    return token;
 }
 
 Token scanToken(void) {
     skipWhitespace();
     scanner.start = scanner.current;
 
+    if (scanProgress != NULL && scanner.start - lastProgress >= SCAN_PROGRESS_INTERVAL) {
+        lastProgress = scanner.start;
+        scanProgress(scanner.start);
+    }
+
     if (isAtEnd()) return makeToken(TOKEN_EOF);
 
     char c = advance();
@@ -0,0 +1,365 @@
+#define _DEFAULT_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "memory.h"
+#include "server.h"
+#include "vm.h"
+
+// Longest script name and input a request may carry.
+#define NAME_MAX_LENGTH 4096
+#define INPUT_MAX_LENGTH (64 * 1024 * 1024)
+
+// How long a client gets to send its whole request, and then to take the
+// whole reply, before the worker drops it and moves on.
+#define REQUEST_TIMEOUT_MS 5000
+#define NO_DEADLINE INT64_MAX
+
+static int64_t millisecondsFromNow(int64_t milliseconds) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000 + milliseconds;
+}
+
+// Waits for fd to be ready for events, unless the deadline passes first.
+static bool waitFor(int fd, short events, int64_t deadline) {
+    if (deadline == NO_DEADLINE) return true;
+    for (;;) {
+        int64_t left = deadline - millisecondsFromNow(0);
+        if (left <= 0) return false;
+        struct pollfd target = {fd, events, 0};
+        int ready = poll(&target, 1, (int)left);
+        if (ready > 0) return true;
+        if (ready == 0 || errno != EINTR) return false;
+    }
+}
+
+static bool readAll(int fd, void* bytes, size_t length, int64_t deadline) {
+    uint8_t* at = bytes;
+    while (length > 0) {
+        if (!waitFor(fd, POLLIN, deadline)) return false;
+        ssize_t count = read(fd, at, length);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        at += count;
+        length -= (size_t)count;
+    }
+    return true;
+}
+
+static bool writeAll(int fd, struct iovec* parts, int count, int64_t deadline) {
+    while (count > 0) {
+        if (!waitFor(fd, POLLOUT, deadline)) return false;
+        ssize_t written = writev(fd, parts, count);
+        if (written < 0 && errno == EINTR) continue;
+        if (written < 0) return false;
+
+        for (; count > 0 && (size_t)written >= parts->iov_len; parts++, count--) {
+            written -= (ssize_t)parts->iov_len;
+        }
+        if (count > 0) {
+            parts->iov_base = (uint8_t*)parts->iov_base + written;
+            parts->iov_len -= (size_t)written;
+        }
+    }
+    return true;
+}
+
+// A length and that many bytes, as a heap copy.
+static char* readBlock(int fd, uint32_t* length, uint32_t maxLength, int64_t deadline) {
+    if (!readAll(fd, length, sizeof(*length), deadline) || *length > maxLength) return NULL;
+    char* chars = ALLOCATE(char, *length + 1);
+    if (!readAll(fd, chars, *length, deadline)) {
+        FREE_ARRAY(char, chars, *length + 1);
+        return NULL;
+    }
+    chars[*length] = '\0';
+    return chars;
+}
+
+static const ServedScript* findScript(const ServedScript* scripts, int count, const char* name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(scripts[i].name, name) == 0) return &scripts[i];
+    }
+    return NULL;
+}
+
+static void serveRequest(int connection, const ServedScript* scripts, int count) {
+    uint32_t nameLength;
+    uint32_t inputLength = 0;
+    int64_t deadline = millisecondsFromNow(REQUEST_TIMEOUT_MS);
+    char* name = readBlock(connection, &nameLength, NAME_MAX_LENGTH, deadline);
+    char* input =
+        name != NULL ? readBlock(connection, &inputLength, INPUT_MAX_LENGTH, deadline) : NULL;
+    if (input == NULL) {
+        if (name != NULL) FREE_ARRAY(char, name, nameLength + 1);
+        return;
+    }
+
+    BatchJob job;
+    job.input = input;
+    job.length = (int)inputLength;
+    ServerReply reply;
+    const ServedScript* script = findScript(scripts, count, name);
+    if (script == NULL) {
+        initOutput(&job.output, OUTPUT_MEMORY, 0);
+        initOutput(&job.errors, OUTPUT_MEMORY, 0);
+        printOutput(&job.errors, "Unknown script '%s'.\n", name);
+        reply.status = SERVER_UNKNOWN_SCRIPT;
+    } else {
+        runBatchJob(vm, script->function, &job);
+        reply.status = job.result == INTERPRET_OK ? 0 : 70;
+    }
+
+    reply.outputLength = (uint32_t)job.output.count;
+    reply.errorLength = (uint32_t)job.errors.count;
+    struct iovec parts[] = {
+        {&reply, sizeof(reply)},
+        {job.output.buffer, job.output.count},
+        {job.errors.buffer, job.errors.count},
+    };
+    writeAll(connection, parts, 3, millisecondsFromNow(REQUEST_TIMEOUT_MS));
+
+    freeOutput(&job.output);
+    freeOutput(&job.errors);
+    FREE_ARRAY(char, name, nameLength + 1);
+    FREE_ARRAY(char, input, inputLength + 1);
+}
+
+typedef struct {
+    int listener;
+    const ServedScript* scripts;
+    int count;
+    sigset_t signals;       // the mask to give workers
+} Server;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int signum) {
+    stopping = 1;
+}
+
+// Only there so that a worker exiting ends the wait for signals.
+static void noteChild(int signum) {}
+
+// A worker that exits this soon after starting, or can't be forked, is
+// restarted after a delay that doubles each time it happens in a row.
+#define QUICK_EXIT_MS 1000
+#define FIRST_RESTART_DELAY_MS 100
+#define LONGEST_RESTART_DELAY_MS 10000
+
+typedef struct {
+    pid_t pid;              // -1 while the slot is empty
+    int64_t started;
+    int64_t restartAt;
+    int quickExits;         // in a row
+} Worker;
+
+// The worker's pid, or -1 if it couldn't be forked.
+static pid_t startWorker(const Server* server) {
+    pid_t pid = fork();
+    if (pid != 0) return pid;
+
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGCHLD, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &server->signals, NULL);
+    for (;;) {
+        int connection = accept(server->listener, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            _exit(71);
+        }
+        serveRequest(connection, server->scripts, server->count);
+        close(connection);
+    }
+}
+
+// Clears the way to binding the address. The only thing removed is a
+// socket left behind by a server that didn't stop cleanly, which refuses
+// connections; anything else at the path is left alone and reported.
+static bool freeSocketPath(const struct sockaddr_un* address) {
+    struct stat info;
+    if (lstat(address->sun_path, &info) != 0) return true;
+    if (!S_ISSOCK(info.st_mode)) return false;
+
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe < 0) return false;
+    bool stale = connect(probe, (const struct sockaddr*)address, sizeof(*address)) != 0 &&
+                 errno == ECONNREFUSED;
+    close(probe);
+    return stale && unlink(address->sun_path) == 0;
+}
+
+// Empties the slot, to be filled again once its delay is over.
+static void restartLater(Worker* worker, int64_t now) {
+    worker->pid = -1;
+    worker->quickExits = now - worker->started < QUICK_EXIT_MS ? worker->quickExits + 1 : 0;
+    int64_t delay = 0;
+    if (worker->quickExits > 0) {
+        delay = FIRST_RESTART_DELAY_MS;
+        for (int i = 1; i < worker->quickExits && delay < LONGEST_RESTART_DELAY_MS; i++) delay *= 2;
+        if (delay > LONGEST_RESTART_DELAY_MS) delay = LONGEST_RESTART_DELAY_MS;
+    }
+    worker->restartAt = now + delay;
+}
+
+bool runServer(const ServedScript* scripts, int count, const ServerOptions* options) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(options->socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path \"%s\" is too long.\n", options->socketPath);
+        return false;
+    }
+    strcpy(address.sun_path, options->socketPath);
+
+    if (!freeSocketPath(&address)) {
+        fprintf(stderr, "Socket path \"%s\" is in use.\n", options->socketPath);
+        return false;
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+        listen(listener, SOMAXCONN) != 0) {
+        fprintf(stderr, "Could not listen on \"%s\": %s.\n", options->socketPath, strerror(errno));
+        if (listener >= 0) close(listener);
+        return false;
+    }
+
+    // Workers would each write out a copy of anything still buffered.
+    flushOutput(&vm->output);
+    signal(SIGPIPE, SIG_IGN);
+
+    // The signals that end the server or a worker are only taken while
+    // waiting for them, so none goes unnoticed.
+    Server server = {listener, scripts, count};
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &blocked, &server.signals);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    action.sa_handler = noteChild;
+    sigaction(SIGCHLD, &action, NULL);
+
+    int workerCount = options->workers;
+    if (workerCount <= 0) workerCount = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workerCount < 1) workerCount = 1;
+    Worker* workers = ALLOCATE(Worker, workerCount);
+    for (int i = 0; i < workerCount; i++) workers[i] = (Worker){-1, 0, 0, 0};
+
+    // Empty slots are filled, and any worker that exits is replaced, until
+    // the server is stopped.
+    stopping = 0;
+    while (!stopping) {
+        int64_t now = millisecondsFromNow(0);
+        pid_t pid;
+        int status;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+            for (int i = 0; i < workerCount; i++) {
+                if (workers[i].pid == pid) restartLater(&workers[i], now);
+            }
+        }
+
+        int64_t next = NO_DEADLINE;
+        for (int i = 0; i < workerCount; i++) {
+            Worker* worker = &workers[i];
+            if (worker->pid < 0 && worker->restartAt <= now) {
+                worker->started = now;
+                worker->pid = startWorker(&server);
+                if (worker->pid < 0) restartLater(worker, now);
+            }
+            if (worker->pid < 0 && worker->restartAt < next) next = worker->restartAt;
+        }
+        if (stopping) break;
+
+        if (next == NO_DEADLINE) {
+            sigsuspend(&server.signals);
+        } else {
+            int64_t delay = next - now;
+            struct timespec wait = {delay / 1000, delay % 1000 * 1000000};
+            pselect(0, NULL, NULL, NULL, &wait, &server.signals);
+        }
+    }
+
+    for (int i = 0; i < workerCount; i++) {
+        if (workers[i].pid > 0) kill(workers[i].pid, SIGTERM);
+    }
+    for (int i = 0; i < workerCount; i++) {
+        if (workers[i].pid > 0) waitpid(workers[i].pid, NULL, 0);
+    }
+    FREE_ARRAY(Worker, workers, workerCount);
+    close(listener);
+    unlink(options->socketPath);
+
+    action.sa_handler = SIG_DFL;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGCHLD, &action, NULL);
+    sigprocmask(SIG_SETMASK, &server.signals, NULL);
+    return true;
+}
+
+// Copies length bytes of the reply into a buffer.
+static bool passOn(int fd, OutputBuffer* into, uint32_t length) {
+    char chars[4096];
+    while (length > 0) {
+        size_t count = length < sizeof(chars) ? length : sizeof(chars);
+        if (!readAll(fd, chars, count, NO_DEADLINE)) return false;
+        writeOutput(into, chars, count);
+        length -= (uint32_t)count;
+    }
+    return true;
+}
+
+int sendRequest(const char* socketPath, const char* name, const char* input, int length,
+                OutputBuffer* output, OutputBuffer* errors) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) return -1;
+    strcpy(address.sun_path, socketPath);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+
+    uint32_t nameLength = (uint32_t)strlen(name);
+    uint32_t inputLength = (uint32_t)length;
+    struct iovec parts[] = {
+        {&nameLength, sizeof(nameLength)},
+        {(char*)name, nameLength},
+        {&inputLength, sizeof(inputLength)},
+        {(char*)input, inputLength},
+    };
+    ServerReply reply;
+    bool answered = writeAll(fd, parts, 4, NO_DEADLINE) &&
+                    readAll(fd, &reply, sizeof(reply), NO_DEADLINE) &&
+                    passOn(fd, output, reply.outputLength) &&
+                    passOn(fd, errors, reply.errorLength);
+    close(fd);
+    return answered ? (int)reply.status : -1;
+}
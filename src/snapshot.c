@@ -0,0 +1,358 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "image.h"
+#include "memory.h"
+#include "snapshot.h"
+#include "vm.h"
+
+// The payload of a snapshot is a list of objects, each written after every
+// object it refers to, so a reference is just the position of an object
+// that has already been rebuilt and nothing needs relocating afterwards:
+//
+//   object:  its ObjType, then its data, referring to objects by position
+//   globals: after SNAPSHOT_END, their count, then each name and value
+//
+// Positions count from 1, leaving 0 for "none". Natives are written as the
+// name they are defined under and load as the ones the VM defines itself.
+// Only objects reachable from the globals are kept; strings the script
+// made and dropped along the way aren't interned again.
+
+#define SNAPSHOT_MAGIC 0x494f574fu  // "OWOI"
+#define SNAPSHOT_END 0xff           // in place of an ObjType, after the last object
+
+typedef struct {
+    Obj* object;
+    int position;
+} ObjectSlot;
+
+typedef struct {
+    ImageWriter payload;
+    ObjectSlot* slots;      // position of each object written, by address
+    int slotCapacity;
+    int count;
+    bool ok;
+} SnapshotWriter;
+
+static uint32_t hashPointer(const Obj* object) {
+    uint64_t bits = (uint64_t)(uintptr_t)object;
+    bits = (bits ^ (bits >> 33)) * 0xff51afd7ed558ccdull;
+    return (uint32_t)(bits ^ (bits >> 33));
+}
+
+static ObjectSlot* findSlot(ObjectSlot* slots, int capacity, const Obj* object) {
+    uint32_t index = hashPointer(object) & (uint32_t)(capacity - 1);
+    while (slots[index].object != NULL && slots[index].object != object) {
+        index = (index + 1) & (uint32_t)(capacity - 1);
+    }
+    return &slots[index];
+}
+
+// Position of an object already written, or 0.
+static int positionOf(const SnapshotWriter* snapshot, const Obj* object) {
+    if (snapshot->slotCapacity == 0) return 0;
+    return findSlot(snapshot->slots, snapshot->slotCapacity, object)->position;
+}
+
+static int addObject(SnapshotWriter* snapshot, Obj* object) {
+    if ((snapshot->count + 1) * 2 > snapshot->slotCapacity) {
+        int capacity = GROW_CAPACITY(snapshot->slotCapacity);
+        ObjectSlot* slots = ALLOCATE(ObjectSlot, capacity);
+        for (int i = 0; i < capacity; i++) {
+            slots[i].object = NULL;
+            slots[i].position = 0;
+        }
+        for (int i = 0; i < snapshot->slotCapacity; i++) {
+            if (snapshot->slots[i].object != NULL) {
+                *findSlot(slots, capacity, snapshot->slots[i].object) = snapshot->slots[i];
+            }
+        }
+        FREE_ARRAY(ObjectSlot, snapshot->slots, snapshot->slotCapacity);
+        snapshot->slots = slots;
+        snapshot->slotCapacity = capacity;
+    }
+
+    ObjectSlot* slot = findSlot(snapshot->slots, snapshot->slotCapacity, object);
+    slot->object = object;
+    slot->position = ++snapshot->count;
+    return slot->position;
+}
+
+// Objects must have been written before a value refers to them.
+static void writeValue(SnapshotWriter* snapshot, Value value) {
+    ImageWriter* payload = &snapshot->payload;
+    writeImageByte(payload, (uint8_t)value.type);
+    switch (value.type) {
+        case VAL_BOOL:
+            writeImageByte(payload, AS_BOOL(value));
+            break;
+        case VAL_NUMBER:
+            writeImageBytes(payload, &AS_NUMBER(value), sizeof(double));
+            break;
+        case VAL_INTEGER:
+            writeImageVarint(payload, AS_INTEGER(value));
+            break;
+        case VAL_OBJ:
+            writeImageVarint(payload, (uint64_t)positionOf(snapshot, AS_OBJ(value)));
+            break;
+        default:
+            break;
+    }
+}
+
+static int writeObject(SnapshotWriter* snapshot, Obj* object);
+
+static void writeReferences(SnapshotWriter* snapshot, const Value* values, int count) {
+    for (int i = 0; i < count && snapshot->ok; i++) {
+        if (IS_OBJ(values[i])) writeObject(snapshot, AS_OBJ(values[i]));
+    }
+}
+
+static void writeFunction(SnapshotWriter* snapshot, ObjFunction* function) {
+    if (function->source != NULL && !compileFunction(function)) {
+        snapshot->ok = false;
+        return;
+    }
+
+    int name = function->name != NULL ? writeObject(snapshot, (Obj*)function->name) : 0;
+    const ValueArray* constants = &function->chunk.constants;
+    writeReferences(snapshot, constants->values, constants->count);
+
+    ImageWriter* payload = &snapshot->payload;
+    writeImageByte(payload, OBJ_FUNCTION);
+    writeImageVarint(payload, (uint64_t)name);
+    writeImageVarint(payload, (uint64_t)function->arity);
+    writeImageVarint(payload, (uint64_t)function->defArity);
+    writeImageChunk(payload, &function->chunk);
+    writeImageVarint(payload, (uint64_t)constants->count);
+    for (int i = 0; i < constants->count; i++) writeValue(snapshot, constants->values[i]);
+}
+
+static void writeSwitch(SnapshotWriter* snapshot, const ObjSwitch* table) {
+    Value* labels = ALLOCATE(Value, table->caseCount);
+    switchLabels(table, labels);
+    writeReferences(snapshot, labels, table->caseCount);
+
+    ImageWriter* payload = &snapshot->payload;
+    writeImageByte(payload, OBJ_SWITCH);
+    writeImageVarint(payload, (uint64_t)table->caseCount);
+    for (int i = 0; i < table->caseCount; i++) writeValue(snapshot, labels[i]);
+    FREE_ARRAY(Value, labels, table->caseCount);
+}
+
+// Writes an object, after everything it refers to, unless it already has
+// been. Returns its position.
+static int writeObject(SnapshotWriter* snapshot, Obj* object) {
+    int position = positionOf(snapshot, object);
+    if (position != 0 || !snapshot->ok) return position;
+
+    ImageWriter* payload = &snapshot->payload;
+    Value value = OBJ_VAL(object);
+    switch (object->type) {
+        case OBJ_FUNCTION:
+            writeFunction(snapshot, (ObjFunction*)object);
+            break;
+        case OBJ_NATIVE: {
+            const char* name = nativeName(((ObjNative*)object)->function);
+            if (name == NULL) {
+                snapshot->ok = false;
+                break;
+            }
+            int length = (int)strlen(name);
+            writeImageByte(payload, OBJ_NATIVE);
+            writeImageString(payload, name, length, hashString(name, length));
+            break;
+        }
+        case OBJ_STRING:
+            writeImageByte(payload, OBJ_STRING);
+            writeImageString(payload, AS_CSTRING(value), AS_STRING(value)->length, AS_STRING(value)->hash);
+            break;
+        case OBJ_STRING_VIEW:
+            // Loads as the plain string it reads as.
+            writeImageByte(payload, OBJ_STRING);
+            writeImageString(payload, stringChars(value), stringLength(value),
+                             hashStringView(AS_STRING_VIEW(value)));
+            break;
+        case OBJ_SWITCH:
+            writeSwitch(snapshot, (ObjSwitch*)object);
+            break;
+        default:
+            snapshot->ok = false;
+            break;
+    }
+    return snapshot->ok ? addObject(snapshot, object) : 0;
+}
+
+bool saveSnapshot(const char* path) {
+    SnapshotWriter snapshot;
+    initImageWriter(&snapshot.payload);
+    snapshot.slots = NULL;
+    snapshot.slotCapacity = 0;
+    snapshot.count = 0;
+    snapshot.ok = true;
+
+    const Table* globals = &vm->globals;
+    int count = 0;
+    for (int i = 0; i < globals->capacity && snapshot.ok; i++) {
+        const Entry* entry = &globals->entries[i];
+        if (IS_EMPTY(entry->key)) continue;
+        writeReferences(&snapshot, &entry->key, 1);
+        writeReferences(&snapshot, &entry->value, 1);
+        count++;
+    }
+
+    writeImageByte(&snapshot.payload, SNAPSHOT_END);
+    writeImageVarint(&snapshot.payload, (uint64_t)count);
+    for (int i = 0; i < globals->capacity; i++) {
+        const Entry* entry = &globals->entries[i];
+        if (IS_EMPTY(entry->key)) continue;
+        writeValue(&snapshot, entry->key);
+        writeValue(&snapshot, entry->value);
+    }
+
+    bool saved = snapshot.ok &&
+                 saveImage(path, SNAPSHOT_MAGIC, imageBuildKey(), &snapshot.payload);
+    FREE_ARRAY(ObjectSlot, snapshot.slots, snapshot.slotCapacity);
+    freeImageWriter(&snapshot.payload);
+    return saved;
+}
+
+typedef struct {
+    ImageReader* reader;
+    Obj** objects;          // by position - 1
+    int count;
+    int capacity;
+} SnapshotReader;
+
+static Obj* objectAt(SnapshotReader* snapshot, uint64_t position) {
+    if (position == 0 || position > (uint64_t)snapshot->count) {
+        snapshot->reader->ok = false;
+        return NULL;
+    }
+    return snapshot->objects[position - 1];
+}
+
+static Value readValue(SnapshotReader* snapshot) {
+    ImageReader* reader = snapshot->reader;
+    switch ((ValueType)readImageByte(reader)) {
+        case VAL_BOOL:
+            return BOOL_VAL(readImageByte(reader) != 0);
+        case VAL_NONE:
+            return NONE_VAL;
+        case VAL_EMPTY:
+            return EMPTY_VAL;
+        case VAL_NUMBER: {
+            double number = 0;
+            const uint8_t* bytes = readImageBytes(reader, sizeof(number));
+            if (bytes != NULL) memcpy(&number, bytes, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+        case VAL_INTEGER:
+            return INTEGER_VAL((ulong)readImageVarint(reader));
+        case VAL_OBJ: {
+            Obj* object = objectAt(snapshot, readImageVarint(reader));
+            return object != NULL ? OBJ_VAL(object) : NONE_VAL;
+        }
+        default:
+            reader->ok = false;
+            return NONE_VAL;
+    }
+}
+
+static Obj* readFunction(SnapshotReader* snapshot) {
+    ImageReader* reader = snapshot->reader;
+    ObjFunction* function = newFunction();
+    uint64_t position = readImageVarint(reader);
+    if (position != 0) {
+        Obj* name = objectAt(snapshot, position);
+        if (name == NULL || name->type != OBJ_STRING) return NULL;
+        function->name = (ObjString*)name;
+    }
+    function->arity = (int)readImageVarint(reader);
+    function->defArity = (int)readImageVarint(reader);
+
+    Chunk* chunk = &function->chunk;
+    readImageChunk(reader, chunk);
+    int constantCount = readImageCount(reader);
+    ValueArray* constants = &chunk->constants;
+    constants->values = ALLOCATE(Value, constantCount);
+    constants->capacity = constantCount;
+    for (int i = 0; i < constantCount && reader->ok; i++) {
+        constants->values[constants->count++] = readValue(snapshot);
+    }
+    return (Obj*)function;
+}
+
+static Obj* readSwitch(SnapshotReader* snapshot) {
+    int count = readImageCount(snapshot->reader);
+    Value* labels = ALLOCATE(Value, count);
+    for (int i = 0; i < count; i++) {
+        labels[i] = readValue(snapshot);
+        if (!isSwitchLabel(labels[i])) snapshot->reader->ok = false;
+    }
+    Obj* table = snapshot->reader->ok ? (Obj*)newSwitch(labels, count) : NULL;
+    FREE_ARRAY(Value, labels, count);
+    return table;
+}
+
+static Obj* readObject(SnapshotReader* snapshot, ObjType type) {
+    switch (type) {
+        case OBJ_FUNCTION:
+            return readFunction(snapshot);
+        case OBJ_NATIVE: {
+            ObjString* name = readImageString(snapshot->reader);
+            Value native;
+            if (name == NULL || !tableGet(&vm->globals, OBJ_VAL(name), &native) ||
+                !isObjType(native, OBJ_NATIVE)) {
+                return NULL;
+            }
+            return AS_OBJ(native);
+        }
+        case OBJ_STRING:
+            return (Obj*)readImageString(snapshot->reader);
+        case OBJ_SWITCH:
+            return readSwitch(snapshot);
+        default:
+            return NULL;
+    }
+}
+
+static bool readSnapshot(SnapshotReader* snapshot) {
+    ImageReader* reader = snapshot->reader;
+    for (;;) {
+        uint8_t type = readImageByte(reader);
+        if (!reader->ok) return false;
+        if (type == SNAPSHOT_END) break;
+
+        Obj* object = readObject(snapshot, (ObjType)type);
+        if (object == NULL || !reader->ok) return false;
+        if (snapshot->count == snapshot->capacity) {
+            int oldCapacity = snapshot->capacity;
+            snapshot->capacity = GROW_CAPACITY(oldCapacity);
+            snapshot->objects = GROW_ARRAY(Obj*, snapshot->objects, oldCapacity, snapshot->capacity);
+        }
+        snapshot->objects[snapshot->count++] = object;
+    }
+
+    int count = readImageCount(reader);
+    for (int i = 0; i < count && reader->ok; i++) {
+        Value name = readValue(snapshot);
+        Value value = readValue(snapshot);
+        if (!IS_STRING(name)) return false;
+        tableSet(&vm->globals, name, value);
+    }
+    return reader->ok && reader->at == reader->end;
+}
+
+bool loadSnapshot(const char* path) {
+    Image image;
+    if (!openImage(path, SNAPSHOT_MAGIC, imageBuildKey(), &image)) return false;
+
+    SnapshotReader snapshot = {&image.reader, NULL, 0, 0};
+    bool loaded = readSnapshot(&snapshot);
+    FREE_ARRAY(Obj*, snapshot.objects, snapshot.capacity);
+    closeImage(&image);
+    return loaded;
+}
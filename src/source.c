@@ -0,0 +1,158 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "scanner.h"
+#include "source.h"
+
+#define READ_CHUNK_SIZE (64 * 1024)
+
+static bool readAll(int fd, Source* source) {
+    size_t capacity = READ_CHUNK_SIZE;
+    size_t count = 0;
+    char* buffer = (char*)malloc(capacity + 1);
+    if (buffer == NULL) return false;
+
+    for (;;) {
+        if (count == capacity) {
+            capacity *= 2;
+            char* grown = (char*)realloc(buffer, capacity + 1);
+            if (grown == NULL) {
+                free(buffer);
+                return false;
+            }
+            buffer = grown;
+        }
+
+        ssize_t bytesRead = read(fd, buffer + count, capacity - count);
+        if (bytesRead == 0) break;
+        if (bytesRead < 0) {
+            if (errno == EINTR) continue;
+            free(buffer);
+            return false;
+        }
+        count += (size_t)bytesRead;
+    }
+
+    buffer[count] = '\0';
+    source->chars = buffer;
+    source->length = count;
+    source->mappedLength = 0;
+    return true;
+}
+
+#ifndef _WIN32
+// The scanner stops at a NUL, which a mapping only has past the end of the
+// file when the size is not a multiple of the page size. So reserve one
+// byte more than the file as zeroed anonymous memory and map the file over
+// the front of it; the byte after the text is then always a NUL.
+static bool mapFile(int fd, size_t size, Source* source) {
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mappedLength = (size + 1 + pageSize - 1) & ~(pageSize - 1);
+
+    char* base = mmap(NULL, mappedLength, PROT_READ,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return false;
+
+    if (size > 0 &&
+        mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, mappedLength);
+        return false;
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    source->chars = base;
+    source->length = size;
+    source->mappedLength = mappedLength;
+    return true;
+}
+#endif
+
+// "-" reads the script from stdin.
+bool openSource(const char* path, Source* source) {
+    if (strcmp(path, "-") == 0) {
+        if (readAll(0, source)) return true;
+        fprintf(stderr, "Could not read stdin.\n");
+        return false;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Could not open file \"%s\".\n", path);
+        return false;
+    }
+
+    bool loaded = false;
+#ifndef _WIN32
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+        loaded = mapFile(fd, (size_t)info.st_size, source);
+    }
+#endif
+    if (!loaded) loaded = readAll(fd, source);
+    close(fd);
+
+    if (!loaded) fprintf(stderr, "Could not read file \"%s\".\n", path);
+    return loaded;
+}
+
+static _Thread_local const Source* streamed = NULL;
+static _Thread_local const char* released = NULL;
+
+// Pages of a private, read-only file mapping can be dropped at any time and
+// are faulted back in from the file if touched again, so this only limits
+// how much of the script stays resident; anything behind the scanner that
+// is still referenced (the symbol table) keeps working.
+static void releaseScanned(const char* position) {
+#ifndef _WIN32
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    if (position - streamed->chars < SOURCE_STREAM_WINDOW) return;
+
+    uintptr_t end = (uintptr_t)(position - SOURCE_STREAM_WINDOW) & ~(uintptr_t)(pageSize - 1);
+    if (end <= (uintptr_t)released) return;
+
+    madvise((void*)released, end - (uintptr_t)released, MADV_DONTNEED);
+    released = (const char*)end;
+#endif
+}
+
+// Lets the OS reclaim the source behind the scanner as it compiles, so the
+// resident size of a huge script stays around SOURCE_STREAM_WINDOW. Only
+// mapped sources can be streamed; for buffered ones this does nothing.
+void streamSource(const Source* source) {
+    if (source->mappedLength == 0) return;
+
+    streamed = source;
+    released = source->chars;
+    setScanProgress(releaseScanned);
+}
+
+void closeSource(Source* source) {
+    if (streamed == source) {
+        setScanProgress(NULL);
+        streamed = NULL;
+    }
+
+#ifndef _WIN32
+    if (source->mappedLength > 0) {
+        munmap((void*)source->chars, source->mappedLength);
+    } else
+#endif
+    {
+        free((void*)source->chars);
+    }
+    source->chars = NULL;
+    source->length = 0;
+    source->mappedLength = 0;
+}
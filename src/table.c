@@ -44,7 +44,7 @@ bool tableGet(Table* table, Value key, Value* value) {
     if (table->count == 0) return false;
 
     const Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (IS_NONE(entry->key)) return false;
+    if (IS_EMPTY(entry->key)) return false;
 
     *value = entry->value;
     return true;
@@ -81,7 +81,7 @@ bool tableSet(Table* table, Value key, Value value) {
 
     Entry* entry = findEntry(table->entries, table->capacity, key);
     bool isNewKey = IS_EMPTY(entry->key);
-    if (isNewKey == IS_NONE(entry->value)) table->count++;
+    if (isNewKey && IS_NONE(entry->value)) table->count++;
 
     entry->key = key;
     entry->value = value;
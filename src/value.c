@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdlib.h>
 
+#include "format.h"
 #include "object.h"
 #include "memory.h"
 #include "value.h"
@@ -32,12 +33,26 @@ void freeValueArray(ValueArray* array) {
 
 void printValue(Value value) {
     switch (value.type) {
-        case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
-        case VAL_NONE: printf("none"); break;
-        case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-        case VAL_INTEGER: printf("%ld", AS_INTEGER(value)); break;
+        case VAL_BOOL:
+            if (AS_BOOL(value)) {
+                writeOutput(&vm->output, "true", 4);
+            } else {
+                writeOutput(&vm->output, "false", 5);
+            }
+            break;
+        case VAL_NONE: writeOutput(&vm->output, "none", 4); break;
+        case VAL_NUMBER: {
+            char chars[FORMAT_DOUBLE_MAX];
+            writeOutput(&vm->output, chars, formatDouble(AS_NUMBER(value), chars));
+            break;
+        }
+        case VAL_INTEGER: {
+            char chars[FORMAT_INTEGER_MAX];
+            writeOutput(&vm->output, chars, formatInteger((long)AS_INTEGER(value), chars));
+            break;
+        }
         case VAL_OBJ: printObject(value); break;
-        case VAL_EMPTY: printf("<empty>"); break;
+        case VAL_EMPTY: writeOutput(&vm->output, "<empty>", 7); break;
 
         default: break;
   }
@@ -45,10 +60,8 @@ void printValue(Value value) {
 
 bool valuesEqual(Value a, Value b) {
     if (IS_INTEGER(a) && IS_DOUBLE(b)) {
-        fprintf(stdout, "a: %f, b: %f\n", AS_NUMBER(a), AS_NUMBER(b));
         return (double)AS_INTEGER(a) == AS_NUMBER(b);
     } else if (IS_DOUBLE(a) && IS_INTEGER(b)) {
-        fprintf(stdout, "a: %f, b: %f\n", AS_NUMBER(a), AS_NUMBER(b));
         return AS_NUMBER(a) == (double)AS_INTEGER(b);
     }
 
@@ -58,7 +71,13 @@ bool valuesEqual(Value a, Value b) {
         case VAL_NONE:    return true;
         case VAL_NUMBER:  return AS_NUMBER(a) == AS_NUMBER(b);
         case VAL_INTEGER: return AS_INTEGER(a) == AS_INTEGER(b);
-        case VAL_OBJ:     return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_OBJ: {
+            if (AS_OBJ(a) == AS_OBJ(b)) return true;
+            if (!IS_STRING_VIEW(a) && !IS_STRING_VIEW(b)) return false;
+            if (!IS_STRINGLIKE(a) || !IS_STRINGLIKE(b)) return false;
+            return stringLength(a) == stringLength(b) &&
+                   memcmp(stringChars(a), stringChars(b), stringLength(a)) == 0;
+        }
         case VAL_EMPTY:   return true;
         default:          return false;
     }
@@ -88,7 +107,9 @@ uint32_t hashValue(Value value) {
         case VAL_NONE:    return 7;
         case VAL_NUMBER:  return hashDouble(AS_NUMBER(value));
         case VAL_INTEGER: return hashInt(AS_INTEGER(value));
-        case VAL_OBJ:     return AS_STRING(value)->hash;
+        case VAL_OBJ:
+            if (IS_STRING_VIEW(value)) return hashStringView(AS_STRING_VIEW(value));
+            return AS_STRING(value)->hash;
         case VAL_EMPTY:   return 0;
         default:          return 0;
     }
@@ -96,32 +117,28 @@ uint32_t hashValue(Value value) {
 
 ObjString* asString(Value value) {
     switch (value.type) {
-        case VAL_BOOL: {
-            bool v = AS_BOOL(value);
-            if (v) {
-                return copyString("true", 4);
-            } else {
-                return copyString("false", 5);
-            }
-        }
-        case VAL_NONE: return copyString("none", 4);
+        case VAL_BOOL: return AS_BOOL(value) ? vm->trueString : vm->falseString;
+        case VAL_NONE: return vm->noneString;
         case VAL_INTEGER: {
             ulong v = AS_INTEGER(value);
-            char* chars = malloc(32);
-            int length = snprintf(chars, 32, "%ld", v);
-            ObjString* str = copyString(chars, length);
-            free(chars);
-            return str;
+            if (v < INT_STRING_CACHE_SIZE && vm->intStrings[v] != NULL) {
+                return vm->intStrings[v];
+            }
+
+            char chars[FORMAT_INTEGER_MAX];
+            int length = formatInteger((long)v, chars);
+            ObjString* string = copyString(chars, length);
+            if (v < INT_STRING_CACHE_SIZE) vm->intStrings[v] = string;
+            return string;
         }
         case VAL_NUMBER: {
-            double v = AS_NUMBER(value);
-            char* chars = malloc(32);
-            int length = snprintf(chars, 32, "%g", v);
-            ObjString* str = copyString(chars, length);
-            free(chars);
-            return str;
+            char chars[FORMAT_DOUBLE_MAX];
+            int length = formatDouble(AS_NUMBER(value), chars);
+            return copyString(chars, length);
         }
-        case VAL_OBJ: return AS_STRING(value);
+        case VAL_OBJ:
+            if (IS_STRING_VIEW(value)) return materializeView(AS_STRING_VIEW(value));
+            return AS_STRING(value);
         default: runtimeError("ValueError: ", "Invalid value to asString\n"); break;
     }
     return AS_STRING(OBJ_VAL(""));
@@ -153,10 +170,11 @@ Value asBool(Value value) {
             }
         }
         case VAL_OBJ: {
-            const ObjString* str = AS_STRING(value);
-            if (strcmp(str->chars, "true") == 0) return BOOL_VAL(true);
-            if (strcmp(str->chars, "false") == 0) return BOOL_VAL(false);
-            if (str->length == 1) {
+            const char* chars = stringChars(value);
+            int length = stringLength(value);
+            if (length == 4 && memcmp(chars, "true", 4) == 0) return BOOL_VAL(true);
+            if (length == 5 && memcmp(chars, "false", 5) == 0) return BOOL_VAL(false);
+            if (length == 0) {
                 return BOOL_VAL(false);
             } else {
                 return BOOL_VAL(true);
@@ -166,3 +184,11 @@ Value asBool(Value value) {
     }
     return BOOL_VAL(false);
 }
+
+bool isFalsey(Value value) {
+    if (value.type == VAL_NUMBER) {
+        return AS_NUMBER(value) < 0 ? true : false;
+    } else {
+        return IS_NONE(value) || !AS_BOOL(asBool(value));
+    }
+}
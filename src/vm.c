@@ -1,9 +1,11 @@
+#include <math.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <time.h>
 
+#include "arith.h"
 #include "compiler.h"
 #include "memory.h"
 #include "common.h"
@@ -11,37 +13,134 @@
 #include "debug.h"
 #include "vm.h"
 
-VM vm;
+// The VM the running thread works in. Each thread starts with one of its
+// own; interpretIn() switches to another for the length of a call.
+_Thread_local VM* vm;
+static _Thread_local VM threadVM;
 
 static Value clockNative(int argCount, const Value* args) {
     return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
+static Value flushNative(int argCount, const Value* args) {
+    flushOutput(&vm->output);
+    return NONE_VAL;
+}
+
+static long sliceIndex(Value value, long length) {
+    long index;
+    if (IS_INTEGER(value)) {
+        index = (long)AS_INTEGER(value);
+    } else {
+        // Brought into range before the cast, which is undefined for NaN,
+        // infinities and anything else long can't hold. NaN counts as 0.
+        double number = AS_NUMBER(value);
+        if (isnan(number)) return 0;
+        if (number < -length) return 0;
+        if (number > length) return length;
+        index = (long)number;
+    }
+    if (index < 0) index += length;
+    if (index < 0) return 0;
+    if (index > length) return length;
+    return index;
+}
+
+// slice(string, start[, end]) follows Python's slicing rules: negative
+// indices count from the end and out of range indices are clamped.
+static Value sliceNative(int argCount, const Value* args) {
+    if (argCount < 2 || argCount > 3 || !IS_STRINGLIKE(args[0]) ||
+        !IS_NUMBER(args[1]) || (argCount == 3 && !IS_NUMBER(args[2]))) {
+        return NONE_VAL;
+    }
+
+    ObjString* parent;
+    int offset = 0;
+    if (IS_STRING_VIEW(args[0])) {
+        parent = AS_STRING_VIEW(args[0])->parent;
+        offset = AS_STRING_VIEW(args[0])->start;
+    } else {
+        parent = AS_STRING(args[0]);
+    }
+
+    long length = stringLength(args[0]);
+    long start = sliceIndex(args[1], length);
+    long end = argCount == 3 ? sliceIndex(args[2], length) : length;
+    if (end < start) end = start;
+
+    if (start == 0 && end == length && IS_STRING(args[0])) return args[0];
+    return OBJ_VAL(newStringView(parent, offset + (int)start, (int)(end - start)));
+}
+
+static Value lenNative(int argCount, const Value* args) {
+    if (argCount != 1 || !IS_STRINGLIKE(args[0])) return NONE_VAL;
+    return INTEGER_VAL((ulong)stringLength(args[0]));
+}
+
+typedef struct {
+    const char* name;
+    NativeFn function;
+} NativeDef;
+
+static const NativeDef natives[] = {
+    {"clock", clockNative},
+    {"flush", flushNative},
+    {"slice", sliceNative},
+    {"len", lenNative},
+};
+
+#define NATIVE_COUNT (int)(sizeof(natives) / sizeof(natives[0]))
+
+// The global name a native is defined under, or NULL for an unknown one.
+const char* nativeName(NativeFn function) {
+    for (int i = 0; i < NATIVE_COUNT; i++) {
+        if (natives[i].function == function) return natives[i].name;
+    }
+    return NULL;
+}
+
 static void resetStack(void) {
-    vm.stackCount = 0;
-    vm.frameCount = 0;
+    vm->stackCount = 0;
+    vm->frameCount = 0;
+}
+
+static void printFrame(int line, ObjString* name) {
+    printOutput(&vm->errors, "[line %d] in ", line);
+    if (name == NULL) {
+        printOutput(&vm->errors, "script\n");
+    } else {
+        printOutput(&vm->errors, "%s()\n", name->chars);
+    }
+}
+
+// Code inlined from another function reports that function's frame too,
+// after the frame of the call it replaced, as if it had been called.
+static void printFrames(const Chunk* chunk, int line, ObjString* name) {
+    if (line < 0) {
+        const InlinedLine* inlined = &chunk->inlined[-1 - line];
+        printFrames(chunk, inlined->caller, name);
+        printFrame(inlined->line, inlined->function);
+    } else {
+        printFrame(line, name);
+    }
 }
 
 void runtimeError(const char* errorType, const char* format, ...) {
     va_list args;
-    for (int i = 0; i <= (vm.frameCount - 1); i++) {
-        CallFrame* frame = &vm.frames[i];
+    flushOutput(&vm->output);
+    for (int i = 0; i <= (vm->frameCount - 1); i++) {
+        CallFrame* frame = &vm->frames[i];
         ObjFunction* function = frame->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ",
-                function->chunk.lines[instruction]);
-        if (function->name == NULL) {
-            fprintf(stderr, "script\n");
-        } else {
-            fprintf(stderr, "%s()\n", function->name->chars);
-        }
+        printFrames(&function->chunk, getLine(&function->chunk, (int)instruction),
+                    function->name);
     }
 
     va_start(args, format);
-    fprintf(stderr, "%s", errorType);
-    vfprintf(stderr, format, args);
+    printOutput(&vm->errors, "%s", errorType);
+    vprintOutput(&vm->errors, format, args);
     va_end(args);
-    fputs("\n", stderr);
+    printOutput(&vm->errors, "\n");
 
     resetStack();
 }
@@ -49,46 +148,116 @@ void runtimeError(const char* errorType, const char* format, ...) {
 static void defineNative(const char* name, NativeFn function) {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
     push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, vm.stack[0], vm.stack[1]);
+    tableSet(&vm->globals, vm->stack[0], vm->stack[1]);
     pop();
     pop();
 }
 
-void initVM(void) {
-    vm.stack = NULL;
-    vm.stackCapacity = 0;
+// Sets up the current VM.
+static void setUpVM(VM* parent) {
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
     resetStack();
-    vm.objects = NULL;
+    vm->objects = NULL;
+    vm->parent = parent;
+
+#ifdef DEBUG_TRACE_EXECUTION
+    initOutput(&vm->output, STDOUT_FD, 0);
+#else
+    initOutput(&vm->output, STDOUT_FD, OUTPUT_BUFFER_SIZE);
+#endif
+    initOutput(&vm->errors, STDERR_FD, 0);
+
+    initTable(&vm->globals);
+    initTable(&vm->strings);
 
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+    vm->trueString = copyString("true", 4);
+    vm->falseString = copyString("false", 5);
+    vm->noneString = copyString("none", 4);
+    for (int i = 0; i < INT_STRING_CACHE_SIZE; i++) {
+        vm->intStrings[i] = NULL;
+    }
 
-    defineNative("clock", &clockNative);
+    for (int i = 0; i < NATIVE_COUNT; i++) {
+        defineNative(natives[i].name, natives[i].function);
+    }
+}
+
+void initVM(void) {
+    vm = &threadVM;
+    setUpVM(NULL);
 }
 
 void freeVM(void) {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
+    freeOutput(&vm->output);
+    freeOutput(&vm->errors);
+    freeTable(&vm->globals);
+    freeTable(&vm->strings);
     freeObjects();
+    freeCompiler();
+    FREE_ARRAY(Value, vm->stack, vm->stackCapacity);
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+}
+
+VM* newVM(void) {
+    return newChildVM(NULL);
+}
+
+VM* newChildVM(VM* parent) {
+    VM* instance = ALLOCATE(VM, 1);
+    VM* caller = useVM(instance);
+    setUpVM(parent);
+    useVM(caller);
+    return instance;
+}
+
+VM* useVM(VM* instance) {
+    VM* caller = vm;
+    vm = instance;
+    return caller;
+}
+
+void destroyVM(VM* instance) {
+    VM* caller = useVM(instance);
+    freeVM();
+    useVM(caller);
+    FREE(VM, instance);
+}
+
+InterpretResult interpretIn(VM* instance, const char* source) {
+    VM* caller = useVM(instance);
+    InterpretResult result = interpret(source);
+    flushOutput(&vm->output);
+    resetStack();
+    useVM(caller);
+    return result;
 }
 
 void push(Value value) {
-    if (vm.stackCapacity < (vm.stackCount + 1)) {
-        int32_t oldCapacity = vm.stackCapacity;
-        vm.stackCapacity = GROW_CAPACITY(oldCapacity);
-        vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, vm.stackCapacity);
+    if (vm->stackCapacity < (vm->stackCount + 1)) {
+        int32_t oldCapacity = vm->stackCapacity;
+        uintptr_t oldStack = (uintptr_t)vm->stack;
+        vm->stackCapacity = GROW_CAPACITY(oldCapacity);
+        vm->stack = GROW_ARRAY(Value, vm->stack, oldCapacity, vm->stackCapacity);
+
+        // Call frames point into the stack, so rebase them if it moved.
+        for (int i = 0; i < vm->frameCount; i++) {
+            CallFrame* frame = &vm->frames[i];
+            frame->slots = vm->stack + ((uintptr_t)frame->slots - oldStack) / sizeof(Value);
+        }
     }
-    vm.stack[vm.stackCount] = value;
-    vm.stackCount++;
+    vm->stack[vm->stackCount] = value;
+    vm->stackCount++;
 }
 
 Value pop(void) {
-    vm.stackCount--;
-    return vm.stack[vm.stackCount];
+    vm->stackCount--;
+    return vm->stack[vm->stackCount];
 }
 
 Value peek(int32_t distance) {
-    return vm.stack[vm.stackCount - 1 - distance];
+    return vm->stack[vm->stackCount - 1 - distance];
 }
 
 static bool call(ObjFunction* function, int argCount) {
@@ -99,15 +268,24 @@ static bool call(ObjFunction* function, int argCount) {
             return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
+    if (vm->frameCount == FRAMES_MAX) {
         runtimeError("FrameError: ", "StackOverflow.");
         return false;
     }
 
-    CallFrame* frame = &vm.frames[vm.frameCount++];
+    if (function->source != NULL) {
+        // Compile errors go straight to stderr, after what was printed.
+        flushOutput(&vm->output);
+        if (!compileFunction(function)) {
+            runtimeError("SyntaxError: ", "Could not compile %s().", function->name->chars);
+            return false;
+        }
+    }
+
+    CallFrame* frame = &vm->frames[vm->frameCount++];
     frame->function = function;
     frame->ip = function->chunk.code;
-    frame->slots = &(vm.stack[(vm.stackCount - 1) - argCount]);
+    frame->slots = &(vm->stack[(vm->stackCount - 1) - argCount]);
     return true;
 }
 
@@ -118,8 +296,8 @@ static bool callValue(Value callee, int argCount) {
                 return call(AS_FUNCTION(callee), argCount);
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, &vm.stack[vm.stackCount-argCount]);
-                vm.stackCount -= argCount + 1;
+                Value result = native(argCount, &vm->stack[vm->stackCount-argCount]);
+                vm->stackCount -= argCount + 1;
                 push(result);
                 return true;
             }
@@ -130,82 +308,85 @@ static bool callValue(Value callee, int argCount) {
     return false;
 }
 
-static bool isFalsey(Value value) {
-    if (value.type == VAL_NUMBER) {
-        return AS_NUMBER(value) < 0 ? true : false;
-    } else {
-        return IS_NONE(value) || !AS_BOOL(asBool(value));
+// One step of a range loop whose counter, stop or step isn't an integer.
+// The counter advances as `counter + step` would, and the loop runs while
+// it is below the stop, or above it for a negative step.
+static bool stepRange(Value* range, bool* more) {
+    Value counter = range[0];
+    Value stop = range[1];
+    Value step = range[2];
+    if (!IS_NUMBER(counter) || !IS_NUMBER(stop) || !IS_NUMBER(step)) {
+        runtimeError("ValueError: ", "range() arguments must be numbers.");
+        return false;
     }
-}
-
-static void concatenateString(void) {
-    char const* b = asString(pop())->chars;
-    char const* a = asString(pop())->chars;
-
-    int length = (int)(strlen(a) + strlen(b));
-    char* chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a, strlen(a));
-    memcpy(chars + strlen(a), b, strlen(b));
-    chars[length] = '\0';
-
-    ObjString* result = takeString(chars, length);
-    push(OBJ_VAL(result));
-}
-
-static void multiplyString(void) {
-    ulong a = AS_INTEGER(pop());
-    const char* b = asString(pop())->chars;
-    int length = (int)(a * strlen(b));
-
-    char* chars = ALLOCATE(char, length + 1);
-
-    memcpy(chars, b, strlen(b));
-    for (ulong i = strlen(b); i <= length; i+=strlen(b)) {
-        memcpy(chars+i, b, strlen(b));
+    if (IS_INTEGER(step) ? AS_INTEGER(step) == 0 : AS_NUMBER(step) == 0) {
+        runtimeError("ValueError: ", "range() step must not be zero.");
+        return false;
     }
 
-    chars[length] = '\0';
-    ObjString* result = takeString(chars, length);
-    push(OBJ_VAL(result));
+    bool ascending = IS_INTEGER(step) || AS_NUMBER(step) > 0;
+    Value inRange;
+    OperationError error;
+    binaryOperation(ascending ? OP_LESS : OP_GREATER, counter, stop, &inRange, &error);
+    *more = AS_BOOL(inRange);
+    if (*more) {
+        range[3] = counter;
+        binaryOperation(OP_ADD, counter, step, &range[0], &error);
+    }
+    return true;
 }
 
 static InterpretResult run(void) {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
 
 #define READ_BYTE() (*frame->ip++)
 #define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
 #define READ_SHORT() (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
 #define READ_INT() (frame->ip += 4, (uint32_t)((frame->ip[-4] << 24) | (frame->ip[-3] << 16) | (frame->ip[-2] << 8) | frame->ip[-1]))
+#define READ_LONG() (frame->ip += 3, (uint32_t)(frame->ip[-3] | (frame->ip[-2] << 8) | (frame->ip[-1] << 16)))
+#define READ_LONG_CONSTANT() (frame->function->chunk.constants.values[READ_LONG()])
 #define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(valueType, op) \
+#define BINARY_OP(op) \
     do { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("ValueError: ", "Operands must be numbers."); \
+        Value result; \
+        OperationError error; \
+        if (!binaryOperation(op, peek(1), peek(0), &result, &error)) { \
+            runtimeError(error.type, "%s", error.message); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
+        vm->stackCount--; \
+        vm->stack[vm->stackCount - 1] = result; \
     } while (false)
-#define BINARY_OP_INT(op) \
+#define UNARY_OP(op) \
     do { \
-        if (!IS_INTEGER(peek(0)) || !IS_INTEGER(peek(1))) { \
-            runtimeError("ValueError: ", "Operands must be Integers."); \
+        Value result; \
+        OperationError error; \
+        if (!unaryOperation(op, peek(0), &result, &error)) { \
+            runtimeError(error.type, "%s", error.message); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        ulong b = AS_INTEGER(pop()); \
-        ulong a = AS_INTEGER(pop()); \
-        push(INTEGER_VAL(a op b)); \
-    } while (false)             //TODO: handle invalid values better
-                                //TODO: implement bitwise operations (&,|,^,!)
+        vm->stack[vm->stackCount - 1] = result; \
+    } while (false)
+// Integer-only shortcuts for the hottest operators; everything else, and
+// every error, goes through arith.c.
+#define INTEGER_FAST_PATH(op, valueType) \
+    if (IS_INTEGER(peek(0)) && IS_INTEGER(peek(1))) { \
+        ulong b = AS_INTEGER(peek(0)); \
+        ulong a = AS_INTEGER(peek(1)); \
+        vm->stackCount--; \
+        vm->stack[vm->stackCount - 1] = valueType(a op b); \
+        break; \
+    }
 
     for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
         printf("          ");
-        for (const Value* slot = vm.stack;
-             slot < (vm.stack + vm.stackCount); slot++) {
+        for (const Value* slot = vm->stack;
+             slot < (vm->stack + vm->stackCount); slot++) {
             printf("[ ");
+            flushOutput(&vm->output);
             printValue(*slot);
+            flushOutput(&vm->output);
             printf(" ]");
         }
         printf("\n");
@@ -219,6 +400,7 @@ static InterpretResult run(void) {
                 push(constant);
                 break;
             }
+            case OP_CONSTANT_LONG: push(READ_LONG_CONSTANT()); break;
             case OP_DUP: push(peek(0)); break;
             case OP_NONE: push(NONE_VAL); break;
             case OP_TRUE: push(BOOL_VAL(true)); break;
@@ -229,35 +411,53 @@ static InterpretResult run(void) {
                 frame->slots[slot] = peek(0);
                 break;
             }
+            case OP_STORE_LOCAL: {
+                uint8_t slot = READ_BYTE();
+                frame->slots[slot] = pop();
+                break;
+            }
             case OP_GET_LOCAL: {
                 uint8_t slot = READ_BYTE();
                 push(frame->slots[slot]);
                 break;
             }
-            case OP_GET_GLOBAL: {
-                pop();
-                ObjString* name = READ_STRING();
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG: {
+                Value name = frame->ip[-1] == OP_GET_GLOBAL ? READ_CONSTANT() : READ_LONG_CONSTANT();
                 Value value;
-                if(!tableGet(&vm.globals, OBJ_VAL(name), &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
+                if(!tableGet(&vm->globals, name, &value)) {
+                    runtimeError("NameError: ", "Undefined variable '%s'.", AS_CSTRING(name));
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 push(value);
                 break;
             }
-            case OP_DEF_GLOBAL: {
-                Value name = READ_CONSTANT();
-                tableSet(&vm.globals, name, peek(0));
+            case OP_DEF_GLOBAL:
+            case OP_DEF_GLOBAL_LONG: {
+                Value name = frame->ip[-1] == OP_DEF_GLOBAL ? READ_CONSTANT() : READ_LONG_CONSTANT();
+                tableSet(&vm->globals, name, peek(0));
                 pop();
                 break;
             }
-            case OP_SET_GLOBAL: {
-                ObjString* name = READ_STRING();
-                if(tableSet(&vm.globals, OBJ_VAL(name), peek(0))) {
-                    tableDelete(&vm.globals, OBJ_VAL(name));
-                    runtimeError("Undefined variable %s.", name->chars);
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG: {
+                Value name = frame->ip[-1] == OP_SET_GLOBAL ? READ_CONSTANT() : READ_LONG_CONSTANT();
+                if(tableSet(&vm->globals, name, peek(0))) {
+                    tableDelete(&vm->globals, name);
+                    runtimeError("NameError: ", "Undefined variable '%s'.", AS_CSTRING(name));
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case OP_STORE_GLOBAL:
+            case OP_STORE_GLOBAL_LONG: {
+                Value name = frame->ip[-1] == OP_STORE_GLOBAL ? READ_CONSTANT() : READ_LONG_CONSTANT();
+                if(tableSet(&vm->globals, name, peek(0))) {
+                    tableDelete(&vm->globals, name);
+                    runtimeError("NameError: ", "Undefined variable '%s'.", AS_CSTRING(name));
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                pop();
                 break;
             }
             case OP_EQUAL: {
@@ -266,66 +466,28 @@ static InterpretResult run(void) {
                 push(BOOL_VAL(valuesEqual(a, b)));
                 break;
             }
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-            case OP_ADD: {
-                if (IS_STRING(peek(1))) {
-                    concatenateString();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    if (IS_INTEGER(peek(0)) && IS_INTEGER(peek(1))) {
-                        BINARY_OP_INT(+);
-                    } else if (IS_INTEGER(peek(0))) {
-                        ulong b = AS_INTEGER(pop());
-                        double a = AS_NUMBER(pop());
-                        push(NUMBER_VAL(a+b));
-                    } else if (IS_INTEGER(peek(1))) {
-                        double b = AS_NUMBER(pop());
-                        ulong a = AS_INTEGER(pop());
-                        push(NUMBER_VAL(a+b));
-                    } else {
-                    BINARY_OP(NUMBER_VAL, +);
-                    }
-                } else {
-                    runtimeError("ValueError: ",
-                        "Operands must be two numbers or first operand must be a string.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            case OP_GREATER:
+                INTEGER_FAST_PATH(>, BOOL_VAL);
+                BINARY_OP(OP_GREATER);
                 break;
-            }
-            case OP_MULTIPLY: {
-                if  (IS_STRING(peek(1))) {
-                    multiplyString();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    BINARY_OP(NUMBER_VAL, *);
-                } else {
-                    runtimeError("ValueError: ", 
-                        "Operands must be two numbers or first operand must be a string.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
+            case OP_LESS:
+                INTEGER_FAST_PATH(<, BOOL_VAL);
+                BINARY_OP(OP_LESS);
                 break;
-            }
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
-            case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-            case OP_LEFTSHIFT: BINARY_OP_INT(<<); break;
-            case OP_RIGHTSHIFT: BINARY_OP_INT(>>); break;
-            case OP_MODULO: BINARY_OP_INT(%); break;
-            case OP_NEGATE: {
-                if(!IS_NUMBER(peek(0))) {
-                    runtimeError("ValueError: ", "Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                Value val = pop();
-                if(IS_DOUBLE(val)) {
-                    val = NUMBER_VAL(-AS_NUMBER(val));
-                } else {
-                    val = NUMBER_VAL(-(double)AS_INTEGER(val));
-                }
-                push(val);
+            case OP_ADD:
+                INTEGER_FAST_PATH(+, INTEGER_VAL);
+                BINARY_OP(OP_ADD);
                 break;
-            }
+            case OP_MULTIPLY: BINARY_OP(OP_MULTIPLY); break;
+            case OP_DIVIDE: BINARY_OP(OP_DIVIDE); break;
+            case OP_NOT: vm->stack[vm->stackCount - 1] = BOOL_VAL(isFalsey(peek(0))); break;
+            case OP_LEFTSHIFT: BINARY_OP(OP_LEFTSHIFT); break;
+            case OP_RIGHTSHIFT: BINARY_OP(OP_RIGHTSHIFT); break;
+            case OP_MODULO: BINARY_OP(OP_MODULO); break;
+            case OP_NEGATE: UNARY_OP(OP_NEGATE); break;
             case OP_PRINT: {
-                printValue(pop());   //TODO: convert to rawPrint
-                printf("\n");        // remove this
+                printValue(pop());
+                writeOutput(&vm->output, "\n", 1);
                 break;
             }
             case OP_JUMP: {
@@ -348,6 +510,16 @@ static InterpretResult run(void) {
                 if (isFalsey(peek(0))) frame->ip += offset;
                 break;
             }
+            case OP_POP_JUMP_FALSE: {
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(pop())) frame->ip += offset;
+                break;
+            }
+            case OP_POP_JUMP_FALSE_LONG: {
+                uint32_t offset = READ_INT();
+                if (isFalsey(pop())) frame->ip += offset;
+                break;
+            }
             case OP_LOOP: {
                 uint16_t offset = READ_SHORT();
                 frame->ip -= offset;
@@ -358,25 +530,51 @@ static InterpretResult run(void) {
                 frame->ip -= offset;
                 break;
             }
+            case OP_SWITCH: {
+                // Lands on the jump for the selected case.
+                ObjSwitch* table = AS_SWITCH(READ_LONG_CONSTANT());
+                frame->ip += switchCase(table, peek(0)) * instructionLength(OP_JUMP_LONG);
+                break;
+            }
+            case OP_FOR_RANGE: {
+                // The counter, stop and step are three hidden locals, and
+                // the loop variable is the local after them.
+                Value* range = &frame->slots[READ_BYTE()];
+                uint32_t offset = READ_INT();
+                if (IS_INTEGER(range[0]) && IS_INTEGER(range[1]) &&
+                    IS_INTEGER(range[2]) && AS_INTEGER(range[2]) != 0) {
+                    if (AS_INTEGER(range[0]) < AS_INTEGER(range[1])) {
+                        range[3] = range[0];
+                        AS_INTEGER(range[0]) += AS_INTEGER(range[2]);
+                        frame->ip -= offset;
+                    }
+                    break;
+                }
+
+                bool more;
+                if (!stepRange(range, &more)) return INTERPRET_RUNTIME_ERROR;
+                if (more) frame->ip -= offset;
+                break;
+            }
             case OP_CALL: {
                 int argCount = READ_BYTE();
                 if (!callValue(peek(argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
+                frame = &vm->frames[vm->frameCount - 1];
                 break;
             }
             case OP_RETURN: {
                 Value result = pop();
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
+                vm->frameCount--;
+                if (vm->frameCount == 0) {
                     pop();
                     return INTERPRET_OK;
                 }
 
-                vm.stack[vm.stackCount] = *frame->slots;
+                vm->stackCount = (int)(frame->slots - vm->stack);
                 push(result);
-                frame = &vm.frames[vm.frameCount - 1];
+                frame = &vm->frames[vm->frameCount - 1];
                 break;
             }
             default:
@@ -388,17 +586,24 @@ static InterpretResult run(void) {
 #undef READ_CONSTANT
 #undef READ_SHORT
 #undef READ_INT
+#undef READ_LONG
+#undef READ_LONG_CONSTANT
 #undef READ_STRING
 #undef BINARY_OP
-#undef BINARY_OP_INT
+#undef UNARY_OP
+#undef INTEGER_FAST_PATH
 }
 
 InterpretResult interpret(const char* source) {
     ObjFunction* function = compile(source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return interpretFunction(function);
+}
 
+// Runs a script that has already been compiled.
+InterpretResult interpretFunction(ObjFunction* function) {
     push(OBJ_VAL(function));
-    call(function, 0);
+    if (!call(function, 0)) return INTERPRET_RUNTIME_ERROR;
 
     return run();
 }